@@ -29,25 +29,230 @@
 #include <bsd/string.h>
 #endif
 
+#include <pthread.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <sys/types.h>
 #include <sys/queue.h>
 #include "s3xml.h"
 
 #define S3_SECRET_LENGTH 128
 #define S3_ID_LENGTH 128
+#define S3_MAX_IDLE_HANDLES 8
+#define S3_ETAG_LENGTH 64
+
+#define S3_IO_CHUNK_SIZE (64 * 1024)
+
+#define S3_RANGE_SIZE (8 * 1024 * 1024)
+#define S3_RANGE_RETRIES 3
+
+#define S3_RETRY_ATTEMPTS 3
+#define S3_RETRY_BASE_DELAY_MS 100
+#define S3_RETRY_MAX_DELAY_MS 20000
+#define S3_HEDGE_MIN_DELAY_MS 10
+
+#define S3_ERROR_CODE_LENGTH 48
+#define S3_CONTENT_TYPE_LENGTH 128
+
+#define S3_MULTIPART_MIN_PART_SIZE (5 * 1024 * 1024)
+#define S3_MULTIPART_MAX_PARTS 10000
+
+#define S3_DELETE_MAX_KEYS 1000
+
+#define S3_LIST_PREFETCH 2
+#define S3_LIST_PARALLEL_PREFETCH 4 /* per range */
 
 struct s3_string {
 	char *ptr;
 	size_t len;
 	size_t uploaded;
+	size_t cap;	/* bytes allocated at ptr */
+};
+
+
+/* Outcome of a request */
+struct s3_result {
+	long status;	/* HTTP status, 0 if no response was received */
+	int error;	/* CURLcode, 0 on success */
+	char code[S3_ERROR_CODE_LENGTH];	/* S3 error code such as "SlowDown", if any */
+	int attempts;	/* requests made, retries included */
+};
+
+#define S3_RESULT_OK(r) ((r)->error == 0 && (r)->status >= 200 && (r)->status < 300)
+
+/*
+ * Upload callback: fill up to len bytes of ptr and return how many were
+ * written, 0 at end of data or S3_READ_ABORT to fail the request.
+ */
+typedef size_t (*s3_read_func)(void *ptr, size_t len, void *arg);
+#define S3_READ_ABORT ((size_t)-1)
+
+/*
+ * Download callback: consume len bytes of ptr and return len, or
+ * anything else to fail the request.
+ */
+typedef size_t (*s3_write_func)(const void *ptr, size_t len, void *arg);
+
+enum s3_checksum_type {
+	S3_CHECKSUM_NONE,
+	S3_CHECKSUM_CRC32C,
+	S3_CHECKSUM_CRC64NVME
+};
+
+/* Running checksum; start with s3_checksum_init */
+struct s3_checksum {
+	enum s3_checksum_type type;
+	uint64_t crc;
+};
+
+#define S3_CHECKSUM_LENGTH 16 /* base64 CRC64 and NUL */
+
+/* s3_result.error when a download didn't match its x-amz-checksum */
+#define S3_ERROR_CHECKSUM (-1)
+
+/*
+ * Failed requests that may succeed if repeated (5xx, throttling, resets,
+ * timeouts) are retried up to max_attempts in all. Before retry n the
+ * request waits a random time between 0 and base_delay_ms * 2^(n-1),
+ * capped at max_delay_ms.
+ */
+struct s3_retry_policy {
+	int max_attempts;	/* 1 disables retries */
+	int base_delay_ms;
+	int max_delay_ms;
+};
+
+/*
+ * A GET still waiting for its first byte after the given percentile of
+ * recent GETs' first-byte times is sent again on a second connection,
+ * and whichever answers first is used.
+ */
+struct s3_hedge_policy {
+	int percentile;		/* e.g. 95; 0 disables hedging */
+	int min_delay_ms;	/* never hedge sooner than this */
+};
+
+/*
+ * What curl measured of one request attempt, passed to the context's
+ * metrics_cb as the attempt finishes. Times are from the start of the
+ * attempt, as curl reports them; the connection phases are 0 on a
+ * reused connection, and tls_us without TLS.
+ */
+struct s3_request_metrics {
+	const char *method;
+	const char *resource;	/* "/bucket/key" */
+	long status;		/* 0 if no response */
+	int error;		/* CURLcode */
+	int attempt;		/* 1 for the first, more for retries */
+	uint64_t dns_us;
+	uint64_t connect_us;
+	uint64_t tls_us;
+	uint64_t ttfb_us;	/* first byte of the response */
+	uint64_t total_us;
+	uint64_t bytes_up;	/* request body */
+	uint64_t bytes_down;	/* response body */
+};
+
+typedef void (*s3_metrics_func)(const struct s3_request_metrics *m, void *arg);
+
+enum s3_metrics_method {
+	S3_METRICS_GET,
+	S3_METRICS_PUT,
+	S3_METRICS_HEAD,
+	S3_METRICS_DELETE,
+	S3_METRICS_POST,
+	S3_METRICS_METHODS
+};
+
+/* Latency histogram upper bounds: 1ms, 2.5ms, 5ms ... 10s, and +Inf */
+#define S3_METRICS_BUCKETS 14
+
+/* Totals of the request attempts made with one HTTP method */
+struct s3_method_metrics {
+	uint64_t requests;	/* retries included */
+	uint64_t retries;
+	uint64_t failures;	/* no response at all */
+	uint64_t status_4xx;
+	uint64_t status_5xx;
+	uint64_t bytes_up;
+	uint64_t bytes_down;
+	uint64_t total_us;	/* sum of the attempts' total times */
+	uint64_t latency[S3_METRICS_BUCKETS];	/* attempts by total time, not cumulative */
 };
 
+struct s3_metrics {
+	struct s3_method_metrics methods[S3_METRICS_METHODS];
+};
+
+/*
+ * Event loop integration: a batch created with s3_batch_new_loop() tells
+ * the application which sockets to watch and when to call back, instead
+ * of waiting on them itself.
+ */
+#define S3_POLL_IN 1
+#define S3_POLL_OUT 2
+#define S3_POLL_REMOVE 4	/* stop watching fd */
+
+typedef void (*s3_socket_func)(int fd, int events, void *arg);
+typedef void (*s3_timer_func)(long timeout_ms, void *arg);	/* -1 cancels */
+typedef void (*s3_done_func)(const struct s3_result *result, void *arg);
+
+/* Counters of an object cache, see s3_cache_new() */
+struct s3_cache_stats {
+	uint64_t hits;		/* served from memory without a request */
+	uint64_t disk_hits;	/* served from the cache directory without a request */
+	uint64_t revalidations;	/* stale, and confirmed unchanged by a 304 */
+	uint64_t misses;	/* fetched in full, or failed */
+	uint64_t evictions;	/* pushed out of memory to make room */
+	uint64_t disk_evictions;	/* files removed to keep the directory in bounds */
+	size_t entries;		/* in memory now */
+	size_t bytes;
+	size_t disk_bytes;	/* of files in the directory, as last counted */
+};
+
+/* Counters of a listing cache, see s3_list_cache_new() */
+struct s3_list_cache_stats {
+	uint64_t hits;		/* served without a request */
+	uint64_t negative_hits;	/* served empty, or as a missing bucket */
+	uint64_t misses;	/* listed from S3 */
+	uint64_t invalidations;	/* dropped by a write through the context */
+	size_t entries;
+};
+
+struct s3_thread;
+struct s3_cache;
+struct s3_list_cache;
+struct s3_batch;
+struct s3_signer;
+struct s3_hedger;
 
 struct S3 {
 	char *secret;
 	char *id;
 	char *base_url;
 	char *proxy;
+	char *region; /* sign with SigV4 for this region if set, else SigV2 */
+	int chunked_uploads; /* with SigV4, sign PUT bodies chunk by chunk instead of Content-MD5 */
+	enum s3_checksum_type checksum; /* sent with PUTs and checked on GETs */
+	struct s3_signer *signer;
+	struct s3_retry_policy retry;
+	struct s3_hedge_policy hedge;
+	struct s3_hedger *hedger;
+	struct s3_cache *cache; /* s3_get reads through it if set; freed with the context */
+	struct s3_list_cache *list_cache; /* likewise for s3_list_bucket */
+	s3_metrics_func metrics_cb; /* called after every request attempt, if set */
+	void *metrics_arg;
+
+	/*
+	 * Idle CURL handles kept around for connection reuse, by each
+	 * thread using the context for itself
+	 */
+	pthread_key_t thread_key;
+	pthread_mutex_t lock;	/* guards threads and metrics_exited */
+	SLIST_HEAD(, s3_thread) threads;
+	struct s3_metrics metrics_exited; /* totals of threads that have exited */
+	size_t max_idle_handles; /* per thread, 0 disables reuse */
 };
 
 struct s3_bucket_entry {
@@ -55,29 +260,167 @@ struct s3_bucket_entry {
 	char *lastmod; /* time_t */
 	size_t size;
 	char *etag;
+	int is_prefix; /* a CommonPrefixes entry; only key is set */
 	TAILQ_ENTRY(s3_bucket_entry) list;
 };
 
 TAILQ_HEAD(s3_bucket_entry_head, s3_bucket_entry);
 
+/* A key s3_delete_many() couldn't delete */
+struct s3_delete_error {
+	char *key;
+	char code[S3_ERROR_CODE_LENGTH];	/* e.g. "AccessDenied" */
+	char *message;				/* may be NULL */
+	TAILQ_ENTRY(s3_delete_error) list;
+};
+
+TAILQ_HEAD(s3_delete_error_head, s3_delete_error);
+
+/* User metadata, sent and returned as x-amz-meta-<name> headers */
+struct s3_meta {
+	char *name;	/* without the x-amz-meta- prefix */
+	char *value;
+	TAILQ_ENTRY(s3_meta) list;
+};
+
+TAILQ_HEAD(s3_meta_head, s3_meta);
+
+/* What s3_head() found out about an object; release with s3_object_info_clear */
+struct s3_object_info {
+	size_t content_length;
+	char etag[S3_ETAG_LENGTH];	/* quotes included */
+	time_t last_modified;		/* -1 if not known */
+	char content_type[S3_CONTENT_TYPE_LENGTH];
+	struct s3_meta_head meta;
+};
+
+struct s3_list_options {
+	const char *prefix;
+	const char *delimiter;
+	const char *start_after; /* marker, or start-after for ListObjectsV2 */
+	int max_keys; /* keys per page, 0 for the server default */
+	int v2; /* use ListObjectsV2 and continuation tokens */
+	int prefetch; /* most pages held at once, 0 for the default */
+};
+
+/*
+ * Compact listing: entries in one array, keys packed NUL-terminated
+ * into a single arena and addressed by offset.
+ */
+struct s3_object {
+	size_t key; /* offset of the key in the arena */
+	size_t key_len;
+	uint64_t size;
+	time_t lastmod;
+	unsigned char etag[16]; /* MD5, or hash of part MD5s if etag_parts > 0 */
+	int etag_parts; /* parts of a multipart upload, -1 if the ETag isn't hex */
+	int is_prefix;
+};
+
+struct s3_listing {
+	struct s3_object *objects;
+	size_t count;
+	char *arena;
+	size_t arena_len;
+	size_t objects_cap;
+	size_t arena_cap;
+	int error; /* an entry couldn't be stored */
+};
+
+#define s3_listing_key(l, i) ((l)->arena + (l)->objects[(i)].key)
+
+struct s3_list_iter;
+struct s3_list_parallel;
+
 struct S3 * s3_init(const char *id, const char *secret, const char *base_url);
 void s3_free(struct S3 *s3);
 
 struct s3_string * s3_string_init(void);
+int s3_string_reserve(struct s3_string *s, size_t extra);
 size_t s3_string_curl_writefunc(void *ptr, size_t len, size_t nmemb, struct s3_string *s);
 size_t s3_string_curl_readfunc(void *ptr, size_t len, size_t nmemb, struct s3_string *s);
 void s3_string_free(struct s3_string *str);
 
 char * s3_hmac_sign(const char *key, const char *str, size_t len);
 char * s3_md5_sum(const char *content, size_t len);
+char * s3_md5_sum_fd(int fd, off_t offset, size_t len);
+int s3_md5_hex_fd(int fd, off_t offset, size_t len, char *hex);
+int s3_etag_fd(int fd, size_t len, size_t part_size, char *etag);
+
+struct s3_result s3_get(struct S3 *s3, const char *bucket, const char *key, struct s3_string *out);
+struct s3_result s3_get_fd(struct S3 *s3, const char *bucket, const char *key, int fd);
+struct s3_result s3_get_buffer(struct S3 *s3, const char *bucket, const char *key, char *buf, size_t size, size_t *len);
+struct s3_result s3_get_cb(struct S3 *s3, const char *bucket, const char *key, s3_write_func write, void *arg);
+int s3_get_parallel(struct S3 *s3, const char *bucket, const char *key, int fd, size_t range_size, int parallelism);
+struct s3_result s3_delete(struct S3 *s3, const char *bucket, const char *key);
+struct s3_delete_error_head * s3_delete_many(struct S3 *s3, const char *bucket, const char * const *keys, size_t nkeys, int quiet, int parallelism);
+void s3_delete_errors_free(struct s3_delete_error_head *errors);
+struct s3_result s3_put(struct S3 *s3, const char *bucket, const char *key, const char *content_type, const char *data, size_t len);
+struct s3_result s3_put_fd(struct S3 *s3, const char *bucket, const char *key, const char *content_type, int fd, size_t len);
+struct s3_result s3_put_cb(struct S3 *s3, const char *bucket, const char *key, const char *content_type, s3_read_func read, void *arg, size_t len);
+int s3_result_retryable(const struct s3_result *r);
 
-void s3_get(struct S3 *s3, const char *bucket, const char *key, struct s3_string *out);
-void s3_delete(struct S3 *s3, const char *bucket, const char *key);
-void s3_put(struct S3 *s3, const char *bucket, const char *key, const char *content_type, const char *data, size_t len);
+struct s3_result s3_head(struct S3 *s3, const char *bucket, const char *key, struct s3_object_info *info);
+int s3_head_many(struct S3 *s3, const char *bucket, const char * const *keys, size_t nkeys, struct s3_object_info *infos, struct s3_result *results, int parallelism);
+const char * s3_object_info_meta(const struct s3_object_info *info, const char *name);
+void s3_object_info_clear(struct s3_object_info *info);
+
+struct s3_cache * s3_cache_new(size_t max_bytes, int ttl_ms, const char *dir, size_t max_disk_bytes);
+void s3_cache_stats(struct s3_cache *c, struct s3_cache_stats *st);
+void s3_cache_invalidate(struct S3 *s3, const char *bucket, const char *key);
+void s3_cache_free(struct s3_cache *c);
+
+int s3_put_multipart(struct S3 *s3, const char *bucket, const char *key, const char *content_type, const char *data, size_t len, size_t part_size, int parallelism);
+int s3_put_multipart_fd(struct S3 *s3, const char *bucket, const char *key, const char *content_type, int fd, size_t len, size_t part_size, int parallelism);
+
+uint32_t s3_crc32c(uint32_t crc, const void *data, size_t len);
+uint64_t s3_crc64nvme(uint64_t crc, const void *data, size_t len);
+void s3_checksum_init(struct s3_checksum *ck, enum s3_checksum_type type);
+void s3_checksum_update(struct s3_checksum *ck, const void *data, size_t len);
+void s3_checksum_base64(const struct s3_checksum *ck, char *out);
+
+void s3_metrics(struct S3 *s3, struct s3_metrics *m);
+void s3_metrics_prometheus(const struct s3_metrics *m, struct s3_string *out);
+
+struct s3_batch * s3_batch_new(struct S3 *s3, int max_connections);
+void s3_batch_get(struct s3_batch *b, const char *bucket, const char *key, struct s3_string *out, struct s3_result *result);
+void s3_batch_put(struct s3_batch *b, const char *bucket, const char *key, const char *content_type, const char *data, size_t len, struct s3_result *result);
+void s3_batch_delete(struct s3_batch *b, const char *bucket, const char *key, struct s3_result *result);
+void s3_batch_head(struct s3_batch *b, const char *bucket, const char *key, struct s3_result *result);
+void s3_batch_head_info(struct s3_batch *b, const char *bucket, const char *key, struct s3_object_info *info, struct s3_result *result);
+int s3_batch_wait(struct s3_batch *b);
+void s3_batch_free(struct s3_batch *b);
+
+struct s3_batch * s3_batch_new_loop(struct S3 *s3, int max_connections, s3_socket_func sock, s3_timer_func timer, void *arg);
+void s3_batch_socket(struct s3_batch *b, int fd, int events);
+void s3_batch_timeout(struct s3_batch *b);
+int s3_batch_pending(struct s3_batch *b);
+void s3_async_get(struct s3_batch *b, const char *bucket, const char *key, struct s3_string *out, s3_done_func done, void *arg);
+void s3_async_get_cb(struct s3_batch *b, const char *bucket, const char *key, s3_write_func write, void *warg, s3_done_func done, void *arg);
+void s3_async_put(struct s3_batch *b, const char *bucket, const char *key, const char *content_type, const char *data, size_t len, s3_done_func done, void *arg);
+void s3_async_delete(struct s3_batch *b, const char *bucket, const char *key, s3_done_func done, void *arg);
+void s3_async_head(struct s3_batch *b, const char *bucket, const char *key, s3_done_func done, void *arg);
 
 void s3_bucket_entry_free(struct s3_bucket_entry *entry);
 void s3_bucket_entries_free(struct s3_bucket_entry_head *entries);
 
 struct s3_bucket_entry_head * s3_list_bucket(struct S3 *s3, const char *bucket, const char *prefix);
 
+struct s3_list_cache * s3_list_cache_new(int ttl_ms, int negative_ttl_ms, size_t max_entries);
+void s3_list_cache_stats(struct s3_list_cache *lc, struct s3_list_cache_stats *st);
+void s3_list_cache_free(struct s3_list_cache *lc);
+
+struct s3_listing * s3_list_compact(struct S3 *s3, const char *bucket, const struct s3_list_options *opts);
+void s3_listing_free(struct s3_listing *l);
+
+struct s3_list_iter * s3_list_iter_new(struct S3 *s3, const char *bucket, const struct s3_list_options *opts);
+struct s3_bucket_entry * s3_list_iter_next(struct s3_list_iter *it);
+int s3_list_iter_error(struct s3_list_iter *it);
+void s3_list_iter_free(struct s3_list_iter *it);
+
+struct s3_list_parallel * s3_list_parallel_new(struct S3 *s3, const char *bucket, const struct s3_list_options *opts, int parallelism);
+struct s3_bucket_entry * s3_list_parallel_next(struct s3_list_parallel *lp);
+int s3_list_parallel_error(struct s3_list_parallel *lp);
+void s3_list_parallel_free(struct s3_list_parallel *lp);
+
 #endif /* _S3_H */
@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2014, Ian Delahorne <ian.delahorne@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Scratch memory for building requests. An arena hands out memory from
+ * one buffer by bumping an offset and releases it all at once. When the
+ * buffer runs out, blocks are taken from malloc and freed on reset; an
+ * arena that owns its buffer then grows it to what was asked for, so
+ * after the first few requests nothing is allocated any more.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "s3.h"
+#include "s3internal.h"
+
+#define S3_ARENA_ALIGN sizeof (void *)
+
+struct s3_arena_block {
+	struct s3_arena_block *next;
+	char data[];
+};
+
+/* Use size bytes at buf, or a malloc'd buffer the arena owns if buf is NULL */
+void
+s3_arena_init(struct s3_arena *a, char *buf, size_t size) {
+	a->owned = buf == NULL;
+	a->buf = buf ? buf : malloc(size);
+	a->size = size;
+	a->used = 0;
+	a->wanted = 0;
+	a->overflow = NULL;
+}
+
+static void
+s3_arena_free_overflow(struct s3_arena *a) {
+	struct s3_arena_block *b;
+
+	while ((b = a->overflow) != NULL) {
+		a->overflow = b->next;
+		free(b);
+	}
+}
+
+/* Release everything handed out since the last reset */
+void
+s3_arena_reset(struct s3_arena *a) {
+	if (a->overflow) {
+		s3_arena_free_overflow(a);
+		if (a->owned) {
+			free(a->buf);
+			a->size = a->wanted + a->wanted / 2;
+			a->buf = malloc(a->size);
+		}
+	}
+	a->used = 0;
+	a->wanted = 0;
+}
+
+void
+s3_arena_release(struct s3_arena *a) {
+	s3_arena_free_overflow(a);
+	if (a->owned)
+		free(a->buf);
+	a->buf = NULL;
+	a->size = a->used = a->wanted = 0;
+}
+
+void *
+s3_arena_alloc(struct s3_arena *a, size_t len) {
+	struct s3_arena_block *b;
+	size_t off = (a->used + S3_ARENA_ALIGN - 1) & ~(S3_ARENA_ALIGN - 1);
+
+	a->wanted += len + S3_ARENA_ALIGN;
+	if (off <= a->size && len <= a->size - off) {
+		a->used = off + len;
+		return a->buf + off;
+	}
+
+	b = malloc(sizeof (struct s3_arena_block) + len);
+	b->next = a->overflow;
+	a->overflow = b;
+
+	return b->data;
+}
+
+char *
+s3_arena_strdup(struct s3_arena *a, const char *s) {
+	size_t len = strlen(s) + 1;
+
+	return memcpy(s3_arena_alloc(a, len), s, len);
+}
+
+/* Format into the arena, in place when it fits the free space */
+char *
+s3_arena_vprintf(struct s3_arena *a, const char *fmt, va_list ap) {
+	size_t off = (a->used + S3_ARENA_ALIGN - 1) & ~(S3_ARENA_ALIGN - 1);
+	size_t avail = off < a->size ? a->size - off : 0;
+	va_list ap2;
+	char *p;
+	int n;
+
+	va_copy(ap2, ap);
+	n = vsnprintf(avail ? a->buf + off : NULL, avail, fmt, ap2);
+	va_end(ap2);
+
+	if ((size_t)n < avail) {
+		a->used = off + n + 1;
+		a->wanted += n + 1 + S3_ARENA_ALIGN;
+		return a->buf + off;
+	}
+
+	p = s3_arena_alloc(a, n + 1);
+	vsnprintf(p, n + 1, fmt, ap);
+
+	return p;
+}
+
+char *
+s3_arena_printf(struct s3_arena *a, const char *fmt, ...) {
+	va_list ap;
+	char *p;
+
+	va_start(ap, fmt);
+	p = s3_arena_vprintf(a, fmt, ap);
+	va_end(ap);
+
+	return p;
+}
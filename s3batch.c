@@ -0,0 +1,553 @@
+/*
+ * Copyright (c) 2014, Ian Delahorne <ian.delahorne@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+
+#include <curl/curl.h>
+
+#include "s3.h"
+#include "s3internal.h"
+
+/*
+ * A batch runs queued operations concurrently over a curl multi handle.
+ * Only max_connections operations hold an easy handle at any time; the
+ * rest wait in the queue, so submitting thousands of operations costs
+ * no more than the s3_op structures themselves. Operations being
+ * retried wait out their backoff in a list of their own and go ahead
+ * of the queue once it has passed.
+ *
+ * A batch is either driven by s3_batch_wait(), which blocks, or - when
+ * made with s3_batch_new_loop() - by the application's event loop,
+ * which is told which sockets to watch and when to time out and calls
+ * back into the batch when they fire.
+ */
+struct s3_batch {
+	struct S3 *s3;
+	CURLM *multi;
+	int max_connections;
+	int nqueued;
+	int nrunning;
+	int nretrying;
+	int failed;
+	TAILQ_HEAD(, s3_op) queue;
+	TAILQ_HEAD(, s3_op) running;
+	TAILQ_HEAD(, s3_op) retrying;
+
+	/* Set when an event loop drives the batch */
+	s3_socket_func sock;
+	s3_timer_func timer;
+	void *loop_arg;
+	uint64_t curl_due;	/* curl's next timeout on s3_now_ms(), 0 if none */
+	uint64_t armed;		/* when the application's timer fires, 0 if unset */
+};
+
+struct s3_batch *
+s3_batch_new(struct S3 *s3, int max_connections) {
+	struct s3_batch *b = malloc(sizeof (struct s3_batch));
+
+	if (max_connections < 1)
+		max_connections = 1;
+
+	b->s3 = s3;
+	b->multi = curl_multi_init();
+	b->max_connections = max_connections;
+	b->nqueued = 0;
+	b->nrunning = 0;
+	b->nretrying = 0;
+	b->failed = 0;
+	b->sock = NULL;
+	b->timer = NULL;
+	b->loop_arg = NULL;
+	b->curl_due = 0;
+	b->armed = 0;
+	TAILQ_INIT(&b->queue);
+	TAILQ_INIT(&b->running);
+	TAILQ_INIT(&b->retrying);
+
+	curl_multi_setopt(b->multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)max_connections);
+
+	return b;
+}
+
+static void s3_batch_arm(struct s3_batch *b);
+
+void
+s3_batch_add(struct s3_batch *b, struct s3_op *op) {
+	TAILQ_INSERT_TAIL(&b->queue, op, entry);
+	b->nqueued++;
+
+	/* Started from the loop's next timeout rather than from in here */
+	if (b->timer)
+		s3_batch_arm(b);
+}
+
+static void
+s3_batch_run(struct s3_batch *b, struct s3_op *op) {
+	s3_op_setup(op);
+	curl_multi_add_handle(b->multi, op->handle->curl);
+
+	TAILQ_INSERT_TAIL(&b->running, op, entry);
+	b->nrunning++;
+}
+
+static void
+s3_batch_start(struct s3_batch *b) {
+	struct s3_op *op, *next;
+	uint64_t now;
+
+	if (b->nretrying > 0) {
+		now = s3_now_ms();
+		for (op = TAILQ_FIRST(&b->retrying); op != NULL && b->nrunning < b->max_connections; op = next) {
+			next = TAILQ_NEXT(op, entry);
+			if (op->not_before > now)
+				continue;
+			TAILQ_REMOVE(&b->retrying, op, entry);
+			b->nretrying--;
+			s3_batch_run(b, op);
+		}
+	}
+
+	while (b->nrunning < b->max_connections && (op = TAILQ_FIRST(&b->queue)) != NULL) {
+		TAILQ_REMOVE(&b->queue, op, entry);
+		b->nqueued--;
+		s3_batch_run(b, op);
+	}
+}
+
+/* ms until the first retry is due, or -1 if none are waiting */
+static int
+s3_batch_next_retry(struct s3_batch *b) {
+	struct s3_op *op;
+	uint64_t now = s3_now_ms(), first = UINT64_MAX;
+
+	TAILQ_FOREACH(op, &b->retrying, entry)
+		if (op->not_before < first)
+			first = op->not_before;
+
+	if (first == UINT64_MAX)
+		return -1;
+	return first > now ? (int)(first - now) : 0;
+}
+
+static void
+s3_batch_complete(struct s3_batch *b, struct s3_op *op, CURLcode code) {
+	int delay;
+
+	TAILQ_REMOVE(&b->running, op, entry);
+	b->nrunning--;
+
+	curl_multi_remove_handle(b->multi, op->handle->curl);
+	s3_op_finish(op, code);
+
+	if ((delay = s3_op_retry(op)) >= 0) {
+		op->not_before = s3_now_ms() + delay;
+		TAILQ_INSERT_TAIL(&b->retrying, op, entry);
+		b->nretrying++;
+		return;
+	}
+
+	if (!S3_RESULT_OK(&op->result))
+		b->failed++;
+	if (op->result_out)
+		*op->result_out = op->result;
+
+	/* May queue follow-up operations on this batch */
+	if (op->done)
+		op->done(op, op->arg);
+	if (op->on_result)
+		op->on_result(&op->result, op->on_result_arg);
+
+	s3_op_free(op);
+	free(op);
+}
+
+/* Complete the operations curl has finished with */
+static void
+s3_batch_reap(struct s3_batch *b) {
+	struct s3_op *op;
+	CURLMsg *msg;
+	CURLcode code;
+	int left;
+
+	while ((msg = curl_multi_info_read(b->multi, &left)) != NULL) {
+		if (msg->msg != CURLMSG_DONE)
+			continue;
+		code = msg->data.result;
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&op);
+		s3_batch_complete(b, op, code);
+	}
+}
+
+/*
+ * Make progress on the batch, waiting up to timeout_ms for socket
+ * activity. Returns the number of operations not yet completed.
+ */
+int
+s3_batch_step(struct s3_batch *b, int timeout_ms) {
+	int still, retry;
+
+	s3_batch_start(b);
+	curl_multi_perform(b->multi, &still);
+	s3_batch_reap(b);
+
+	s3_batch_start(b);
+	if (timeout_ms > 0) {
+		if ((retry = s3_batch_next_retry(b)) >= 0 && retry < timeout_ms)
+			timeout_ms = retry;
+		if (b->nrunning > 0)
+			curl_multi_wait(b->multi, NULL, 0, timeout_ms, NULL);
+		else if (retry >= 0)
+			s3_sleep_ms(timeout_ms);
+	}
+
+	return b->nrunning + b->nqueued + b->nretrying;
+}
+
+/*
+ * Run until every submitted operation has completed. Returns the number
+ * of operations that failed since the last wait.
+ */
+int
+s3_batch_wait(struct s3_batch *b) {
+	int failed;
+
+	while (s3_batch_step(b, 1000) > 0)
+		;
+
+	failed = b->failed;
+	b->failed = 0;
+
+	return failed;
+}
+
+int
+s3_batch_pending(struct s3_batch *b) {
+	return b->nrunning + b->nqueued + b->nretrying;
+}
+
+static int
+s3_batch_socketfunc(CURL *curl, curl_socket_t fd, int what, void *arg, void *sockp) {
+	struct s3_batch *b = arg;
+	int events = 0;
+
+	switch (what) {
+	case CURL_POLL_IN:
+		events = S3_POLL_IN;
+		break;
+	case CURL_POLL_OUT:
+		events = S3_POLL_OUT;
+		break;
+	case CURL_POLL_INOUT:
+		events = S3_POLL_IN | S3_POLL_OUT;
+		break;
+	case CURL_POLL_REMOVE:
+		events = S3_POLL_REMOVE;
+		break;
+	}
+	b->sock(fd, events, b->loop_arg);
+
+	return 0;
+}
+
+/* curl may not be driven from inside this, so just note the deadline */
+static int
+s3_batch_timerfunc(CURLM *multi, long timeout_ms, void *arg) {
+	struct s3_batch *b = arg;
+
+	b->curl_due = timeout_ms < 0 ? 0 : s3_now_ms() + timeout_ms;
+	s3_batch_arm(b);
+
+	return 0;
+}
+
+/*
+ * Point the application's timer at whatever comes first: curl's own
+ * timeout, a retry whose backoff has passed or, with a connection
+ * free, the queue. The timer is one-shot and only reset when that
+ * changes.
+ */
+static void
+s3_batch_arm(struct s3_batch *b) {
+	uint64_t now = s3_now_ms(), due = b->curl_due;
+	int retry;
+
+	if (b->nrunning < b->max_connections) {
+		if (b->nqueued > 0)
+			due = now;
+		else if ((retry = s3_batch_next_retry(b)) >= 0 && (due == 0 || now + retry < due))
+			due = now + retry;
+	}
+
+	if (due == b->armed && (due == 0 || due > now))
+		return;
+	b->armed = due;
+	b->timer(due == 0 ? -1 : due > now ? (long)(due - now) : 0, b->loop_arg);
+}
+
+/*
+ * A batch driven by an event loop. sock is called whenever a socket
+ * should be watched for other events or no longer at all, and timer
+ * with how long to wait before calling s3_batch_timeout(). Neither may
+ * call back into the batch; s3_batch_socket() and s3_batch_timeout()
+ * are called from the loop instead and never block.
+ */
+struct s3_batch *
+s3_batch_new_loop(struct S3 *s3, int max_connections, s3_socket_func sock, s3_timer_func timer, void *arg) {
+	struct s3_batch *b = s3_batch_new(s3, max_connections);
+
+	b->sock = sock;
+	b->timer = timer;
+	b->loop_arg = arg;
+
+	curl_multi_setopt(b->multi, CURLMOPT_SOCKETFUNCTION, s3_batch_socketfunc);
+	curl_multi_setopt(b->multi, CURLMOPT_SOCKETDATA, b);
+	curl_multi_setopt(b->multi, CURLMOPT_TIMERFUNCTION, s3_batch_timerfunc);
+	curl_multi_setopt(b->multi, CURLMOPT_TIMERDATA, b);
+
+	return b;
+}
+
+/* fd is ready for events (S3_POLL_IN and/or S3_POLL_OUT) */
+void
+s3_batch_socket(struct s3_batch *b, int fd, int events) {
+	int flags = 0, still;
+
+	if (events & S3_POLL_IN)
+		flags |= CURL_CSELECT_IN;
+	if (events & S3_POLL_OUT)
+		flags |= CURL_CSELECT_OUT;
+
+	curl_multi_socket_action(b->multi, fd, flags, &still);
+	s3_batch_reap(b);
+	s3_batch_start(b);
+	s3_batch_arm(b);
+}
+
+/* The timer last asked for has expired */
+void
+s3_batch_timeout(struct s3_batch *b) {
+	int still;
+
+	b->armed = 0;
+	if (b->curl_due != 0 && b->curl_due <= s3_now_ms()) {
+		/* curl sets the next one, if any, while handling this */
+		b->curl_due = 0;
+		curl_multi_socket_action(b->multi, CURL_SOCKET_TIMEOUT, 0, &still);
+		s3_batch_reap(b);
+	}
+	s3_batch_start(b);
+	s3_batch_arm(b);
+}
+
+void
+s3_batch_free(struct s3_batch *b) {
+	struct s3_op *op;
+
+	while ((op = TAILQ_FIRST(&b->running)) != NULL)
+		s3_batch_complete(b, op, CURLE_ABORTED_BY_CALLBACK);
+
+	while ((op = TAILQ_FIRST(&b->retrying)) != NULL) {
+		TAILQ_REMOVE(&b->retrying, op, entry);
+		TAILQ_INSERT_TAIL(&b->queue, op, entry);
+	}
+	while ((op = TAILQ_FIRST(&b->queue)) != NULL) {
+		TAILQ_REMOVE(&b->queue, op, entry);
+		op->result.error = CURLE_ABORTED_BY_CALLBACK;
+		if (op->result_out)
+			*op->result_out = op->result;
+		if (op->on_result)
+			op->on_result(&op->result, op->on_result_arg);
+		s3_op_free(op);
+		free(op);
+	}
+
+	curl_multi_cleanup(b->multi);
+	free(b);
+}
+
+static struct s3_op *
+s3_batch_op(struct s3_batch *b, const char *method, const char *bucket, const char *key, struct s3_result *result) {
+	struct s3_op *op = malloc(sizeof (struct s3_op));
+
+	s3_op_init(op, b->s3, method, bucket, key, NULL, NULL);
+	op->result_out = result;
+
+	return op;
+}
+
+void
+s3_batch_get(struct s3_batch *b, const char *bucket, const char *key, struct s3_string *out, struct s3_result *result) {
+	struct s3_op *op = s3_batch_op(b, "GET", bucket, key, result);
+
+	op->out = s3_sink_init_string(&op->out_store, out);
+	s3_batch_add(b, op);
+}
+
+void
+s3_batch_put(struct s3_batch *b, const char *bucket, const char *key, const char *content_type, const char *data, size_t len, struct s3_result *result) {
+	struct s3_op *op = s3_batch_op(b, "PUT", bucket, key, result);
+
+	s3_op_set_source(op, content_type, s3_source_init_buffer(&op->in_store, data, len));
+	s3_batch_add(b, op);
+}
+
+void
+s3_batch_delete(struct s3_batch *b, const char *bucket, const char *key, struct s3_result *result) {
+	s3_batch_add(b, s3_batch_op(b, "DELETE", bucket, key, result));
+}
+
+void
+s3_batch_head(struct s3_batch *b, const char *bucket, const char *key, struct s3_result *result) {
+	s3_batch_add(b, s3_batch_op(b, "HEAD", bucket, key, result));
+}
+
+/* As s3_batch_head, filling in info as s3_head() does */
+void
+s3_batch_head_info(struct s3_batch *b, const char *bucket, const char *key, struct s3_object_info *info, struct s3_result *result) {
+	struct s3_op *op = s3_batch_op(b, "HEAD", bucket, key, result);
+
+	if (info)
+		s3_object_info_init(info);
+	op->info = info;
+	s3_batch_add(b, op);
+}
+
+struct s3_head_many {
+	struct s3_batch *batch;
+	const char *bucket;
+	const char * const *keys;
+	size_t nkeys;
+	size_t next;
+	struct s3_object_info *infos;
+	struct s3_result *results;
+};
+
+static void s3_head_many_queue(struct s3_head_many *hm);
+
+static void
+s3_head_many_done(struct s3_op *op, void *arg) {
+	struct s3_head_many *hm = arg;
+
+	if (hm->next < hm->nkeys)
+		s3_head_many_queue(hm);
+}
+
+static void
+s3_head_many_queue(struct s3_head_many *hm) {
+	size_t i = hm->next++;
+	struct s3_op *op = s3_batch_op(hm->batch, "HEAD", hm->bucket, hm->keys[i], &hm->results[i]);
+
+	if (hm->infos) {
+		s3_object_info_init(&hm->infos[i]);
+		op->info = &hm->infos[i];
+	}
+	op->done = s3_head_many_done;
+	op->arg = hm;
+	s3_batch_add(hm->batch, op);
+}
+
+/*
+ * HEAD nkeys keys of bucket over up to parallelism connections, each
+ * queued as an earlier one completes. results[i] (and infos[i], unless
+ * infos is NULL) receive what s3_head() would for keys[i]. Returns how
+ * many of the keys exist.
+ */
+int
+s3_head_many(struct S3 *s3, const char *bucket, const char * const *keys, size_t nkeys, struct s3_object_info *infos, struct s3_result *results, int parallelism) {
+	struct s3_head_many hm;
+	size_t i;
+	int found = 0;
+
+	if (parallelism < 1)
+		parallelism = 1;
+
+	memset(&hm, 0, sizeof (hm));
+	hm.bucket = bucket;
+	hm.keys = keys;
+	hm.nkeys = nkeys;
+	hm.infos = infos;
+	hm.results = results;
+
+	hm.batch = s3_batch_new(s3, parallelism);
+	for (i = 0; i < (size_t)parallelism && hm.next < nkeys; i++)
+		s3_head_many_queue(&hm);
+	s3_batch_wait(hm.batch);
+	s3_batch_free(hm.batch);
+
+	for (i = 0; i < nkeys; i++)
+		if (S3_RESULT_OK(&results[i]))
+			found++;
+
+	return found;
+}
+
+/*
+ * Start an operation on b and call done with its result once it has
+ * completed, retries included, or been abandoned by s3_batch_free().
+ * Buffers passed in must stay valid until then.
+ */
+static struct s3_op *
+s3_async_op(struct s3_batch *b, const char *method, const char *bucket, const char *key, s3_done_func done, void *arg) {
+	struct s3_op *op = s3_batch_op(b, method, bucket, key, NULL);
+
+	op->on_result = done;
+	op->on_result_arg = arg;
+
+	return op;
+}
+
+void
+s3_async_get(struct s3_batch *b, const char *bucket, const char *key, struct s3_string *out, s3_done_func done, void *arg) {
+	struct s3_op *op = s3_async_op(b, "GET", bucket, key, done, arg);
+
+	op->out = s3_sink_init_string(&op->out_store, out);
+	s3_batch_add(b, op);
+}
+
+/* The body is passed to write as it arrives, from inside s3_batch_socket() */
+void
+s3_async_get_cb(struct s3_batch *b, const char *bucket, const char *key, s3_write_func write, void *warg, s3_done_func done, void *arg) {
+	struct s3_op *op = s3_async_op(b, "GET", bucket, key, done, arg);
+
+	op->out = s3_sink_init_callback(&op->out_store, write, warg);
+	s3_batch_add(b, op);
+}
+
+void
+s3_async_put(struct s3_batch *b, const char *bucket, const char *key, const char *content_type, const char *data, size_t len, s3_done_func done, void *arg) {
+	struct s3_op *op = s3_async_op(b, "PUT", bucket, key, done, arg);
+
+	s3_op_set_source(op, content_type, s3_source_init_buffer(&op->in_store, data, len));
+	s3_batch_add(b, op);
+}
+
+void
+s3_async_delete(struct s3_batch *b, const char *bucket, const char *key, s3_done_func done, void *arg) {
+	s3_batch_add(b, s3_async_op(b, "DELETE", bucket, key, done, arg));
+}
+
+void
+s3_async_head(struct s3_batch *b, const char *bucket, const char *key, s3_done_func done, void *arg) {
+	s3_batch_add(b, s3_async_op(b, "HEAD", bucket, key, done, arg));
+}
@@ -0,0 +1,590 @@
+/*
+ * Copyright (c) 2014, Ian Delahorne <ian.delahorne@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * s3bench - throughput and latency of S3 workloads against a local
+ * s3mock (or any proxy that speaks S3).
+ *
+ * Each workload runs a number of operations over -c threads sharing
+ * one context, timing every operation, and reports operations and
+ * megabytes per second with the 50th, 99th and 99.9th percentile
+ * latency. The client modes compare ways of issuing the same GET.
+ */
+
+#include "s3.h"
+
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_MULTIPART_SIZE (2 * S3_MULTIPART_MIN_PART_SIZE)
+
+struct stats {
+	double *lat;		/* seconds per operation, NULL if not timed */
+	int n;
+	int failed;
+	size_t bytes;
+	double elapsed;
+};
+
+struct bench {
+	struct S3 *s3;
+	const char *bucket;
+	char *data;
+	size_t size;
+	char *mp_data;		/* BENCH_MULTIPART_SIZE bytes */
+	int concurrency;
+};
+
+/* One operation of a workload; adds what it transferred to *bytes */
+typedef int (*bench_op)(struct bench *b, int i, size_t *bytes);
+
+struct runner {
+	struct bench *b;
+	bench_op op;
+	int n;
+	int next;		/* next operation to claim */
+	pthread_mutex_t lock;
+	struct stats st;
+};
+
+static double
+now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+double_cmp(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Nearest rank; lat must be sorted */
+static double
+percentile(const double *lat, int n, double q) {
+	int i = (int)(q * n + 0.5) - 1;
+
+	return lat[i < 0 ? 0 : i >= n ? n - 1 : i];
+}
+
+static void
+report(const char *name, struct stats *st) {
+	printf("%-24s %7d ops %9.1f ops/s %8.2f MB/s", name, st->n,
+	    st->n / st->elapsed, st->bytes / st->elapsed / (1024 * 1024));
+	if (st->lat && st->n > 0) {
+		qsort(st->lat, st->n, sizeof (double), double_cmp);
+		printf("  p50 %7.3f  p99 %7.3f  p999 %7.3f ms",
+		    percentile(st->lat, st->n, 0.5) * 1e3,
+		    percentile(st->lat, st->n, 0.99) * 1e3,
+		    percentile(st->lat, st->n, 0.999) * 1e3);
+	}
+	printf("  %d failed\n", st->failed);
+}
+
+static void *
+runner_run(void *arg) {
+	struct runner *r = arg;
+	size_t bytes = 0;
+	double start;
+	int i, failed = 0;
+
+	while ((i = __sync_fetch_and_add(&r->next, 1)) < r->n) {
+		start = now();
+		if (r->op(r->b, i, &bytes) < 0)
+			failed++;
+		r->st.lat[i] = now() - start;
+	}
+
+	pthread_mutex_lock(&r->lock);
+	r->st.failed += failed;
+	r->st.bytes += bytes;
+	pthread_mutex_unlock(&r->lock);
+
+	return NULL;
+}
+
+/* Run n operations over nthreads threads and report them as name */
+static void
+run(struct bench *b, const char *name, bench_op op, int n, int nthreads) {
+	struct runner r;
+	pthread_t *tids;
+	double start;
+	int i;
+
+	if (nthreads > n)
+		nthreads = n > 0 ? n : 1;
+
+	memset(&r, 0, sizeof (r));
+	r.b = b;
+	r.op = op;
+	r.n = n;
+	r.st.n = n;
+	r.st.lat = calloc(n ? n : 1, sizeof (double));
+	pthread_mutex_init(&r.lock, NULL);
+	tids = calloc(nthreads, sizeof (pthread_t));
+
+	start = now();
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&tids[i], NULL, runner_run, &r);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(tids[i], NULL);
+	r.st.elapsed = now() - start;
+
+	report(name, &r.st);
+
+	pthread_mutex_destroy(&r.lock);
+	free(r.st.lat);
+	free(tids);
+}
+
+static void
+bench_key(char *buf, size_t len, int i) {
+	snprintf(buf, len, "bench/%08d", i);
+}
+
+static int
+op_put(struct bench *b, int i, size_t *bytes) {
+	struct s3_result r;
+	char key[32];
+
+	bench_key(key, sizeof (key), i);
+	r = s3_put(b->s3, b->bucket, key, "application/octet-stream", b->data, b->size);
+	if (!S3_RESULT_OK(&r))
+		return -1;
+	*bytes += b->size;
+	return 0;
+}
+
+static int
+op_get(struct bench *b, int i, size_t *bytes) {
+	struct s3_string *out = s3_string_init();
+	struct s3_result r;
+	char key[32];
+
+	bench_key(key, sizeof (key), i);
+	r = s3_get(b->s3, b->bucket, key, out);
+	*bytes += out->len;
+	s3_string_free(out);
+
+	return S3_RESULT_OK(&r) ? 0 : -1;
+}
+
+/* GET of the one shared object, for the client modes */
+static int
+op_get_shared(struct bench *b, int i, size_t *bytes) {
+	struct s3_string *out = s3_string_init();
+	struct s3_result r;
+
+	r = s3_get(b->s3, b->bucket, "bench.dat", out);
+	*bytes += out->len;
+	s3_string_free(out);
+
+	return S3_RESULT_OK(&r) ? 0 : -1;
+}
+
+/* Every page of the keys the put workload left */
+static int
+op_list(struct bench *b, int i, size_t *bytes) {
+	struct s3_bucket_entry_head *entries;
+
+	if ((entries = s3_list_bucket(b->s3, b->bucket, "bench/")) == NULL)
+		return -1;
+	s3_bucket_entries_free(entries);
+	return 0;
+}
+
+/* The same number of keys again, spread over eight "directories" */
+static void
+bench_tree_key(char *buf, size_t len, int i) {
+	snprintf(buf, len, "bench-tree/%d/%08d", i % 8, i);
+}
+
+static int
+op_put_tree(struct bench *b, int i, size_t *bytes) {
+	struct s3_result r;
+	char key[40];
+
+	bench_tree_key(key, sizeof (key), i);
+	r = s3_put(b->s3, b->bucket, key, "application/octet-stream", "x", 1);
+
+	return S3_RESULT_OK(&r) ? 0 : -1;
+}
+
+static int
+op_delete_tree(struct bench *b, int i, size_t *bytes) {
+	struct s3_result r;
+	char key[40];
+
+	bench_tree_key(key, sizeof (key), i);
+	r = s3_delete(b->s3, b->bucket, key);
+
+	return S3_RESULT_OK(&r) ? 0 : -1;
+}
+
+static int
+op_delete(struct bench *b, int i, size_t *bytes) {
+	struct s3_result r;
+	char key[32];
+
+	bench_key(key, sizeof (key), i);
+	r = s3_delete(b->s3, b->bucket, key);
+
+	return S3_RESULT_OK(&r) ? 0 : -1;
+}
+
+static int
+op_multipart(struct bench *b, int i, size_t *bytes) {
+	char key[32];
+	int rc;
+
+	snprintf(key, sizeof (key), "bench-mp/%08d", i);
+	rc = s3_put_multipart(b->s3, b->bucket, key, "application/octet-stream",
+	    b->mp_data, BENCH_MULTIPART_SIZE, S3_MULTIPART_MIN_PART_SIZE, 2);
+	if (rc == 0)
+		*bytes += BENCH_MULTIPART_SIZE;
+	s3_delete(b->s3, b->bucket, key);
+
+	return rc;
+}
+
+static void
+bench_batch_get(struct S3 *s3, const char *bucket, const char *name, int n, int concurrency, size_t size) {
+	struct s3_batch *b;
+	struct s3_string **out;
+	struct stats st;
+	double start;
+	int i;
+
+	out = calloc(n, sizeof (*out));
+	memset(&st, 0, sizeof (st));
+	st.n = n;
+
+	start = now();
+	b = s3_batch_new(s3, concurrency);
+	for (i = 0; i < n; i++) {
+		out[i] = s3_string_init();
+		s3_batch_get(b, bucket, "bench.dat", out[i], NULL);
+	}
+	st.failed = s3_batch_wait(b);
+	s3_batch_free(b);
+	st.elapsed = now() - start;
+
+	for (i = 0; i < n; i++) {
+		st.bytes += out[i]->len;
+		s3_string_free(out[i]);
+	}
+	free(out);
+
+	report(name, &st);
+}
+
+/*
+ * Enumerate every key under prefix, with one iterator if parallelism is
+ * 0 or else that many ranges at once. Each key counts as an operation.
+ */
+static void
+bench_list(struct bench *b, const char *name, const char *prefix, int parallelism) {
+	struct s3_list_options opts;
+	struct s3_list_iter *it = NULL;
+	struct s3_list_parallel *lp = NULL;
+	struct s3_bucket_entry *e;
+	struct stats st;
+	double start;
+
+	memset(&opts, 0, sizeof (opts));
+	opts.prefix = prefix;
+	memset(&st, 0, sizeof (st));
+
+	start = now();
+	if (parallelism > 0)
+		lp = s3_list_parallel_new(b->s3, b->bucket, &opts, parallelism);
+	else
+		it = s3_list_iter_new(b->s3, b->bucket, &opts);
+
+	while ((e = lp ? s3_list_parallel_next(lp) : it ? s3_list_iter_next(it) : NULL) != NULL) {
+		st.n++;
+		s3_bucket_entry_free(e);
+	}
+
+	if (lp) {
+		st.failed = s3_list_parallel_error(lp) != 0;
+		s3_list_parallel_free(lp);
+	} else if (it) {
+		st.failed = s3_list_iter_error(it) != 0;
+		s3_list_iter_free(it);
+	} else
+		st.failed = 1;
+	st.elapsed = now() - start;
+
+	report(name, &st);
+}
+
+/*
+ * Listings walked a page at a time against the same listings split
+ * into -c ranges, over the flat keys put leaves and over a tree.
+ */
+static void
+bench_list_parallel(struct bench *b, int n) {
+	char name[32];
+
+	bench_list(b, "list flat (serial)", "bench/", 0);
+	snprintf(name, sizeof (name), "list flat (%d ranges)", b->concurrency);
+	bench_list(b, name, "bench/", b->concurrency);
+
+	run(b, "put (tree)", op_put_tree, n, b->concurrency);
+	bench_list(b, "list tree (serial)", "bench-tree/", 0);
+	snprintf(name, sizeof (name), "list tree (%d ranges)", b->concurrency);
+	bench_list(b, name, "bench-tree/", b->concurrency);
+	run(b, "delete (tree)", op_delete_tree, n, b->concurrency);
+}
+
+/*
+ * A minimal poll() loop standing in for the application's own, to
+ * measure a batch driven through s3_batch_socket()/s3_batch_timeout().
+ */
+struct loop {
+	struct pollfd *fds;
+	int nfds;
+	int maxfds;
+	double due;	/* timer expiry on now(), 0 if unset */
+	int failed;
+};
+
+static void
+loop_socket(int fd, int events, void *arg) {
+	struct loop *l = arg;
+	int i;
+
+	for (i = 0; i < l->nfds && l->fds[i].fd != fd; i++)
+		;
+	if (events & S3_POLL_REMOVE) {
+		if (i < l->nfds)
+			l->fds[i] = l->fds[--l->nfds];
+		return;
+	}
+	if (i == l->nfds) {
+		if (l->nfds == l->maxfds) {
+			l->maxfds = l->maxfds ? l->maxfds * 2 : 64;
+			l->fds = realloc(l->fds, l->maxfds * sizeof (struct pollfd));
+		}
+		l->fds[l->nfds].fd = fd;
+		l->fds[l->nfds++].revents = 0;
+	}
+	l->fds[i].events = ((events & S3_POLL_IN) ? POLLIN : 0) | ((events & S3_POLL_OUT) ? POLLOUT : 0);
+}
+
+static void
+loop_timer(long timeout_ms, void *arg) {
+	struct loop *l = arg;
+
+	l->due = timeout_ms < 0 ? 0 : now() + timeout_ms / 1e3;
+}
+
+static void
+loop_done(const struct s3_result *result, void *arg) {
+	struct loop *l = arg;
+
+	if (!S3_RESULT_OK(result))
+		l->failed++;
+}
+
+static void
+bench_loop_get(struct S3 *s3, const char *bucket, const char *name, int n, int concurrency, size_t size) {
+	struct stats st;
+	struct loop l;
+	struct s3_batch *b;
+	struct s3_string **out;
+	double start, elapsed;
+	int i, nready, timeout, events;
+
+	memset(&l, 0, sizeof (l));
+	out = calloc(n, sizeof (*out));
+
+	start = now();
+	b = s3_batch_new_loop(s3, concurrency, loop_socket, loop_timer, &l);
+	for (i = 0; i < n; i++) {
+		out[i] = s3_string_init();
+		s3_async_get(b, bucket, "bench.dat", out[i], loop_done, &l);
+	}
+	while (s3_batch_pending(b) > 0) {
+		timeout = l.due == 0 ? 1000 : l.due > now() ? (int)((l.due - now()) * 1e3) + 1 : 0;
+		nready = poll(l.fds, l.nfds, timeout);
+		if (l.due != 0 && now() >= l.due) {
+			l.due = 0;
+			s3_batch_timeout(b);
+		}
+		/* Callbacks may rearrange fds, so go from the end */
+		for (i = l.nfds - 1; nready > 0 && i >= 0; i--) {
+			if (i >= l.nfds || l.fds[i].revents == 0)
+				continue;
+			events = 0;
+			if (l.fds[i].revents & (POLLIN | POLLERR | POLLHUP))
+				events |= S3_POLL_IN;
+			if (l.fds[i].revents & POLLOUT)
+				events |= S3_POLL_OUT;
+			l.fds[i].revents = 0;
+			nready--;
+			s3_batch_socket(b, l.fds[i].fd, events);
+		}
+	}
+	s3_batch_free(b);
+	elapsed = now() - start;
+
+	for (i = 0; i < n; i++)
+		s3_string_free(out[i]);
+	free(out);
+	free(l.fds);
+
+	memset(&st, 0, sizeof (st));
+	st.n = n;
+	st.failed = l.failed;
+	st.bytes = (size_t)n * size;
+	st.elapsed = elapsed;
+	report(name, &st);
+}
+
+/*
+ * The ways of issuing GETs: one at a time with and without connection
+ * reuse, in a batch, from an event loop and from 1, 2, 4... threads.
+ */
+static void
+bench_clients(struct bench *b, int n, int threads) {
+	char name[32];
+	int t;
+
+	s3_put(b->s3, b->bucket, "bench.dat", "application/octet-stream", b->data, b->size);
+
+	b->s3->max_idle_handles = 0;
+	run(b, "get (new handle)", op_get_shared, n, 1);
+	b->s3->max_idle_handles = S3_MAX_IDLE_HANDLES;
+	run(b, "get (reused handle)", op_get_shared, n, 1);
+
+	bench_batch_get(b->s3, b->bucket, "get (batch)", n, b->concurrency, b->size);
+	bench_loop_get(b->s3, b->bucket, "get (event loop)", n, b->concurrency, b->size);
+	for (t = 1; t <= threads; t *= 2) {
+		snprintf(name, sizeof (name), "get (%d threads)", t);
+		run(b, name, op_get_shared, n, t);
+	}
+
+	s3_delete(b->s3, b->bucket, "bench.dat");
+}
+
+/* Is name among the comma separated workloads? */
+static int
+wanted(const char *workloads, const char *name) {
+	size_t len = strlen(name);
+	const char *p;
+
+	for (p = workloads; (p = strstr(p, name)) != NULL; p += len)
+		if ((p == workloads || p[-1] == ',') && (p[len] == ',' || p[len] == '\0'))
+			return 1;
+	return 0;
+}
+
+static void
+usage(void) {
+	fprintf(stderr, "Usage: s3bench [-b bucket] [-c concurrency] [-n requests] [-p proxy] [-s size] [-t threads] [-w workloads]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv) {
+	struct bench b;
+	const char *workloads = "put,get,list,listpar,delete,multipart,clients";
+	char *proxy = "http://127.0.0.1:8000";
+	int ch, n = 1000, threads = 64;
+
+	memset(&b, 0, sizeof (b));
+	b.bucket = "bench";
+	b.size = 1024;
+	b.concurrency = 16;
+
+	while ((ch = getopt(argc, argv, "b:c:n:p:s:t:w:")) != -1) {
+		switch (ch) {
+		case 'b':
+			b.bucket = optarg;
+			break;
+		case 'c':
+			b.concurrency = atoi(optarg);
+			break;
+		case 'n':
+			n = atoi(optarg);
+			break;
+		case 'p':
+			proxy = optarg;
+			break;
+		case 's':
+			b.size = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'w':
+			workloads = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (n < 1 || b.concurrency < 1)
+		usage();
+
+	b.s3 = s3_init("bench", "bench", "s3.amazonaws.com");
+	b.s3->proxy = proxy;
+
+	b.data = malloc(b.size ? b.size : 1);
+	memset(b.data, 'x', b.size);
+	b.mp_data = malloc(BENCH_MULTIPART_SIZE);
+	memset(b.mp_data, 'x', BENCH_MULTIPART_SIZE);
+
+	/* get, list, listpar and delete work on the keys put leaves behind */
+	if (wanted(workloads, "put"))
+		run(&b, "put", op_put, n, b.concurrency);
+	if (wanted(workloads, "get"))
+		run(&b, "get", op_get, n, b.concurrency);
+	if (wanted(workloads, "list"))
+		run(&b, "list", op_list, n / 10 > 0 ? n / 10 : 1, b.concurrency);
+	if (wanted(workloads, "listpar"))
+		bench_list_parallel(&b, n);
+	if (wanted(workloads, "delete"))
+		run(&b, "delete", op_delete, n, b.concurrency);
+	if (wanted(workloads, "multipart"))
+		run(&b, "multipart", op_multipart, n / 100 > 0 ? n / 100 : 1, b.concurrency);
+	if (wanted(workloads, "clients"))
+		bench_clients(&b, n, threads);
+
+	s3_free(b.s3);
+	free(b.data);
+	free(b.mp_data);
+
+	return 0;
+}
@@ -54,144 +54,751 @@ s3_bucket_entries_free(struct s3_bucket_entry_head *entries) {
 }
 
 
-static struct s3_bucket_entry *
-s3_bucket_entry_from_node(xmlNode *root) {
-	struct s3_bucket_entry *entry = malloc(sizeof(struct s3_bucket_entry));
-	xmlNode *node = NULL;
-	for (node = root; node; node = node->next) {
-		if (node->type == XML_ELEMENT_NODE) {
-			xmlChar *value =  xmlNodeGetContent(node->children);
-			size_t len = strlen((const char *) value);
-
-			if (strcasecmp("key", (const char *)node->name) == 0) {
-				entry->key = malloc(len + 2);
-				strlcpy(entry->key, (const char *)value, len + 1);
-			} else if (strcasecmp("lastmodified", (const char *)node->name) == 0) {
-				entry->lastmod = malloc(len + 2);
-				strlcpy(entry->lastmod, (const char *)value, len + 1);
-			} else if (strcasecmp("etag", (const char *)node->name) == 0) {
-				entry->etag = malloc(len + 2);
-				strlcpy(entry->etag, (const char *)value, len + 1);
-			} else {
-#ifdef DEBUG
-				printf("node type: Element, name: %s\n", node->name);
-				printf("node xmlNodeGetContent: %s\n",value);
-#endif
-			}
-			xmlFree(value);
-		}
+/*
+ * Bucket listings are parsed with a libxml2 SAX push parser fed straight
+ * from the curl write callback, so no document tree is built and the
+ * response is never buffered. Text is collected into a handful of
+ * reusable strings and handed out one entry at a time.
+ */
+
+enum s3_list_section {
+	S3_LIST_NONE,
+	S3_LIST_CONTENTS,
+	S3_LIST_PREFIXES
+};
+
+static void
+s3_list_capture(struct s3_list_parser *p, struct s3_string *field) {
+	p->field = field;
+	field->len = 0;
+	field->ptr[0] = '\0';
+}
+
+static void
+s3_list_start(void *ctx, const xmlChar *localname, const xmlChar *prefix, const xmlChar *URI,
+    int nb_namespaces, const xmlChar **namespaces, int nb_attributes, int nb_defaulted, const xmlChar **attributes) {
+	struct s3_list_parser *p = ctx;
+	const char *name = (const char *)localname;
+
+	p->field = NULL;
+	p->depth++;
+
+	if (p->depth == 1) {
+		p->is_error = strcmp(name, "Error") == 0;
+	} else if (p->depth == 2) {
+		if (strcmp(name, "Contents") == 0) {
+			p->section = S3_LIST_CONTENTS;
+			p->key->len = p->lastmod->len = p->etag->len = p->size->len = 0;
+			p->key->ptr[0] = p->lastmod->ptr[0] = p->etag->ptr[0] = p->size->ptr[0] = '\0';
+		} else if (strcmp(name, "CommonPrefixes") == 0)
+			p->section = S3_LIST_PREFIXES;
+		else if (strcmp(name, "IsTruncated") == 0)
+			s3_list_capture(p, p->truncated);
+		else if (strcmp(name, "NextMarker") == 0)
+			s3_list_capture(p, p->next_marker);
+		else if (strcmp(name, "NextContinuationToken") == 0)
+			s3_list_capture(p, p->continuation);
+		else if (p->is_error && strcmp(name, "Code") == 0)
+			s3_list_capture(p, p->error_code);
+	} else if (p->depth == 3 && p->section == S3_LIST_CONTENTS) {
+		if (strcmp(name, "Key") == 0)
+			s3_list_capture(p, p->key);
+		else if (strcmp(name, "LastModified") == 0)
+			s3_list_capture(p, p->lastmod);
+		else if (strcmp(name, "ETag") == 0)
+			s3_list_capture(p, p->etag);
+		else if (strcmp(name, "Size") == 0)
+			s3_list_capture(p, p->size);
+	} else if (p->depth == 3 && p->section == S3_LIST_PREFIXES) {
+		if (strcmp(name, "Prefix") == 0)
+			s3_list_capture(p, p->prefix);
 	}
-	return entry;	
 }
 
-#ifdef WALK_CONTENT_PREFIXES
 static void
-s3_parse_bucket_prefixes(xmlNode *root) {
-	xmlNode *node = NULL;
-	for (node = root; node; node = node->next) {
-		if (node->type == XML_ELEMENT_NODE) {
-			xmlChar *value =  xmlNodeGetContent(node->children);
-			
-			printf("Prefix node type: Element, name: %s\n", node->name);
-			printf("Prefix node xmlsNodeGetContent: %s\n",value);
-			xmlFree(value);
-		}
+s3_list_end(void *ctx, const xmlChar *localname, const xmlChar *prefix, const xmlChar *URI) {
+	struct s3_list_parser *p = ctx;
+	struct s3_list_item item;
+
+	p->field = NULL;
+
+	if (p->depth == 2 && p->section == S3_LIST_CONTENTS) {
+		item.key = p->key->ptr;
+		item.lastmod = p->lastmod->ptr;
+		item.etag = p->etag->ptr;
+		item.size = strtoull(p->size->ptr, NULL, 10);
+
+		p->nentries++;
+		s3_string_reserve(p->last_key, p->key->len);
+		memcpy(p->last_key->ptr, p->key->ptr, p->key->len + 1);
+		p->last_key->len = p->key->len;
+
+		if (p->entry_cb)
+			p->entry_cb(p->arg, &item);
+	} else if (p->depth == 3 && p->section == S3_LIST_PREFIXES && strcmp((const char *)localname, "Prefix") == 0) {
+		p->nprefixes++;
+		if (p->prefix_cb)
+			p->prefix_cb(p->arg, p->prefix->ptr);
 	}
+
+	if (p->depth == 2)
+		p->section = S3_LIST_NONE;
+	p->depth--;
 }
 
 static void
-s3_walk_content_prefixes(xmlNodeSetPtr nodes, void *data) {
-	xmlNodePtr cur;
-	int size;
-	int i;
-
-	size = (nodes) ? nodes->nodeNr : 0;
-#ifdef DEBUG
-	printf("prefix size is %d nodes\n", size);
-#endif
-	for (i = 0; i < size ; i++) {
-		if (nodes->nodeTab[i]->type == XML_ELEMENT_NODE) {
-			cur = nodes->nodeTab[i];
-			s3_parse_bucket_prefixes(cur->children);
+s3_list_characters(void *ctx, const xmlChar *ch, int len) {
+	struct s3_list_parser *p = ctx;
+
+	if (p->field)
+		s3_string_curl_writefunc((void *)ch, 1, len, p->field);
+}
+
+static void
+s3_list_parser_reset(struct s3_list_parser *p) {
+	struct s3_string *fields[] = {
+		p->key, p->lastmod, p->etag, p->size, p->prefix,
+		p->truncated, p->next_marker, p->continuation, p->error_code, p->last_key
+	};
+	size_t i;
+
+	for (i = 0; i < sizeof (fields) / sizeof (fields[0]); i++) {
+		fields[i]->len = 0;
+		fields[i]->ptr[0] = '\0';
+	}
+
+	p->depth = 0;
+	p->section = S3_LIST_NONE;
+	p->field = NULL;
+	p->is_error = 0;
+	p->failed = 0;
+	p->nentries = 0;
+	p->nprefixes = 0;
+}
+
+struct s3_list_parser *
+s3_list_parser_new(s3_list_entry_cb entry_cb, s3_list_prefix_cb prefix_cb, void *arg) {
+	struct s3_list_parser *p = calloc(1, sizeof (struct s3_list_parser));
+
+	p->entry_cb = entry_cb;
+	p->prefix_cb = prefix_cb;
+	p->arg = arg;
+
+	p->sax.initialized = XML_SAX2_MAGIC;
+	p->sax.startElementNs = s3_list_start;
+	p->sax.endElementNs = s3_list_end;
+	p->sax.characters = s3_list_characters;
+
+	p->key = s3_string_init();
+	p->lastmod = s3_string_init();
+	p->etag = s3_string_init();
+	p->size = s3_string_init();
+	p->prefix = s3_string_init();
+	p->truncated = s3_string_init();
+	p->next_marker = s3_string_init();
+	p->continuation = s3_string_init();
+	p->error_code = s3_string_init();
+	p->last_key = s3_string_init();
+
+	s3_list_parser_begin(p);
+
+	return p;
+}
+
+/* Get ready for another response, keeping the field buffers */
+void
+s3_list_parser_begin(struct s3_list_parser *p) {
+	if (p->ctxt)
+		xmlFreeParserCtxt(p->ctxt);
+	s3_list_parser_reset(p);
+
+	p->ctxt = xmlCreatePushParserCtxt(&p->sax, p, NULL, 0, NULL);
+	xmlCtxtUseOptions(p->ctxt, XML_PARSE_NONET);
+}
+
+/* s3_write_func feeding response bytes to the parser as they arrive */
+size_t
+s3_list_parser_write(const void *ptr, size_t len, void *arg) {
+	struct s3_list_parser *p = arg;
+
+	if (!p->failed && xmlParseChunk(p->ctxt, ptr, (int)len, 0) != 0)
+		p->failed = 1;
+
+	return len;
+}
+
+/* Flush the parser. Returns -1 if the response was not a well formed listing. */
+int
+s3_list_parser_finish(struct s3_list_parser *p) {
+	if (!p->failed && xmlParseChunk(p->ctxt, NULL, 0, 1) != 0)
+		p->failed = 1;
+
+	return p->failed || p->is_error ? -1 : 0;
+}
+
+int
+s3_list_parser_truncated(struct s3_list_parser *p) {
+	return strcmp(p->truncated->ptr, "true") == 0;
+}
+
+void
+s3_list_parser_free(struct s3_list_parser *p) {
+	xmlFreeParserCtxt(p->ctxt);
+
+	s3_string_free(p->key);
+	s3_string_free(p->lastmod);
+	s3_string_free(p->etag);
+	s3_string_free(p->size);
+	s3_string_free(p->prefix);
+	s3_string_free(p->truncated);
+	s3_string_free(p->next_marker);
+	s3_string_free(p->continuation);
+	s3_string_free(p->error_code);
+	s3_string_free(p->last_key);
+
+	free(p);
+}
+
+/*
+ * An iterator walks every page of a listing. Pages are fetched ahead on
+ * the iterator's batch while the caller works through earlier ones, so
+ * each call to s3_list_iter_next() also pumps the transfer along without
+ * blocking. Once prefetch pages are held the next is only requested
+ * when the caller finishes the oldest.
+ */
+struct s3_list_iter {
+	struct S3 *s3;
+	struct s3_batch *batch;
+	struct s3_list_parser *parser;
+	char *bucket;
+	char *prefix;
+	char *delimiter;
+	char *marker;		/* where the next page starts, v1 */
+	char *token;		/* continuation token, v2 */
+	char *end;		/* last key wanted, if bounded */
+	int max_keys;
+	int v2;
+	int own_batch;
+	int inflight;
+	int more;		/* next page is wanted once a page is used up */
+	int one_page;		/* stop after the first page */
+	int past_end;
+	int error;
+	int prefetch;		/* pages that may be held at once */
+	int npages;
+	size_t *pages;		/* entries left in each held page, oldest first */
+	size_t npending;
+	size_t nready;
+	s3_list_entry_cb entry_cb;	/* set to take entries as parsed */
+	s3_list_prefix_cb prefix_cb;
+	void *cb_arg;
+	struct s3_bucket_entry_head ready;	/* from completed pages */
+	struct s3_bucket_entry_head pending;	/* from the page in flight */
+};
+
+static void
+s3_list_iter_add(void *arg, const struct s3_list_item *item) {
+	struct s3_list_iter *it = arg;
+	struct s3_bucket_entry *entry;
+
+	if (it->past_end || (it->end && strcmp(item->key, it->end) > 0)) {
+		it->past_end = 1;
+		return;
+	}
+	if (it->entry_cb) {
+		it->entry_cb(it->cb_arg, item);
+		return;
+	}
+
+	entry = calloc(1, sizeof (struct s3_bucket_entry));
+	entry->key = strdup(item->key);
+	entry->lastmod = strdup(item->lastmod);
+	entry->etag = strdup(item->etag);
+	entry->size = item->size;
+
+	TAILQ_INSERT_TAIL(&it->pending, entry, list);
+	it->npending++;
+}
+
+static void
+s3_list_iter_add_prefix(void *arg, const char *prefix) {
+	struct s3_list_iter *it = arg;
+	struct s3_bucket_entry *entry;
+
+	if (it->entry_cb) {
+		if (it->prefix_cb)
+			it->prefix_cb(it->cb_arg, prefix);
+		return;
+	}
+
+	entry = calloc(1, sizeof (struct s3_bucket_entry));
+	entry->key = strdup(prefix);
+	entry->is_prefix = 1;
+
+	TAILQ_INSERT_TAIL(&it->pending, entry, list);
+	it->npending++;
+}
+
+/* Append "&name=value" to q, percent-encoding value */
+static void
+s3_list_query_add(struct s3_string *q, const char *name, const char *value) {
+	char *enc;
+	size_t n;
+
+	if (value == NULL)
+		return;
+
+	enc = s3_url_encode(value);
+	n = strlen(name) + strlen(enc) + 2;
+	s3_string_reserve(q, n);
+	q->len += snprintf(q->ptr + q->len, n + 1, "%s%s=%s", q->len ? "&" : "", name, enc);
+	free(enc);
+}
+
+static void s3_list_iter_done(struct s3_op *op, void *arg);
+
+static void
+s3_list_iter_fetch(struct s3_list_iter *it) {
+	struct s3_op *op = malloc(sizeof (struct s3_op));
+	struct s3_string *query = s3_string_init();
+	char max_keys[16];
+
+	if (it->v2) {
+		s3_list_query_add(query, "list-type", "2");
+		s3_list_query_add(query, "continuation-token", it->token);
+		s3_list_query_add(query, "start-after", it->token ? NULL : it->marker);
+	} else
+		s3_list_query_add(query, "marker", it->marker);
+	s3_list_query_add(query, "delimiter", it->delimiter);
+	if (it->max_keys > 0) {
+		snprintf(max_keys, sizeof (max_keys), "%d", it->max_keys);
+		s3_list_query_add(query, "max-keys", max_keys);
+	}
+	s3_list_query_add(query, "prefix", it->prefix);
+
+	s3_op_init(op, it->s3, "GET", it->bucket, NULL, NULL, query->len ? query->ptr : NULL);
+	s3_string_free(query);
+
+	s3_list_parser_begin(it->parser);
+	it->npending = 0;
+	op->out = s3_sink_callback(s3_list_parser_write, it->parser);
+	op->done = s3_list_iter_done;
+	op->arg = it;
+
+	it->inflight = 1;
+	s3_batch_add(it->batch, op);
+}
+
+static void
+s3_list_iter_replace(char **field, const char *value) {
+	free(*field);
+	*field = value && *value ? strdup(value) : NULL;
+}
+
+/*
+ * Work out where the page after this one starts. V1 listings only carry
+ * NextMarker when a delimiter is given; otherwise the last key (or
+ * common prefix, whichever sorts later) is the marker.
+ */
+static int
+s3_list_iter_advance(struct s3_list_iter *it) {
+	struct s3_list_parser *p = it->parser;
+	const char *marker;
+
+	if (it->v2) {
+		s3_list_iter_replace(&it->token, p->continuation->ptr);
+		return it->token ? 0 : -1;
+	}
+
+	marker = p->next_marker->ptr;
+	if (*marker == '\0')
+		marker = strcmp(p->last_key->ptr, p->prefix->ptr) > 0 ? p->last_key->ptr : p->prefix->ptr;
+
+	/* A marker that doesn't move would loop forever */
+	if (*marker == '\0' || (it->marker && strcmp(marker, it->marker) <= 0))
+		return -1;
+
+	s3_list_iter_replace(&it->marker, marker);
+	return 0;
+}
+
+static void
+s3_list_iter_done(struct s3_op *op, void *arg) {
+	struct s3_list_iter *it = arg;
+	struct s3_bucket_entry *e;
+
+	it->inflight = 0;
+
+	if (s3_list_parser_finish(it->parser) < 0 || !S3_RESULT_OK(&op->result)) {
+		while ((e = TAILQ_FIRST(&it->pending)) != NULL) {
+			TAILQ_REMOVE(&it->pending, e, list);
+			s3_bucket_entry_free(e);
+		}
+		it->error = op->result.status >= 300 ? (int)op->result.status : 1;
+		return;
+	}
+
+	if (it->npending > 0)
+		it->pages[it->npages++] = it->npending;
+	it->nready += it->npending;
+	TAILQ_CONCAT(&it->ready, &it->pending, list);
+
+	if (it->one_page || it->past_end || !s3_list_parser_truncated(it->parser))
+		return;
+	if (s3_list_iter_advance(it) < 0) {
+		it->error = 1;
+		return;
+	}
+
+	/* Hold off while the caller has as many pages as it may keep */
+	if (it->npages < it->prefetch)
+		s3_list_iter_fetch(it);
+	else
+		it->more = 1;
+}
+
+static struct s3_list_iter *
+s3_list_iter_create(struct S3 *s3, const char *bucket, const struct s3_list_options *opts, const char *end, struct s3_batch *batch) {
+	struct s3_list_iter *it = calloc(1, sizeof (struct s3_list_iter));
+
+	it->s3 = s3;
+	it->bucket = strdup(bucket);
+	if (opts) {
+		it->prefix = opts->prefix ? strdup(opts->prefix) : NULL;
+		it->delimiter = opts->delimiter ? strdup(opts->delimiter) : NULL;
+		it->marker = opts->start_after ? strdup(opts->start_after) : NULL;
+		it->max_keys = opts->max_keys;
+		it->v2 = opts->v2;
+		it->prefetch = opts->prefetch;
+	}
+	if (it->prefetch < 1)
+		it->prefetch = S3_LIST_PREFETCH;
+	it->pages = calloc(it->prefetch, sizeof (size_t));
+	it->end = end ? strdup(end) : NULL;
+	TAILQ_INIT(&it->ready);
+	TAILQ_INIT(&it->pending);
+
+	it->parser = s3_list_parser_new(s3_list_iter_add, s3_list_iter_add_prefix, it);
+	it->own_batch = batch == NULL;
+	it->batch = batch ? batch : s3_batch_new(s3, 1);
+
+	return it;
+}
+
+/*
+ * Start listing bucket, stopping after key end if it is not NULL. Pages
+ * are fetched on batch, which may be shared with other iterators and
+ * must then outlive them; if NULL the iterator makes its own.
+ */
+struct s3_list_iter *
+s3_list_iter_range(struct S3 *s3, const char *bucket, const struct s3_list_options *opts, const char *end, struct s3_batch *batch) {
+	struct s3_list_iter *it = s3_list_iter_create(s3, bucket, opts, end, batch);
+
+	s3_list_iter_fetch(it);
+	s3_batch_step(it->batch, 0);
+
+	return it;
+}
+
+/*
+ * Start listing bucket. opts may be NULL to list every key. The first
+ * page is requested straight away.
+ */
+struct s3_list_iter *
+s3_list_iter_new(struct S3 *s3, const char *bucket, const struct s3_list_options *opts) {
+	return s3_list_iter_range(s3, bucket, opts, NULL, NULL);
+}
+
+/*
+ * Return the next entry in key order within each page, waiting for the
+ * next page if needed, or NULL when the listing is exhausted or failed.
+ * The entry belongs to the caller and is freed with s3_bucket_entry_free.
+ */
+struct s3_bucket_entry *
+s3_list_iter_next(struct s3_list_iter *it) {
+	struct s3_bucket_entry *e;
+
+	for (;;) {
+		if ((e = TAILQ_FIRST(&it->ready)) != NULL) {
+			TAILQ_REMOVE(&it->ready, e, list);
+			it->nready--;
+			if (--it->pages[0] == 0)
+				memmove(it->pages, it->pages + 1, --it->npages * sizeof (size_t));
+			if (it->more && it->npages < it->prefetch) {
+				it->more = 0;
+				s3_list_iter_fetch(it);
+			}
+			if (it->inflight)
+				s3_batch_step(it->batch, 0);
+			return e;
 		}
+		if (!it->inflight)
+			return NULL;
+		s3_batch_step(it->batch, 1000);
 	}
 }
-#endif
 
-static void 
-s3_walk_content_nodes(xmlNodeSetPtr nodes, void *data) {
-	struct s3_bucket_entry_head *head;
-	xmlNodePtr cur;
-	int size;
-	int i;
+/*
+ * Non-zero if the listing ended early because a page failed: the HTTP
+ * status of an error response, otherwise 1.
+ */
+int
+s3_list_iter_error(struct s3_list_iter *it) {
+	return it->error;
+}
 
-	head = (struct s3_bucket_entry_head *) data;
+void
+s3_list_iter_free(struct s3_list_iter *it) {
+	struct s3_bucket_entry *e;
 
-	size = (nodes) ? nodes->nodeNr : 0;
-#ifdef DEBUG
-	printf("size is %d nodes\n", size);
-#endif
-	for (i = 0; i < size ; i++) {
-		if (nodes->nodeTab[i]->type == XML_ELEMENT_NODE) {
-			cur = nodes->nodeTab[i];
-			
-			struct s3_bucket_entry *entry = s3_bucket_entry_from_node(cur->children);
-			TAILQ_INSERT_TAIL(head, entry, list);
+	/* Aborts a prefetch still in flight */
+	if (it->own_batch)
+		s3_batch_free(it->batch);
+	s3_list_parser_free(it->parser);
+
+	while ((e = TAILQ_FIRST(&it->ready)) != NULL) {
+		TAILQ_REMOVE(&it->ready, e, list);
+		s3_bucket_entry_free(e);
+	}
+
+	free(it->bucket);
+	free(it->prefix);
+	free(it->delimiter);
+	free(it->marker);
+	free(it->token);
+	free(it->end);
+	free(it->pages);
+	free(it);
+}
+
+/*
+ * Walk every page of a listing, handing each entry and common prefix to
+ * the callbacks as it is parsed instead of building entries. Returns -1
+ * if a page failed.
+ */
+int
+s3_list_walk(struct S3 *s3, const char *bucket, const struct s3_list_options *opts, s3_list_entry_cb entry_cb, s3_list_prefix_cb prefix_cb, void *arg) {
+	struct s3_list_iter *it;
+	int error;
+
+	it = s3_list_iter_create(s3, bucket, opts, NULL, NULL);
+	it->entry_cb = entry_cb;
+	it->prefix_cb = prefix_cb;
+	it->cb_arg = arg;
+	s3_list_iter_fetch(it);
+
+	/* Entries go to the callbacks, so this only runs the pages */
+	while (s3_list_iter_next(it) != NULL)
+		;
+	error = it->error;
+	s3_list_iter_free(it);
+
+	return error ? -1 : 0;
+}
+
+/*
+ * Like s3_list_walk() but for the first page only. Returns -1 if it
+ * failed, 1 if the listing goes on past it, otherwise 0.
+ */
+int
+s3_list_page(struct S3 *s3, const char *bucket, const struct s3_list_options *opts, s3_list_entry_cb entry_cb, s3_list_prefix_cb prefix_cb, void *arg) {
+	struct s3_list_iter *it;
+	int rc;
+
+	it = s3_list_iter_create(s3, bucket, opts, NULL, NULL);
+	it->entry_cb = entry_cb;
+	it->prefix_cb = prefix_cb;
+	it->cb_arg = arg;
+	it->one_page = 1;
+	s3_list_iter_fetch(it);
+
+	while (s3_list_iter_next(it) != NULL)
+		;
+	rc = it->error ? -1 : s3_list_parser_truncated(it->parser);
+	s3_list_iter_free(it);
+
+	return rc;
+}
+
+static int
+s3_listing_reserve(struct s3_listing *l, size_t key_len) {
+	void *p;
+	size_t cap;
+
+	if (l->count == l->objects_cap) {
+		cap = l->objects_cap ? l->objects_cap * 2 : 1024;
+		if ((p = realloc(l->objects, cap * sizeof (struct s3_object))) == NULL)
+			return -1;
+		l->objects = p;
+		l->objects_cap = cap;
+	}
+	if (l->arena_len + key_len + 1 > l->arena_cap) {
+		for (cap = l->arena_cap ? l->arena_cap : 64 * 1024; cap < l->arena_len + key_len + 1; cap *= 2)
+			;
+		if ((p = realloc(l->arena, cap)) == NULL)
+			return -1;
+		l->arena = p;
+		l->arena_cap = cap;
+	}
+	return 0;
+}
+
+static struct s3_object *
+s3_listing_push(struct s3_listing *l, const char *key) {
+	size_t len = strlen(key);
+	struct s3_object *o;
+
+	if (s3_listing_reserve(l, len) < 0)
+		return NULL;
+
+	o = &l->objects[l->count++];
+	memset(o, 0, sizeof (*o));
+	o->key = l->arena_len;
+	o->key_len = len;
+	memcpy(l->arena + l->arena_len, key, len + 1);
+	l->arena_len += len + 1;
+
+	return o;
+}
+
+static int
+s3_hexval(int c) {
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/* "<32 hex digits>" or "<32 hex digits>-<parts>", quotes optional */
+static void
+s3_listing_etag(struct s3_object *o, const char *etag) {
+	int i, hi, lo;
+
+	if (*etag == '"')
+		etag++;
+	for (i = 0; i < 16; i++) {
+		if ((hi = s3_hexval(etag[2 * i])) < 0 || (lo = s3_hexval(etag[2 * i + 1])) < 0) {
+			o->etag_parts = -1;
+			return;
 		}
+		o->etag[i] = hi << 4 | lo;
 	}
+	o->etag_parts = etag[32] == '-' ? atoi(etag + 33) : 0;
 }
 
-static struct s3_bucket_entry_head *
-s3_parse_bucket_response(char *xml) {
-	struct s3_bucket_entry_head *entries;
-	xmlDocPtr doc;
+/*
+ * Parse an ISO 8601 LastModified, "2009-10-12T17:50:30.000Z", as UTC.
+ * Returns 0 if it can't be parsed.
+ */
+time_t
+s3_parse_time(const char *s) {
+	int y, mo, d, h, mi, sec;
+	long days;
+
+	if (sscanf(s, "%4d-%2d-%2dT%2d:%2d:%2d", &y, &mo, &d, &h, &mi, &sec) != 6)
+		return 0;
+
+	/* Days since the epoch of a proleptic Gregorian date */
+	y -= mo <= 2;
+	days = 365L * y + y / 4 - y / 100 + y / 400 + (153 * (mo + (mo > 2 ? -3 : 9)) + 2) / 5 + d - 1 - 719468;
+
+	return (time_t)days * 86400 + h * 3600 + mi * 60 + sec;
+}
+
+static void
+s3_listing_add(void *arg, const struct s3_list_item *item) {
+	struct s3_listing *l = arg;
+	struct s3_object *o;
 
-	doc = xmlReadMemory(xml, strlen(xml), "noname.xml", NULL, 0);
-	if (doc == NULL)
+	if ((o = s3_listing_push(l, item->key)) == NULL) {
+		l->error = 1;
+		return;
+	}
+	o->size = item->size;
+	o->lastmod = s3_parse_time(item->lastmod);
+	s3_listing_etag(o, item->etag);
+}
+
+static void
+s3_listing_add_prefix(void *arg, const char *prefix) {
+	struct s3_listing *l = arg;
+	struct s3_object *o;
+
+	if ((o = s3_listing_push(l, prefix)) == NULL) {
+		l->error = 1;
+		return;
+	}
+	o->is_prefix = 1;
+}
+
+/*
+ * List every page into a compact result: one array of entries and one
+ * arena holding the keys, so a listing costs a handful of allocations
+ * however many keys it has. Returns NULL on failure.
+ */
+struct s3_listing *
+s3_list_compact(struct S3 *s3, const char *bucket, const struct s3_list_options *opts) {
+	struct s3_listing *l = calloc(1, sizeof (struct s3_listing));
+
+	/* A listing missing entries it ran out of memory for is no listing */
+	if (s3_list_walk(s3, bucket, opts, s3_listing_add, s3_listing_add_prefix, l) < 0 || l->error) {
+		s3_listing_free(l);
 		return NULL;
+	}
 
-	entries = malloc(sizeof (*entries));
-	TAILQ_INIT(entries);
-	
-	/* 
-	 * Since Amazon uses an XML Namespace, we need to declare it
-	 * and use it as a prefix in Xpath queries, even though it's
-	 * not written out in the tag names - libxml2 follows the
-	 * standard where others don't
-	 */
-	s3_execute_xpath_expr(doc, (const xmlChar *)"//amzn:Contents", s3_walk_content_nodes, entries);
-#ifdef WALK_CONTENT_PREFIXES
-	s3_execute_xpath_expr(doc, (const xmlChar *)"//amzn:CommonPrefixes", s3_walk_content_prefixes, NULL);
-#endif
-	xmlFreeDoc(doc);
-	xmlCleanupParser();
+	return l;
+}
 
-	return entries;
+void
+s3_listing_free(struct s3_listing *l) {
+	free(l->objects);
+	free(l->arena);
+	free(l);
 }
 
+/*
+ * List the keys directly under prefix, walking every page. Common
+ * prefixes ("subdirectories") are left out. Goes through the context's
+ * listing cache if it has one.
+ */
 struct s3_bucket_entry_head *
 s3_list_bucket(struct S3 *s3, const char *bucket, const char *prefix) {
-	char *date;
-	char *sign_data;	
-	char *url;
-	struct s3_string *str;
-	const char *method = "GET";
+	struct s3_list_options opts;
+	struct s3_list_iter *it;
 	struct s3_bucket_entry_head *entries;
+	struct s3_bucket_entry *e;
+	struct s3_list_fetch fetch;
+	int error;
+
+	if (s3->list_cache && s3_list_cache_lookup(s3, bucket, prefix, &entries, &fetch) == 0)
+		return entries;
 
-	str = s3_string_init();		
-	date = s3_make_date();
+	memset(&opts, 0, sizeof (opts));
+	opts.prefix = prefix;
+	opts.delimiter = "/";
 
-	asprintf(&sign_data, "%s\n\n\n%s\n/%s/", method, date, bucket);	
-      	asprintf(&url, "http://%s.%s/?delimiter=/%s%s", bucket, s3->base_url, prefix ? "&prefix=" : "", prefix ? prefix : "");
+	entries = malloc(sizeof (*entries));
+	TAILQ_INIT(entries);
 
-	s3_perform_op(s3, method, url, sign_data, date, str, NULL, NULL, NULL);
+	it = s3_list_iter_new(s3, bucket, &opts);
+	while ((e = s3_list_iter_next(it)) != NULL) {
+		if (e->is_prefix)
+			s3_bucket_entry_free(e);
+		else
+			TAILQ_INSERT_TAIL(entries, e, list);
+	}
 
-	entries = s3_parse_bucket_response(str->ptr);
+	if ((error = s3_list_iter_error(it)) != 0) {
+		s3_bucket_entries_free(entries);
+		entries = NULL;
+	}
+	s3_list_iter_free(it);
 
-	s3_string_free(str);
-	free(url);
-	free(sign_data);
-	free(date);
+	if (s3->list_cache)
+		s3_list_cache_store(s3, &fetch, entries, error);
 
 	return entries;
 }
@@ -0,0 +1,697 @@
+/*
+ * Copyright (c) 2014, Ian Delahorne <ian.delahorne@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Read-through cache for s3_get. Objects live in memory in a hash table
+ * threaded onto an LRU list and bounded by bytes, and optionally in a
+ * directory as well, where they survive restarts. An entry younger than
+ * the TTL is served without a request; an older one is revalidated
+ * with If-None-Match, so an unchanged object costs a 304 and no body.
+ *
+ * Entries are named by the op's resource, "/bucket/key" as signed. Any
+ * other request on a resource through the same context (a PUT, DELETE
+ * or multipart upload) drops it. A GET that was under way when such a
+ * request completed may have fetched the old object and is not stored.
+ *
+ * Cache files are named by a hash of the resource and hold the
+ * resource, the ETag and the body. Their mtime is when they were last
+ * validated. Once they add up to more than the directory's bound, the
+ * least recently validated are removed.
+ */
+
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "s3.h"
+#include "s3internal.h"
+
+#ifdef LINUX
+#include <bsd/string.h>
+#endif
+#include <string.h>
+
+#define S3_CACHE_MIN_BUCKETS 64
+#define S3_CACHE_FILE_NAME 16	/* hex digits of the resource's hash */
+
+struct s3_cache_entry {
+	char *name;
+	uint64_t hash;
+	char etag[S3_ETAG_LENGTH];
+	char *data;
+	size_t len;
+	uint64_t fresh_until;	/* on s3_now_ms() */
+	struct s3_cache_entry *chain;
+	TAILQ_ENTRY(s3_cache_entry) lru;
+};
+
+/* A GET through the cache, from lookup to storing what it got */
+struct s3_cache_fetch {
+	const char *name;
+	int stale;		/* the resource was dropped meanwhile */
+	TAILQ_ENTRY(s3_cache_fetch) entry;
+};
+
+struct s3_cache {
+	pthread_mutex_t lock;
+	size_t max_bytes;
+	int ttl_ms;
+	char *dir;		/* NULL for memory only */
+	size_t max_disk_bytes;	/* of files in dir, 0 for no limit */
+	pthread_mutex_t trim_lock;	/* one thread trims dir at a time */
+	struct s3_cache_entry **buckets;
+	size_t nbuckets;
+	TAILQ_HEAD(s3_cache_lru, s3_cache_entry) lru;	/* most recently used first */
+	TAILQ_HEAD(, s3_cache_fetch) fetching;
+	struct s3_cache_stats stats;
+};
+
+/* What a lookup found */
+enum s3_cache_state {
+	S3_CACHE_MISS,
+	S3_CACHE_FRESH,		/* copied to out, no request needed */
+	S3_CACHE_STALE		/* a copy and its ETag, to revalidate */
+};
+
+/* FNV-1a */
+static uint64_t
+s3_cache_hash(const char *s) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	while (*s)
+		h = (h ^ (unsigned char)*s++) * 0x100000001b3ULL;
+	return h;
+}
+
+static size_t
+s3_cache_entry_size(const struct s3_cache_entry *e) {
+	return sizeof (*e) + strlen(e->name) + 1 + e->len;
+}
+
+static void s3_cache_disk_trim(struct s3_cache *c);
+
+/*
+ * Cache up to max_bytes of objects in memory, served without a request
+ * for ttl_ms after they were last fetched or revalidated. With dir,
+ * objects are also kept as files there, up to max_disk_bytes of them
+ * (0 for no limit).
+ */
+struct s3_cache *
+s3_cache_new(size_t max_bytes, int ttl_ms, const char *dir, size_t max_disk_bytes) {
+	struct s3_cache *c = calloc(1, sizeof (struct s3_cache));
+
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_mutex_init(&c->trim_lock, NULL);
+	c->max_bytes = max_bytes;
+	c->ttl_ms = ttl_ms > 0 ? ttl_ms : 0;
+	c->dir = dir ? strdup(dir) : NULL;
+	c->max_disk_bytes = max_disk_bytes;
+	c->nbuckets = S3_CACHE_MIN_BUCKETS;
+	c->buckets = calloc(c->nbuckets, sizeof (struct s3_cache_entry *));
+	TAILQ_INIT(&c->lru);
+	TAILQ_INIT(&c->fetching);
+
+	/* Count what earlier runs left, and trim it if it is too much */
+	if (c->dir)
+		s3_cache_disk_trim(c);
+
+	return c;
+}
+
+static void
+s3_cache_entry_free(struct s3_cache_entry *e) {
+	free(e->name);
+	free(e->data);
+	free(e);
+}
+
+void
+s3_cache_free(struct s3_cache *c) {
+	struct s3_cache_entry *e;
+
+	while ((e = TAILQ_FIRST(&c->lru)) != NULL) {
+		TAILQ_REMOVE(&c->lru, e, lru);
+		s3_cache_entry_free(e);
+	}
+	pthread_mutex_destroy(&c->lock);
+	pthread_mutex_destroy(&c->trim_lock);
+	free(c->buckets);
+	free(c->dir);
+	free(c);
+}
+
+static void
+s3_cache_count(struct s3_cache *c, uint64_t *counter) {
+	pthread_mutex_lock(&c->lock);
+	(*counter)++;
+	pthread_mutex_unlock(&c->lock);
+}
+
+void
+s3_cache_stats(struct s3_cache *c, struct s3_cache_stats *st) {
+	pthread_mutex_lock(&c->lock);
+	*st = c->stats;
+	pthread_mutex_unlock(&c->lock);
+}
+
+static struct s3_cache_entry **
+s3_cache_slot(struct s3_cache *c, const char *name, uint64_t hash) {
+	struct s3_cache_entry **ep;
+
+	for (ep = &c->buckets[hash & (c->nbuckets - 1)]; *ep != NULL; ep = &(*ep)->chain)
+		if ((*ep)->hash == hash && strcmp((*ep)->name, name) == 0)
+			break;
+	return ep;
+}
+
+static void
+s3_cache_grow(struct s3_cache *c) {
+	struct s3_cache_entry **old = c->buckets, *e, *next;
+	size_t i, n = c->nbuckets;
+
+	c->nbuckets *= 2;
+	c->buckets = calloc(c->nbuckets, sizeof (struct s3_cache_entry *));
+	for (i = 0; i < n; i++) {
+		for (e = old[i]; e != NULL; e = next) {
+			next = e->chain;
+			e->chain = c->buckets[e->hash & (c->nbuckets - 1)];
+			c->buckets[e->hash & (c->nbuckets - 1)] = e;
+		}
+	}
+	free(old);
+}
+
+/* Unlink e from the table and the LRU; the caller frees it */
+static void
+s3_cache_unlink(struct s3_cache *c, struct s3_cache_entry *e) {
+	struct s3_cache_entry **ep = s3_cache_slot(c, e->name, e->hash);
+
+	*ep = e->chain;
+	TAILQ_REMOVE(&c->lru, e, lru);
+	c->stats.entries--;
+	c->stats.bytes -= s3_cache_entry_size(e);
+}
+
+static void
+s3_cache_fetch_begin(struct s3_cache *c, struct s3_cache_fetch *f, const char *name) {
+	f->name = name;
+	f->stale = 0;
+	pthread_mutex_lock(&c->lock);
+	TAILQ_INSERT_TAIL(&c->fetching, f, entry);
+	pthread_mutex_unlock(&c->lock);
+}
+
+static void
+s3_cache_fetch_end(struct s3_cache *c, struct s3_cache_fetch *f) {
+	pthread_mutex_lock(&c->lock);
+	TAILQ_REMOVE(&c->fetching, f, entry);
+	pthread_mutex_unlock(&c->lock);
+}
+
+/*
+ * Put a copy of data in memory under name, evicting from the cold end.
+ * Returns -1 without storing it if f's resource was dropped since f
+ * began, as data may then be older than the write that dropped it.
+ */
+static int
+s3_cache_store(struct s3_cache *c, struct s3_cache_fetch *f, const char *etag, const char *data, size_t len, uint64_t fresh_until) {
+	struct s3_cache_entry *e, *cold, **ep;
+	const char *name = f->name;
+	uint64_t hash = s3_cache_hash(name);
+
+	pthread_mutex_lock(&c->lock);
+	if (f->stale) {
+		pthread_mutex_unlock(&c->lock);
+		return -1;
+	}
+	if ((e = *s3_cache_slot(c, name, hash)) != NULL) {
+		s3_cache_unlink(c, e);
+		s3_cache_entry_free(e);
+	}
+
+	e = calloc(1, sizeof (struct s3_cache_entry));
+	e->name = strdup(name);
+	e->hash = hash;
+	strlcpy(e->etag, etag, sizeof (e->etag));
+	e->len = len;
+	e->fresh_until = fresh_until;
+
+	if (s3_cache_entry_size(e) > c->max_bytes) {
+		pthread_mutex_unlock(&c->lock);
+		s3_cache_entry_free(e);
+		return 0;
+	}
+	e->data = malloc(len ? len : 1);
+	memcpy(e->data, data, len);
+
+	while (c->stats.bytes + s3_cache_entry_size(e) > c->max_bytes) {
+		cold = TAILQ_LAST(&c->lru, s3_cache_lru);
+		s3_cache_unlink(c, cold);
+		s3_cache_entry_free(cold);
+		c->stats.evictions++;
+	}
+
+	if (c->stats.entries >= c->nbuckets)
+		s3_cache_grow(c);
+	ep = &c->buckets[hash & (c->nbuckets - 1)];
+	e->chain = *ep;
+	*ep = e;
+	TAILQ_INSERT_HEAD(&c->lru, e, lru);
+	c->stats.entries++;
+	c->stats.bytes += s3_cache_entry_size(e);
+	pthread_mutex_unlock(&c->lock);
+
+	return 0;
+}
+
+/* Wall clock ms, which file times are compared against */
+static uint64_t
+s3_cache_wall_ms(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t
+s3_cache_mtime_ms(const struct stat *st) {
+#ifdef LINUX
+	return (uint64_t)st->st_mtim.tv_sec * 1000 + st->st_mtim.tv_nsec / 1000000;
+#else
+	return (uint64_t)st->st_mtimespec.tv_sec * 1000 + st->st_mtimespec.tv_nsec / 1000000;
+#endif
+}
+
+static void
+s3_cache_path(struct s3_cache *c, const char *name, char *path, size_t size) {
+	snprintf(path, size, "%s/%016llx", c->dir, (unsigned long long)s3_cache_hash(name));
+}
+
+/*
+ * Read name's file: its body into *data, its ETag and when it was last
+ * validated. Returns -1 if there is none, or it belongs to another name
+ * with the same hash.
+ */
+static int
+s3_cache_disk_read(struct s3_cache *c, const char *name, char **data, size_t *len, char *etag, uint64_t *validated) {
+	char path[PATH_MAX], *buf, *p, *end, *nl;
+	struct stat st;
+	ssize_t r;
+	size_t got = 0;
+	int fd;
+
+	s3_cache_path(c, name, path, sizeof (path));
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	buf = malloc(st.st_size + 1);
+	while (got < (size_t)st.st_size) {
+		r = read(fd, buf + got, st.st_size - got);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		got += r;
+	}
+	close(fd);
+
+	/* "name\netag\n" and the body */
+	p = buf;
+	end = buf + got;
+	if ((nl = memchr(p, '\n', end - p)) == NULL || (size_t)(nl - p) != strlen(name) ||
+	    memcmp(p, name, nl - p) != 0)
+		goto fail;
+	p = nl + 1;
+	if ((nl = memchr(p, '\n', end - p)) == NULL || nl - p >= S3_ETAG_LENGTH)
+		goto fail;
+	memcpy(etag, p, nl - p);
+	etag[nl - p] = '\0';
+	p = nl + 1;
+
+	*len = end - p;
+	memmove(buf, p, *len);
+	*data = buf;
+	*validated = s3_cache_mtime_ms(&st);
+	return 0;
+
+fail:
+	free(buf);
+	return -1;
+}
+
+/* A cache file of size bytes was added, or with a negative size removed */
+static void
+s3_cache_disk_account(struct s3_cache *c, off_t size) {
+	int over;
+
+	pthread_mutex_lock(&c->lock);
+	if (size < 0 && (size_t)-size > c->stats.disk_bytes)
+		c->stats.disk_bytes = 0;
+	else
+		c->stats.disk_bytes += size;
+	over = c->max_disk_bytes > 0 && c->stats.disk_bytes > c->max_disk_bytes;
+	pthread_mutex_unlock(&c->lock);
+
+	if (over)
+		s3_cache_disk_trim(c);
+}
+
+static off_t
+s3_cache_file_size(const char *path) {
+	struct stat st;
+
+	return stat(path, &st) == 0 ? st.st_size : 0;
+}
+
+/* Replaced with a rename so readers never see half a file */
+static void
+s3_cache_disk_write(struct s3_cache *c, const char *name, const char *etag, const char *data, size_t len) {
+	char path[PATH_MAX], tmp[PATH_MAX + 8];
+	off_t old, size;
+	FILE *f;
+	int fd, ok;
+
+	s3_cache_path(c, name, path, sizeof (path));
+	snprintf(tmp, sizeof (tmp), "%s.XXXXXX", path);
+	if ((fd = mkstemp(tmp)) < 0)
+		return;
+	if ((f = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+
+	ok = fprintf(f, "%s\n%s\n", name, etag) > 0 && fwrite(data, 1, len, f) == len;
+	size = ok ? ftello(f) : 0;
+	if (fclose(f) != 0 || !ok) {
+		unlink(tmp);
+		return;
+	}
+	old = s3_cache_file_size(path);
+	if (rename(tmp, path) < 0) {
+		unlink(tmp);
+		return;
+	}
+	s3_cache_disk_account(c, size - old);
+}
+
+static void
+s3_cache_disk_remove(struct s3_cache *c, const char *name) {
+	char path[PATH_MAX];
+	off_t size;
+
+	s3_cache_path(c, name, path, sizeof (path));
+	size = s3_cache_file_size(path);
+	if (unlink(path) == 0)
+		s3_cache_disk_account(c, -size);
+}
+
+struct s3_cache_file {
+	char name[S3_CACHE_FILE_NAME + 1];
+	uint64_t mtime;
+	off_t size;
+};
+
+static int
+s3_cache_file_cmp(const void *a, const void *b) {
+	uint64_t x = ((const struct s3_cache_file *)a)->mtime, y = ((const struct s3_cache_file *)b)->mtime;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Cache files are named by 16 hex digits; anything else is left alone */
+static int
+s3_cache_file_name(const char *name) {
+	return strlen(name) == S3_CACHE_FILE_NAME && strspn(name, "0123456789abcdef") == S3_CACHE_FILE_NAME;
+}
+
+/*
+ * Add up the files in the cache directory, and if they are over the
+ * bound remove the least recently validated until they are comfortably
+ * under it, so that not every write has to scan the directory. The
+ * directory may be shared, so the total is recounted each time.
+ */
+static void
+s3_cache_disk_trim(struct s3_cache *c) {
+	struct s3_cache_file *files = NULL, *nf;
+	char path[PATH_MAX];
+	struct dirent *de;
+	struct stat st;
+	size_t n = 0, cap = 0, i, target;
+	uint64_t total = 0, evicted = 0;
+	DIR *d;
+
+	/* Whoever is trimming already will get the total under the bound */
+	if (pthread_mutex_trylock(&c->trim_lock) != 0)
+		return;
+	if ((d = opendir(c->dir)) == NULL) {
+		pthread_mutex_unlock(&c->trim_lock);
+		return;
+	}
+
+	while ((de = readdir(d)) != NULL) {
+		if (!s3_cache_file_name(de->d_name))
+			continue;
+		snprintf(path, sizeof (path), "%s/%s", c->dir, de->d_name);
+		if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+			continue;
+		if (n == cap) {
+			cap = cap ? 2 * cap : 256;
+			if ((nf = realloc(files, cap * sizeof (struct s3_cache_file))) == NULL)
+				break;
+			files = nf;
+		}
+		strlcpy(files[n].name, de->d_name, sizeof (files[n].name));
+		files[n].mtime = s3_cache_mtime_ms(&st);
+		files[n].size = st.st_size;
+		total += st.st_size;
+		n++;
+	}
+	closedir(d);
+
+	if (c->max_disk_bytes > 0 && total > c->max_disk_bytes) {
+		target = c->max_disk_bytes - c->max_disk_bytes / 8;
+		qsort(files, n, sizeof (struct s3_cache_file), s3_cache_file_cmp);
+		for (i = 0; i < n && total > target; i++) {
+			snprintf(path, sizeof (path), "%s/%s", c->dir, files[i].name);
+			if (unlink(path) == 0) {
+				total -= files[i].size;
+				evicted++;
+			}
+		}
+	}
+	free(files);
+
+	pthread_mutex_lock(&c->lock);
+	c->stats.disk_bytes = total;
+	c->stats.disk_evictions += evicted;
+	pthread_mutex_unlock(&c->lock);
+
+	pthread_mutex_unlock(&c->trim_lock);
+}
+
+/* Revalidated just now */
+static void
+s3_cache_disk_touch(struct s3_cache *c, const char *name) {
+	char path[PATH_MAX];
+
+	s3_cache_path(c, name, path, sizeof (path));
+	(void) utimes(path, NULL);
+}
+
+static void
+s3_cache_append(struct s3_string *out, const char *data, size_t len) {
+	(void) s3_string_curl_writefunc((void *)data, 1, len, out);
+}
+
+/*
+ * Look name up in memory, then on disk. A fresh entry is appended to
+ * out. A stale one is handed back as a copy in *data with its ETag, so
+ * that a 304 can be answered even if the entry is evicted meanwhile.
+ */
+static enum s3_cache_state
+s3_cache_lookup(struct s3_cache *c, struct s3_cache_fetch *f, struct s3_string *out, char **data, size_t *len, char *etag) {
+	const char *name = f->name;
+	struct s3_cache_entry *e;
+	uint64_t now = s3_now_ms(), validated, wall;
+
+	pthread_mutex_lock(&c->lock);
+	if ((e = *s3_cache_slot(c, name, s3_cache_hash(name))) != NULL) {
+		TAILQ_REMOVE(&c->lru, e, lru);
+		TAILQ_INSERT_HEAD(&c->lru, e, lru);
+		if (now < e->fresh_until) {
+			s3_cache_append(out, e->data, e->len);
+			c->stats.hits++;
+			pthread_mutex_unlock(&c->lock);
+			return S3_CACHE_FRESH;
+		}
+		*data = malloc(e->len ? e->len : 1);
+		memcpy(*data, e->data, e->len);
+		*len = e->len;
+		strlcpy(etag, e->etag, S3_ETAG_LENGTH);
+		pthread_mutex_unlock(&c->lock);
+		return S3_CACHE_STALE;
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	if (c->dir == NULL || s3_cache_disk_read(c, name, data, len, etag, &validated) < 0)
+		return S3_CACHE_MISS;
+
+	wall = s3_cache_wall_ms();
+	if (validated <= wall && wall - validated < (uint64_t)c->ttl_ms) {
+		s3_cache_append(out, *data, *len);
+		s3_cache_store(c, f, etag, *data, *len, now + c->ttl_ms - (wall - validated));
+		free(*data);
+		*data = NULL;
+		s3_cache_count(c, &c->stats.disk_hits);
+		return S3_CACHE_FRESH;
+	}
+	return S3_CACHE_STALE;
+}
+
+/* Forget name, and spoil GETs of it under way */
+static void
+s3_cache_drop(struct s3_cache *c, const char *name) {
+	struct s3_cache_entry *e;
+	struct s3_cache_fetch *f;
+
+	pthread_mutex_lock(&c->lock);
+	if ((e = *s3_cache_slot(c, name, s3_cache_hash(name))) != NULL) {
+		s3_cache_unlink(c, e);
+		s3_cache_entry_free(e);
+	}
+	TAILQ_FOREACH(f, &c->fetching, entry)
+		if (strcmp(f->name, name) == 0)
+			f->stale = 1;
+	pthread_mutex_unlock(&c->lock);
+
+	if (c->dir)
+		s3_cache_disk_remove(c, name);
+}
+
+/*
+ * The op changed or removed its resource: forget it. Only the part of
+ * the resource before any subresource names the object.
+ */
+void
+s3_cache_invalidate_op(struct s3_op *op) {
+	char name[S3_OP_SCRATCH];
+	size_t n = strcspn(op->resource, "?");
+
+	if (n >= sizeof (name))
+		return;
+	memcpy(name, op->resource, n);
+	name[n] = '\0';
+	s3_cache_drop(op->s3->cache, name);
+}
+
+/* Drop key from the context's cache, e.g. after it was changed elsewhere */
+void
+s3_cache_invalidate(struct S3 *s3, const char *bucket, const char *key) {
+	struct s3_op op;
+
+	if (s3->cache == NULL)
+		return;
+	s3_op_init(&op, s3, "GET", bucket, key, NULL, NULL);
+	s3_cache_drop(s3->cache, op.resource);
+	s3_op_free(&op);
+}
+
+/*
+ * s3_get through the cache. A fresh hit makes no request and reports
+ * a 200 with no attempts; a revalidated one reports the 304 as a 200.
+ */
+struct s3_result
+s3_cache_get(struct S3 *s3, const char *bucket, const char *key, struct s3_string *out) {
+	struct s3_cache *c = s3->cache;
+	struct s3_cache_fetch f;
+	struct s3_op op;
+	struct s3_result result;
+	enum s3_cache_state state;
+	char etag[S3_ETAG_LENGTH], hdr[S3_ETAG_LENGTH + 32];
+	char *data = NULL;
+	size_t len = 0, start = out->len;
+
+	s3_op_init(&op, s3, "GET", bucket, key, NULL, NULL);
+
+	s3_cache_fetch_begin(c, &f, op.resource);
+	state = s3_cache_lookup(c, &f, out, &data, &len, etag);
+	if (state == S3_CACHE_FRESH) {
+		s3_cache_fetch_end(c, &f);
+		s3_op_free(&op);
+		memset(&result, 0, sizeof (result));
+		result.status = 200;
+		return result;
+	}
+
+	op.out = s3_sink_init_string(&op.out_store, out);
+	if (state == S3_CACHE_STALE) {
+		snprintf(hdr, sizeof (hdr), "If-None-Match: %s", etag);
+		op.headers = curl_slist_append(op.headers, hdr);
+	}
+
+	s3_perform_op(&op);
+
+	if (state == S3_CACHE_STALE && op.result.error == 0 && op.result.status == 304) {
+		s3_cache_append(out, data, len);
+		if (s3_cache_store(c, &f, etag, data, len, s3_now_ms() + c->ttl_ms) == 0 && c->dir)
+			s3_cache_disk_touch(c, op.resource);
+		op.result.status = 200;
+		s3_cache_count(c, &c->stats.revalidations);
+	} else {
+		s3_cache_count(c, &c->stats.misses);
+		if (op.result.error == 0 && op.result.status == 200 && op.etag[0]) {
+			/*
+			 * The file goes first: a drop from here on either
+			 * spoils the store, which takes the file back out,
+			 * or comes after it and removes both.
+			 */
+			if (c->dir)
+				s3_cache_disk_write(c, op.resource, op.etag, out->ptr + start, out->len - start);
+			if (s3_cache_store(c, &f, op.etag, out->ptr + start, out->len - start, s3_now_ms() + c->ttl_ms) < 0 && c->dir)
+				s3_cache_disk_remove(c, op.resource);
+		} else if (op.result.error == 0 && (op.result.status == 200 || op.result.status == 404)) {
+			/* Gone, or can't be revalidated without an ETag */
+			s3_cache_drop(c, op.resource);
+		}
+	}
+
+	s3_cache_fetch_end(c, &f);
+	free(data);
+	result = op.result;
+	s3_op_free(&op);
+
+	return result;
+}
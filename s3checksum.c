@@ -0,0 +1,317 @@
+/*
+ * Copyright (c) 2014, Ian Delahorne <ian.delahorne@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Incremental CRC32C and CRC64NVME, the checksums S3 accepts in the
+ * x-amz-checksum-* headers. Both are reflected CRCs. On x86-64 CRC32C
+ * uses the SSE4.2 crc32 instruction and CRC64NVME folds 64 bytes at a
+ * time with PCLMULQDQ; otherwise, and for short buffers, slicing-by-8
+ * tables are used. The choice is made once at run time.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include <openssl/evp.h>
+
+#include "s3.h"
+#include "s3internal.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define S3_CRC_X86
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+#define S3_CRC32C_POLY		0x82f63b78U		/* reflected */
+#define S3_CRC64NVME_POLY	0x9a6c9329ac4bc9b5ULL	/* reflected */
+
+static uint32_t crc32c_table[8][256];
+static uint64_t crc64_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static uint32_t (*crc32c_impl)(uint32_t, const unsigned char *, size_t);
+static uint64_t (*crc64_impl)(uint64_t, const unsigned char *, size_t);
+
+/*
+ * Eight bytes as a little-endian word, whatever the host's byte order;
+ * compilers turn this into a plain load where they can.
+ */
+static inline uint64_t
+s3_load_le64(const unsigned char *p) {
+	return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 |
+	    (uint64_t)p[3] << 24 | (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+	    (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+uint32_t
+s3_crc32c_sw(uint32_t crc, const void *data, size_t len) {
+	const unsigned char *p = data;
+	uint64_t v;
+
+	crc = ~crc;
+	for (; len >= 8; len -= 8, p += 8) {
+		v = s3_load_le64(p) ^ crc;
+		crc = crc32c_table[7][v & 0xff] ^ crc32c_table[6][(v >> 8) & 0xff] ^
+		    crc32c_table[5][(v >> 16) & 0xff] ^ crc32c_table[4][(v >> 24) & 0xff] ^
+		    crc32c_table[3][(v >> 32) & 0xff] ^ crc32c_table[2][(v >> 40) & 0xff] ^
+		    crc32c_table[1][(v >> 48) & 0xff] ^ crc32c_table[0][v >> 56];
+	}
+	while (len--)
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+/* The raw register update, without the pre and post inversion */
+static uint64_t
+s3_crc64_bytes(uint64_t crc, const unsigned char *p, size_t len) {
+	uint64_t v;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		v = s3_load_le64(p) ^ crc;
+		crc = crc64_table[7][v & 0xff] ^ crc64_table[6][(v >> 8) & 0xff] ^
+		    crc64_table[5][(v >> 16) & 0xff] ^ crc64_table[4][(v >> 24) & 0xff] ^
+		    crc64_table[3][(v >> 32) & 0xff] ^ crc64_table[2][(v >> 40) & 0xff] ^
+		    crc64_table[1][(v >> 48) & 0xff] ^ crc64_table[0][v >> 56];
+	}
+	while (len--)
+		crc = crc64_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+uint64_t
+s3_crc64nvme_sw(uint64_t crc, const void *data, size_t len) {
+	return ~s3_crc64_bytes(~crc, data, len);
+}
+
+static uint32_t
+s3_crc32c_table_impl(uint32_t crc, const unsigned char *p, size_t len) {
+	return s3_crc32c_sw(crc, p, len);
+}
+
+static uint64_t
+s3_crc64_table_impl(uint64_t crc, const unsigned char *p, size_t len) {
+	return s3_crc64nvme_sw(crc, p, len);
+}
+
+#ifdef S3_CRC_X86
+__attribute__((target("sse4.2")))
+static uint32_t
+s3_crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len) {
+	uint64_t c = ~crc & 0xffffffffU, v;
+
+	for (; len > 0 && ((uintptr_t)p & 7); len--)
+		c = _mm_crc32_u8((uint32_t)c, *p++);
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&v, p, 8);
+		c = _mm_crc32_u64(c, v);
+	}
+	for (; len > 0; len--)
+		c = _mm_crc32_u8((uint32_t)c, *p++);
+
+	return ~(uint32_t)c;
+}
+
+/*
+ * Folding constants x^n mod P, bit-reflected. A 128-bit lane holding
+ * L:H is carried d bits further along by multiplying L by x^(d+63) and
+ * H by x^(d-1) mod P; clmul of reflected operands supplies the last x.
+ */
+static uint64_t crc64_fold512[2];
+static uint64_t crc64_fold128[2];
+
+static uint64_t
+s3_xpow_mod(unsigned int n) {
+	const uint64_t poly = 0xad93d23594c93659ULL;	/* S3_CRC64NVME_POLY unreflected */
+	uint64_t r = 1, rev = 0;
+	int i;
+
+	while (n--)
+		r = (r << 1) ^ (r >> 63 ? poly : 0);
+	for (i = 0; i < 64; i++)
+		rev |= ((r >> i) & 1) << (63 - i);
+
+	return rev;
+}
+
+__attribute__((target("pclmul,sse4.1")))
+static __m128i
+s3_fold(__m128i x, __m128i k, __m128i data) {
+	return _mm_xor_si128(data, _mm_xor_si128(
+	    _mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11)));
+}
+
+__attribute__((target("pclmul,sse4.1")))
+static uint64_t
+s3_crc64_pclmul(uint64_t crc, const unsigned char *p, size_t len) {
+	__m128i x0, x1, x2, x3, k512, k128;
+	unsigned char tail[16];
+	uint64_t c = ~crc;
+
+	if (len < 128)
+		return ~s3_crc64_bytes(c, p, len);
+
+	k512 = _mm_set_epi64x(crc64_fold512[1], crc64_fold512[0]);
+	k128 = _mm_set_epi64x(crc64_fold128[1], crc64_fold128[0]);
+
+	/* The register is folded in by xoring it over the first 8 bytes */
+	x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)p), _mm_cvtsi64_si128(c));
+	x1 = _mm_loadu_si128((const __m128i *)(p + 16));
+	x2 = _mm_loadu_si128((const __m128i *)(p + 32));
+	x3 = _mm_loadu_si128((const __m128i *)(p + 48));
+	p += 64;
+	len -= 64;
+
+	for (; len >= 64; len -= 64, p += 64) {
+		x0 = s3_fold(x0, k512, _mm_loadu_si128((const __m128i *)p));
+		x1 = s3_fold(x1, k512, _mm_loadu_si128((const __m128i *)(p + 16)));
+		x2 = s3_fold(x2, k512, _mm_loadu_si128((const __m128i *)(p + 32)));
+		x3 = s3_fold(x3, k512, _mm_loadu_si128((const __m128i *)(p + 48)));
+	}
+
+	x1 = s3_fold(x0, k128, x1);
+	x2 = s3_fold(x1, k128, x2);
+	x3 = s3_fold(x2, k128, x3);
+	for (; len >= 16; len -= 16, p += 16)
+		x3 = s3_fold(x3, k128, _mm_loadu_si128((const __m128i *)p));
+
+	/* Reduce the last 128 bits, then the tail, with the tables */
+	_mm_storeu_si128((__m128i *)tail, x3);
+	c = s3_crc64_bytes(0, tail, 16);
+
+	return ~s3_crc64_bytes(c, p, len);
+}
+#endif
+
+static void
+s3_crc_init(void) {
+	uint32_t c32;
+	uint64_t c64;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		c32 = i;
+		c64 = i;
+		for (j = 0; j < 8; j++) {
+			c32 = (c32 >> 1) ^ (c32 & 1 ? S3_CRC32C_POLY : 0);
+			c64 = (c64 >> 1) ^ (c64 & 1 ? S3_CRC64NVME_POLY : 0);
+		}
+		crc32c_table[0][i] = c32;
+		crc64_table[0][i] = c64;
+	}
+	for (i = 0; i < 256; i++) {
+		for (j = 1; j < 8; j++) {
+			crc32c_table[j][i] = crc32c_table[0][crc32c_table[j - 1][i] & 0xff] ^ (crc32c_table[j - 1][i] >> 8);
+			crc64_table[j][i] = crc64_table[0][crc64_table[j - 1][i] & 0xff] ^ (crc64_table[j - 1][i] >> 8);
+		}
+	}
+
+	crc32c_impl = s3_crc32c_table_impl;
+	crc64_impl = s3_crc64_table_impl;
+#ifdef S3_CRC_X86
+	if (__builtin_cpu_supports("sse4.2"))
+		crc32c_impl = s3_crc32c_sse42;
+	if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+		crc64_fold512[0] = s3_xpow_mod(512 + 63);
+		crc64_fold512[1] = s3_xpow_mod(512 - 1);
+		crc64_fold128[0] = s3_xpow_mod(128 + 63);
+		crc64_fold128[1] = s3_xpow_mod(128 - 1);
+		crc64_impl = s3_crc64_pclmul;
+	}
+#endif
+}
+
+/* Tables and dispatch, for callers of the _sw variants */
+void
+s3_crc_setup(void) {
+	pthread_once(&crc_once, s3_crc_init);
+}
+
+/* Continue a CRC32C over len more bytes; start from 0 */
+uint32_t
+s3_crc32c(uint32_t crc, const void *data, size_t len) {
+	s3_crc_setup();
+	return crc32c_impl(crc, data, len);
+}
+
+/* Continue a CRC64NVME over len more bytes; start from 0 */
+uint64_t
+s3_crc64nvme(uint64_t crc, const void *data, size_t len) {
+	s3_crc_setup();
+	return crc64_impl(crc, data, len);
+}
+
+void
+s3_checksum_init(struct s3_checksum *ck, enum s3_checksum_type type) {
+	ck->type = type;
+	ck->crc = 0;
+}
+
+void
+s3_checksum_update(struct s3_checksum *ck, const void *data, size_t len) {
+	switch (ck->type) {
+	case S3_CHECKSUM_CRC32C:
+		ck->crc = s3_crc32c((uint32_t)ck->crc, data, len);
+		break;
+	case S3_CHECKSUM_CRC64NVME:
+		ck->crc = s3_crc64nvme(ck->crc, data, len);
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * The checksum as sent in x-amz-checksum-*: the big-endian CRC, base64
+ * encoded. out holds S3_CHECKSUM_LENGTH bytes.
+ */
+void
+s3_checksum_base64(const struct s3_checksum *ck, char *out) {
+	unsigned char be[8];
+	int n = ck->type == S3_CHECKSUM_CRC32C ? 4 : 8;
+	int i;
+
+	if (ck->type == S3_CHECKSUM_NONE) {
+		*out = '\0';
+		return;
+	}
+	for (i = 0; i < n; i++)
+		be[i] = ck->crc >> (8 * (n - 1 - i));
+	EVP_EncodeBlock((unsigned char *)out, be, n);
+}
+
+/* Header name suffix, as in x-amz-checksum-crc32c */
+const char *
+s3_checksum_name(enum s3_checksum_type type) {
+	switch (type) {
+	case S3_CHECKSUM_CRC32C:
+		return "crc32c";
+	case S3_CHECKSUM_CRC64NVME:
+		return "crc64nvme";
+	default:
+		return NULL;
+	}
+}
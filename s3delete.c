@@ -0,0 +1,279 @@
+/*
+ * Copyright (c) 2014, Ian Delahorne <ian.delahorne@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Multi-Object Delete: keys are sent S3_DELETE_MAX_KEYS to a POST
+ * ?delete request, several requests at a time. S3 answers each with
+ * the keys it deleted (unless asked to be quiet) and the ones it
+ * couldn't, which are handed back to the caller.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "s3.h"
+#include "s3internal.h"
+
+#ifdef LINUX
+#include <bsd/string.h>
+#endif
+#include <string.h>
+
+struct s3_deleter;
+
+struct s3_delete_chunk {
+	struct s3_deleter *d;
+	size_t first;		/* index into keys */
+	size_t n;
+	struct s3_string *body;
+	struct s3_string *out;
+};
+
+struct s3_deleter {
+	struct S3 *s3;
+	struct s3_batch *batch;
+	const char *bucket;
+	const char * const *keys;
+	size_t nkeys;
+	size_t next;
+	int quiet;
+	struct s3_delete_error_head *errors;
+};
+
+static void
+s3_delete_error_add(struct s3_delete_error_head *errors, const char *key, const char *code, const char *message) {
+	struct s3_delete_error *e = calloc(1, sizeof (struct s3_delete_error));
+
+	e->key = strdup(key);
+	strlcpy(e->code, code ? code : "", sizeof (e->code));
+	e->message = message ? strdup(message) : NULL;
+	TAILQ_INSERT_TAIL(errors, e, list);
+}
+
+void
+s3_delete_errors_free(struct s3_delete_error_head *errors) {
+	struct s3_delete_error *e;
+
+	while ((e = TAILQ_FIRST(errors)) != NULL) {
+		TAILQ_REMOVE(errors, e, list);
+		free(e->key);
+		free(e->message);
+		free(e);
+	}
+	free(errors);
+}
+
+/* Append s with the five XML special characters escaped */
+static void
+s3_xml_escape_append(struct s3_string *str, const char *s) {
+	const char *rep;
+	size_t n;
+
+	for (; *s; s += n) {
+		n = strcspn(s, "&<>\"'");
+		s3_string_curl_writefunc((void *)s, 1, n, str);
+		if (s[n] == '\0')
+			break;
+		switch (s[n]) {
+		case '&':
+			rep = "&amp;";
+			break;
+		case '<':
+			rep = "&lt;";
+			break;
+		case '>':
+			rep = "&gt;";
+			break;
+		case '"':
+			rep = "&quot;";
+			break;
+		default:
+			rep = "&apos;";
+			break;
+		}
+		s3_string_curl_writefunc((void *)rep, 1, strlen(rep), str);
+		n++;
+	}
+}
+
+static void
+s3_string_append(struct s3_string *str, const char *s) {
+	s3_string_curl_writefunc((void *)s, 1, strlen(s), str);
+}
+
+static char *
+s3_xml_child_text(xmlNodePtr node, const char *name) {
+	xmlNodePtr c;
+	xmlChar *value;
+	char *text;
+
+	for (c = node->children; c; c = c->next) {
+		if (c->type != XML_ELEMENT_NODE || strcmp((const char *)c->name, name) != 0)
+			continue;
+		value = xmlNodeGetContent(c);
+		text = strdup((const char *)value);
+		xmlFree(value);
+		return text;
+	}
+	return NULL;
+}
+
+static void
+s3_delete_errors_cb(xmlNodeSetPtr nodes, void *data) {
+	struct s3_delete_error_head *errors = data;
+	char *key, *code, *message;
+	int i;
+
+	if (nodes == NULL)
+		return;
+
+	for (i = 0; i < nodes->nodeNr; i++) {
+		key = s3_xml_child_text(nodes->nodeTab[i], "Key");
+		code = s3_xml_child_text(nodes->nodeTab[i], "Code");
+		message = s3_xml_child_text(nodes->nodeTab[i], "Message");
+		if (key)
+			s3_delete_error_add(errors, key, code, message);
+		free(key);
+		free(code);
+		free(message);
+	}
+}
+
+/*
+ * Pick the per-key errors out of a DeleteResult. Returns -1 if the body
+ * isn't one, which S3 may send with a 200 when the request failed.
+ */
+static int
+s3_delete_parse(const char *xml, size_t len, struct s3_delete_error_head *errors) {
+	xmlDocPtr doc;
+	xmlNodePtr root;
+
+	if ((doc = xmlReadMemory(xml, len, "noname.xml", NULL, 0)) == NULL)
+		return -1;
+	root = xmlDocGetRootElement(doc);
+	if (root == NULL || strcmp((const char *)root->name, "DeleteResult") != 0) {
+		xmlFreeDoc(doc);
+		return -1;
+	}
+	s3_execute_xpath_expr(doc, (const xmlChar *)"/amzn:DeleteResult/amzn:Error", s3_delete_errors_cb, errors);
+	xmlFreeDoc(doc);
+
+	return 0;
+}
+
+static void s3_delete_queue_chunk(struct s3_deleter *d);
+
+static void
+s3_delete_chunk_done(struct s3_op *op, void *arg) {
+	struct s3_delete_chunk *c = arg;
+	struct s3_deleter *d = c->d;
+	size_t i;
+
+	/* A request that failed outright takes all of its keys with it */
+	if (!S3_RESULT_OK(&op->result) || s3_delete_parse(c->out->ptr, c->out->len, d->errors) < 0) {
+		for (i = 0; i < c->n; i++)
+			s3_delete_error_add(d->errors, d->keys[c->first + i],
+			    op->result.code[0] ? op->result.code : "InternalError", NULL);
+	}
+
+	/* The op's own resource doesn't name the keys */
+	for (i = 0; i < c->n; i++) {
+		s3_cache_invalidate(d->s3, d->bucket, d->keys[c->first + i]);
+		s3_list_cache_invalidate(d->s3, d->bucket, d->keys[c->first + i]);
+	}
+
+	s3_string_free(c->body);
+	s3_string_free(c->out);
+	free(c);
+
+	if (d->next < d->nkeys)
+		s3_delete_queue_chunk(d);
+}
+
+static void
+s3_delete_queue_chunk(struct s3_deleter *d) {
+	struct s3_delete_chunk *c = calloc(1, sizeof (struct s3_delete_chunk));
+	struct s3_op *op = malloc(sizeof (struct s3_op));
+	size_t i;
+
+	c->d = d;
+	c->first = d->next;
+	c->n = d->nkeys - d->next < S3_DELETE_MAX_KEYS ? d->nkeys - d->next : S3_DELETE_MAX_KEYS;
+	d->next += c->n;
+
+	c->body = s3_string_init();
+	s3_string_reserve(c->body, 64 + c->n * 48);
+	s3_string_append(c->body, "<Delete>");
+	if (d->quiet)
+		s3_string_append(c->body, "<Quiet>true</Quiet>");
+	for (i = 0; i < c->n; i++) {
+		s3_string_append(c->body, "<Object><Key>");
+		s3_xml_escape_append(c->body, d->keys[c->first + i]);
+		s3_string_append(c->body, "</Key></Object>");
+	}
+	s3_string_append(c->body, "</Delete>");
+	c->out = s3_string_init();
+
+	/* The body's Content-MD5, which S3 requires here, comes with the source */
+	s3_op_init(op, d->s3, "POST", d->bucket, NULL, "delete", NULL);
+	s3_op_set_source(op, "application/xml", s3_source_init_buffer(&op->in_store, c->body->ptr, c->body->len));
+	op->out = s3_sink_init_string(&op->out_store, c->out);
+	op->done = s3_delete_chunk_done;
+	op->arg = c;
+
+	s3_batch_add(d->batch, op);
+}
+
+/*
+ * Delete nkeys keys from bucket with Multi-Object Delete requests of up
+ * to S3_DELETE_MAX_KEYS keys, at most parallelism of them in flight.
+ * Quiet requests only list failures in their response. Returns the
+ * keys that could not be deleted, empty if all were; free it with
+ * s3_delete_errors_free().
+ */
+struct s3_delete_error_head *
+s3_delete_many(struct S3 *s3, const char *bucket, const char * const *keys, size_t nkeys, int quiet, int parallelism) {
+	struct s3_deleter d;
+	int i;
+
+	if (parallelism < 1)
+		parallelism = 1;
+
+	memset(&d, 0, sizeof (d));
+	d.s3 = s3;
+	d.bucket = bucket;
+	d.keys = keys;
+	d.nkeys = nkeys;
+	d.quiet = quiet;
+	d.errors = malloc(sizeof (struct s3_delete_error_head));
+	TAILQ_INIT(d.errors);
+
+	d.batch = s3_batch_new(s3, parallelism);
+	for (i = 0; i < parallelism && d.next < nkeys; i++)
+		s3_delete_queue_chunk(&d);
+	s3_batch_wait(d.batch);
+	s3_batch_free(d.batch);
+
+	return d.errors;
+}
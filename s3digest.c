@@ -22,93 +22,189 @@
  * SOFTWARE.  
  */
 
+/*
+ * MD5 bodies are hashed with MD5_CTX on the stack. OpenSSL 3.0
+ * deprecates MD5_* in favour of EVP, which allocates a context per
+ * digest; the 1.1.0 API keeps them without deprecation warnings (see
+ * s3sign.c).
+ */
+#define OPENSSL_API_COMPAT 0x10100000L
+
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
 #include "s3.h"
+#include "s3internal.h"
 
-#include <openssl/engine.h>
 #include <openssl/hmac.h>
 #include <openssl/evp.h>
-#include <openssl/bio.h>
+#include <openssl/md5.h>
+
+/* Base64 encode a digest into a freshly allocated string */
+static char *
+s3_base64(const unsigned char *digest, unsigned int digest_len) {
+	char *buf = malloc(4 * ((digest_len + 2) / 3) + 1);
+
+	EVP_EncodeBlock((unsigned char *)buf, digest, digest_len);
 
+	return buf;
+}
+
+/*
+ * Base64 HMAC-SHA1 of str with key. Requests are signed through the
+ * context's signer, which keeps the keyed state between calls; this is
+ * the one-off equivalent.
+ */
 char *
 s3_hmac_sign(const char *key, const char *str, size_t len) {
-	unsigned char *digest; 
-	char *buf;
-	unsigned int digest_len = EVP_MAX_MD_SIZE; /* HMAC_Final needs at most EVP_MAX_MD_SIZE bytes */
-	HMAC_CTX ctx;
-	BIO *bmem, *b64;
-	BUF_MEM *bufptr;
-	
-	ENGINE_load_builtin_engines();
-	ENGINE_register_all_complete();
-
-	/* Setup HMAC context, init with sha1 and our key*/ 
-	HMAC_CTX_init(&ctx);
-	HMAC_Init_ex(&ctx, key, strlen((char *)key), EVP_sha1(), NULL);
-
-	/* Create Base64 BIO filter that outputs to memory */
-	b64  = BIO_new(BIO_f_base64());
-	bmem = BIO_new(BIO_s_mem());
-	b64  = BIO_push(b64, bmem);
-
-	/* Give us a buffer to write result into */
-	digest = malloc(digest_len);
-
-	/* Push data into HMAC */
-	HMAC_Update(&ctx, (unsigned char *)str, (unsigned int)len);
-
-	/* Flush HMAC data into buffer */
-	HMAC_Final(&ctx, digest, &digest_len);
-
-	/* Write data into BIO, flush and fetch the data */
-	BIO_write(b64, digest, digest_len);
-	(void) BIO_flush(b64);
-	BIO_get_mem_ptr(b64, &bufptr);
-	
-	buf = malloc(bufptr->length);
-	memcpy(buf, bufptr->data, bufptr->length - 1);
-	buf[bufptr->length - 1] = '\0';
-
-	BIO_free_all(b64);
-	HMAC_CTX_cleanup(&ctx);
-
-	ENGINE_cleanup();
-	free(digest);
-	return buf;
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int digest_len;
+
+	HMAC(EVP_sha1(), key, (int)strlen(key), (const unsigned char *)str, len, digest, &digest_len);
+
+	return s3_base64(digest, digest_len);
 }
 
 char *
 s3_md5_sum(const char *content, size_t len) {
+	char *buf = malloc(S3_MD5_LENGTH);
 
-	const EVP_MD *md = EVP_md5();
-	unsigned char *digest;
-	EVP_MD_CTX *ctx;
-	unsigned int digest_len;
-	BIO *bmem, *b64;
-	BUF_MEM *bufptr;
-	char *buf;
-
-	digest = malloc(EVP_MAX_MD_SIZE);
-	
-	ctx = EVP_MD_CTX_create();
-	EVP_DigestInit_ex(ctx, md, NULL);
-	EVP_DigestUpdate(ctx, content, len);
-	EVP_DigestFinal_ex(ctx, digest, &digest_len);
-
-	b64  = BIO_new(BIO_f_base64());
-	bmem = BIO_new(BIO_s_mem());
-	b64  = BIO_push(b64, bmem);
-
-	BIO_write(b64, digest, digest_len);
-	(void) BIO_flush(b64);
-	BIO_get_mem_ptr(b64, &bufptr);
-	
-	buf = malloc(bufptr->length);
-	memcpy(buf, bufptr->data, bufptr->length - 1);
-	buf[bufptr->length - 1] = '\0';
-
-	BIO_free_all(b64);
-	free(digest);
-	EVP_MD_CTX_destroy(ctx);
+	s3_md5_base64(content, len, NULL, buf);
 
 	return buf;
 }
+
+/*
+ * Base64 MD5 of content into out (S3_MD5_LENGTH bytes), also feeding it
+ * to ck when that isn't NULL. Both are run a chunk at a time so the
+ * data is only pulled into cache once.
+ */
+void
+s3_md5_base64(const char *content, size_t len, struct s3_checksum *ck, char *out) {
+	unsigned char digest[MD5_DIGEST_LENGTH];
+	MD5_CTX ctx;
+	size_t n;
+
+	MD5_Init(&ctx);
+	do {
+		n = len < S3_IO_CHUNK_SIZE ? len : S3_IO_CHUNK_SIZE;
+		MD5_Update(&ctx, content, n);
+		if (ck)
+			s3_checksum_update(ck, content, n);
+		content += n;
+		len -= n;
+	} while (len > 0);
+	MD5_Final(digest, &ctx);
+
+	EVP_EncodeBlock((unsigned char *)out, digest, sizeof (digest));
+}
+
+/*
+ * MD5 of len bytes of fd starting at offset, read in fixed size chunks
+ * with pread() so files larger than memory can be summed. ck, if not
+ * NULL, is updated from the same reads.
+ */
+static int
+s3_md5_fd(int fd, off_t offset, size_t len, unsigned char *digest, struct s3_checksum *ck) {
+	MD5_CTX ctx;
+	char *chunk;
+	ssize_t n;
+
+	chunk = malloc(S3_IO_CHUNK_SIZE);
+
+	MD5_Init(&ctx);
+	while (len > 0) {
+		n = pread(fd, chunk, len < S3_IO_CHUNK_SIZE ? len : S3_IO_CHUNK_SIZE, offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		MD5_Update(&ctx, chunk, n);
+		if (ck)
+			s3_checksum_update(ck, chunk, n);
+		offset += n;
+		len -= n;
+	}
+	MD5_Final(digest, &ctx);
+
+	free(chunk);
+
+	return len == 0 ? 0 : -1;
+}
+
+/* Base64 MD5 of part of a file, as sent in Content-MD5. NULL on read errors. */
+char *
+s3_md5_sum_fd(int fd, off_t offset, size_t len) {
+	char *buf = malloc(S3_MD5_LENGTH);
+
+	if (s3_md5_base64_fd(fd, offset, len, NULL, buf) < 0) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+int
+s3_md5_base64_fd(int fd, off_t offset, size_t len, struct s3_checksum *ck, char *out) {
+	unsigned char digest[MD5_DIGEST_LENGTH];
+
+	if (s3_md5_fd(fd, offset, len, digest, ck) < 0)
+		return -1;
+	EVP_EncodeBlock((unsigned char *)out, digest, sizeof (digest));
+
+	return 0;
+}
+
+/*
+ * Hex MD5 of part of a file, comparable to the ETag of an object that
+ * was not uploaded in parts. hex must hold 33 bytes.
+ */
+int
+s3_md5_hex_fd(int fd, off_t offset, size_t len, char *hex) {
+	unsigned char digest[MD5_DIGEST_LENGTH];
+	unsigned int i;
+
+	if (s3_md5_fd(fd, offset, len, digest, NULL) < 0)
+		return -1;
+	for (i = 0; i < sizeof (digest); i++)
+		sprintf(hex + 2 * i, "%02x", digest[i]);
+
+	return 0;
+}
+
+/*
+ * The ETag, without quotes, that S3 gives the first len bytes of fd once
+ * uploaded: the hex MD5, or for an upload in part_size parts as with
+ * s3_put_multipart_fd the hex MD5 of the parts' MD5s and "-" and the
+ * number of parts. part_size 0 means a single PUT. etag must hold
+ * S3_ETAG_LENGTH bytes.
+ */
+int
+s3_etag_fd(int fd, size_t len, size_t part_size, char *etag) {
+	unsigned char digest[MD5_DIGEST_LENGTH], *digests;
+	size_t nparts, i, n;
+
+	if (part_size == 0)
+		return s3_md5_hex_fd(fd, 0, len, etag);
+
+	part_size = s3_multipart_part_size(len, part_size);
+	nparts = len ? (len + part_size - 1) / part_size : 1;
+	digests = malloc(nparts * MD5_DIGEST_LENGTH);
+
+	for (i = 0; i < nparts; i++) {
+		n = len - i * part_size < part_size ? len - i * part_size : part_size;
+		if (s3_md5_fd(fd, i * part_size, n, digests + i * MD5_DIGEST_LENGTH, NULL) < 0) {
+			free(digests);
+			return -1;
+		}
+	}
+	MD5(digests, nparts * MD5_DIGEST_LENGTH, digest);
+	free(digests);
+
+	for (i = 0; i < sizeof (digest); i++)
+		sprintf(etag + 2 * i, "%02x", digest[i]);
+	snprintf(etag + 2 * sizeof (digest), S3_ETAG_LENGTH - 2 * sizeof (digest), "-%zu", nparts);
+
+	return 0;
+}
@@ -25,7 +25,317 @@
 #ifndef _S3_INTERNAL_H
 #define _S3_INTERNAL_H
 
-char * s3_make_date(void);
-void s3_perform_op(struct S3 *s3, const char *method, const char *url, const char *sign_data, const char *date, struct s3_string *out, struct s3_string *in, const char *content_md5, const char *content_type);
+#include <stdarg.h>
+
+#include <curl/curl.h>
+
+#define S3_OP_SCRATCH		1024	/* inline storage for an op's strings */
+#define S3_HANDLE_SCRATCH	4096	/* initial per-handle scratch, grows to fit */
+#define S3_MD5_LENGTH		32	/* base64 MD5 and NUL, with room to spare */
+#define S3_ERROR_BODY_LENGTH	256	/* enough of an error response to find its Code */
+
+/* Bump allocator, see s3arena.c */
+struct s3_arena_block;
+
+struct s3_arena {
+	char *buf;
+	size_t size;
+	size_t used;
+	size_t wanted;		/* asked for since the last reset, overflow included */
+	int owned;		/* buf was malloc'd here and may be resized */
+	struct s3_arena_block *overflow;
+};
+
+void s3_arena_init(struct s3_arena *a, char *buf, size_t size);
+void s3_arena_reset(struct s3_arena *a);
+void s3_arena_release(struct s3_arena *a);
+void * s3_arena_alloc(struct s3_arena *a, size_t len);
+char * s3_arena_strdup(struct s3_arena *a, const char *s);
+char * s3_arena_printf(struct s3_arena *a, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+char * s3_arena_vprintf(struct s3_arena *a, const char *fmt, va_list ap);
+
+/* Request dates, formatted again only when the second changes */
+struct s3_clock {
+	time_t now;
+	char http[32];		/* Sun, 06 Nov 1994 08:49:37 GMT */
+	char amz[17];		/* 19941106T084937Z */
+	char day[9];		/* 19941106 */
+};
+
+void s3_clock_update(struct s3_clock *c);
+
+/*
+ * A CURL easy handle and the memory its requests are built in. Both are
+ * kept while the handle is idle, so a request on a reused handle does
+ * no allocation of its own.
+ */
+struct s3_handle {
+	CURL *curl;
+	SLIST_ENTRY(s3_handle) next;
+	struct s3_arena scratch;	/* signing strings and header nodes */
+	struct s3_clock clock;
+	struct s3_chunker *chunker;	/* aws-chunked framing, once one is sent */
+};
+
+/*
+ * What a thread keeps to itself on a context shared between threads:
+ * its idle handles, and the multi handle its hedged GETs run on.
+ */
+struct s3_thread {
+	struct S3 *s3;
+	SLIST_HEAD(, s3_handle) handles;
+	size_t nidle;
+	CURLM *hedge_multi;	/* created on first use */
+	struct s3_metrics metrics;	/* written by this thread only, see s3metrics.c */
+	SLIST_ENTRY(s3_thread) next;
+};
+
+struct s3_thread * s3_thread_get(struct S3 *s3);
+struct s3_handle * s3_handle_get(struct S3 *s3);
+void s3_handle_put(struct S3 *s3, struct s3_handle *h);
+
+enum s3_source_type {
+	S3_SOURCE_BUFFER,
+	S3_SOURCE_FD,
+	S3_SOURCE_CALLBACK
+};
+
+/* Request body, read in place from wherever the caller keeps it */
+struct s3_source {
+	enum s3_source_type type;
+	const char *buf;
+	int fd;
+	off_t offset;
+	s3_read_func read;
+	void *arg;
+	size_t len;
+	size_t pos;
+};
+
+struct s3_source * s3_source_init_buffer(struct s3_source *src, const char *buf, size_t len);
+struct s3_source * s3_source_init_fd(struct s3_source *src, int fd, off_t offset, size_t len);
+struct s3_source * s3_source_init_callback(struct s3_source *src, s3_read_func read, void *arg, size_t len);
+struct s3_source * s3_source_buffer(const char *buf, size_t len);
+struct s3_source * s3_source_fd(int fd, off_t offset, size_t len);
+struct s3_source * s3_source_callback(s3_read_func read, void *arg, size_t len);
+struct s3_source * s3_source_slice(const struct s3_source *src, size_t offset, size_t len);
+int s3_source_md5(const struct s3_source *src, struct s3_checksum *ck, char *out);
+int s3_source_rewind(struct s3_source *src);
+void s3_source_free(struct s3_source *src);
+size_t s3_source_curl_readfunc(void *ptr, size_t size, size_t nmemb, void *arg);
+int s3_source_curl_seekfunc(void *arg, curl_off_t offset, int origin);
+
+enum s3_sink_type {
+	S3_SINK_STRING,
+	S3_SINK_FD,
+	S3_SINK_BUFFER,
+	S3_SINK_CALLBACK
+};
+
+/* Response body destination */
+struct s3_sink {
+	enum s3_sink_type type;
+	struct s3_string *str;
+	char *buf;
+	size_t size;
+	int fd;
+	off_t offset;
+	s3_write_func write;
+	void *arg;
+	size_t pos;		/* bytes delivered so far */
+	struct s3_checksum checksum;	/* of the body, when the response announced one */
+	char checksum_expected[S3_CHECKSUM_LENGTH];
+};
+
+struct s3_sink * s3_sink_init_string(struct s3_sink *sink, struct s3_string *str);
+struct s3_sink * s3_sink_init_fd(struct s3_sink *sink, int fd, off_t offset);
+struct s3_sink * s3_sink_init_buffer(struct s3_sink *sink, char *buf, size_t size);
+struct s3_sink * s3_sink_init_callback(struct s3_sink *sink, s3_write_func write, void *arg);
+struct s3_sink * s3_sink_string(struct s3_string *str);
+struct s3_sink * s3_sink_fd(int fd, off_t offset);
+struct s3_sink * s3_sink_buffer(char *buf, size_t size);
+struct s3_sink * s3_sink_callback(s3_write_func write, void *arg);
+void s3_sink_expect(struct s3_sink *sink, size_t len);
+int s3_sink_rewind(struct s3_sink *sink);
+void s3_sink_free(struct s3_sink *sink);
+size_t s3_sink_curl_writefunc(void *ptr, size_t size, size_t nmemb, void *arg);
+
+/*
+ * A single request. s3_op_init() fills in what to fetch, callers then
+ * set content and body fields before handing it to s3_perform_op() or
+ * a batch.
+ */
+struct s3_chunker;
+
+enum s3_chunking {
+	S3_CHUNKED_NONE,
+	S3_CHUNKED_UNSIGNED,	/* plain chunks, for a checksum trailer */
+	S3_CHUNKED_SIGNED
+};
+
+struct s3_op {
+	struct S3 *s3;
+	const char *method;
+	char *resource;		/* signed resource, "/bucket/key" */
+	char *url;
+	char content_md5[S3_MD5_LENGTH];	/* empty if not sent */
+	const char *content_type;
+	struct s3_sink *out;	/* response body, owned, discarded if NULL */
+	struct s3_source *in;	/* request body, owned by the op */
+	enum s3_chunking chunked;	/* send the body aws-chunked */
+	enum s3_checksum_type checksum_type;	/* sent with PUT bodies */
+	char checksum[S3_CHECKSUM_LENGTH];	/* precomputed, when not sent as a trailer */
+
+	/* Filled in by s3_op_setup() */
+	struct s3_handle *handle;
+	struct curl_slist *headers;	/* added by the caller, owned by the op */
+	struct curl_slist *request_headers;	/* what is sent: ours, then headers */
+	const char *date;		/* these two live in the handle's scratch */
+	const char *sign_data;		/* until s3_op_finish() */
+	struct s3_chunker *chunker;	/* the handle's, for an aws-chunked body */
+
+	struct s3_result result;
+	size_t content_length;		/* from the response headers */
+	char etag[S3_ETAG_LENGTH];	/* response ETag, quotes included */
+	struct s3_object_info *info;	/* filled in from the headers of a 2xx, if set */
+	char error_body[S3_ERROR_BODY_LENGTH];	/* start of a non-2xx body, kept from out */
+	size_t error_len;
+
+	/* A hedged GET and its duplicate point at each other */
+	struct s3_op *twin;
+	int claimed;			/* this one has written to out */
+
+	/* Batch bookkeeping */
+	struct s3_result *result_out;
+	void (*done)(struct s3_op *op, void *arg);
+	void *arg;
+	s3_done_func on_result;		/* the application's, after done */
+	void *on_result_arg;
+	TAILQ_ENTRY(s3_op) entry;
+	uint64_t not_before;		/* retry backoff, on s3_now_ms() */
+
+	/* Storage for the fields above, so a simple op needs no malloc */
+	struct s3_source in_store;
+	struct s3_sink out_store;
+	struct s3_arena arena;
+	char scratch[S3_OP_SCRATCH];
+};
+
+void s3_md5_base64(const char *content, size_t len, struct s3_checksum *ck, char *out);
+int s3_md5_base64_fd(int fd, off_t offset, size_t len, struct s3_checksum *ck, char *out);
+size_t s3_multipart_part_size(size_t len, size_t part_size);
+
+uint32_t s3_crc32c_sw(uint32_t crc, const void *data, size_t len);
+uint64_t s3_crc64nvme_sw(uint64_t crc, const void *data, size_t len);
+void s3_crc_setup(void);
+const char * s3_checksum_name(enum s3_checksum_type type);
+
+char * s3_url_encode(const char *s);
+char * s3_url_encode_path(const char *s);
+char * s3_arena_url_encode(struct s3_arena *a, const char *s, int keep_slash);
+time_t s3_parse_time(const char *s);
+
+struct s3_signer * s3_signer_new(const char *secret);
+void s3_signer_free(struct s3_signer *sg);
+void s3_signer_v2(struct s3_signer *sg, const char *str, size_t len, char *out);
+void s3_op_sign(struct s3_op *op);
+
+size_t s3_chunked_length(size_t len, int sign, enum s3_checksum_type trailer);
+void s3_chunker_free(struct s3_chunker *c);
+size_t s3_chunker_curl_readfunc(void *ptr, size_t size, size_t nmemb, void *arg);
+int s3_chunker_curl_seekfunc(void *arg, curl_off_t offset, int origin);
+
+void s3_op_init(struct s3_op *op, struct S3 *s3, const char *method, const char *bucket, const char *key, const char *subresource, const char *query);
+void s3_op_set_source(struct s3_op *op, const char *content_type, struct s3_source *src);
+void s3_op_header(struct s3_op *op, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void s3_op_prepare(struct s3_op *op);
+void s3_op_setup(struct s3_op *op);
+void s3_op_finish(struct s3_op *op, int code);
+void s3_op_free(struct s3_op *op);
+void s3_object_info_init(struct s3_object_info *info);
+int s3_op_reset(struct s3_op *op);
+void s3_perform_op(struct s3_op *op);
+
+/* Retries and hedging, see s3retry.c */
+uint64_t s3_now_ms(void);
+void s3_sleep_ms(int ms);
+int s3_op_retry(struct s3_op *op);
+struct s3_result s3_cache_get(struct S3 *s3, const char *bucket, const char *key, struct s3_string *out);
+void s3_cache_invalidate_op(struct s3_op *op);
+
+/* A listing being fetched for the cache, see s3listcache.c */
+struct s3_list_fetch {
+	char *name;
+	int stale;		/* a write under the prefix completed meanwhile */
+	TAILQ_ENTRY(s3_list_fetch) entry;
+};
+
+int s3_list_cache_lookup(struct S3 *s3, const char *bucket, const char *prefix, struct s3_bucket_entry_head **entries, struct s3_list_fetch *f);
+void s3_list_cache_store(struct S3 *s3, struct s3_list_fetch *f, const struct s3_bucket_entry_head *entries, int error);
+void s3_list_cache_invalidate_op(struct s3_op *op);
+void s3_list_cache_invalidate(struct S3 *s3, const char *bucket, const char *key);
+
+void s3_metrics_record(struct s3_op *op);
+void s3_metrics_add(struct s3_metrics *to, const struct s3_metrics *from);
+
+struct s3_hedger * s3_hedger_new(void);
+void s3_hedger_free(struct s3_hedger *hg);
+int s3_hedge_delay(struct S3 *s3);
+void s3_perform_hedged(struct s3_op *op, int delay_ms);
+
+/* One <Contents> entry of a listing; strings only valid during the callback */
+struct s3_list_item {
+	const char *key;
+	const char *lastmod;
+	const char *etag;
+	size_t size;
+};
+
+typedef void (*s3_list_entry_cb)(void *arg, const struct s3_list_item *item);
+typedef void (*s3_list_prefix_cb)(void *arg, const char *prefix);
+
+/* Streaming ListBucketResult parser, see s3bucket.c */
+struct s3_list_parser {
+	xmlSAXHandler sax;
+	xmlParserCtxtPtr ctxt;
+	s3_list_entry_cb entry_cb;
+	s3_list_prefix_cb prefix_cb;
+	void *arg;
+
+	int depth;
+	int section;
+	int is_error;
+	int failed;
+	struct s3_string *field;	/* text being collected, if any */
+
+	struct s3_string *key;
+	struct s3_string *lastmod;
+	struct s3_string *etag;
+	struct s3_string *size;
+	struct s3_string *prefix;
+
+	/* Page state, valid once the response has been parsed */
+	struct s3_string *truncated;
+	struct s3_string *next_marker;
+	struct s3_string *continuation;
+	struct s3_string *error_code;
+	struct s3_string *last_key;
+	size_t nentries;
+	size_t nprefixes;
+};
+
+struct s3_list_parser * s3_list_parser_new(s3_list_entry_cb entry_cb, s3_list_prefix_cb prefix_cb, void *arg);
+void s3_list_parser_begin(struct s3_list_parser *p);
+size_t s3_list_parser_write(const void *ptr, size_t len, void *arg);
+int s3_list_parser_finish(struct s3_list_parser *p);
+int s3_list_parser_truncated(struct s3_list_parser *p);
+void s3_list_parser_free(struct s3_list_parser *p);
+
+int s3_list_walk(struct S3 *s3, const char *bucket, const struct s3_list_options *opts, s3_list_entry_cb entry_cb, s3_list_prefix_cb prefix_cb, void *arg);
+int s3_list_page(struct S3 *s3, const char *bucket, const struct s3_list_options *opts, s3_list_entry_cb entry_cb, s3_list_prefix_cb prefix_cb, void *arg);
+struct s3_list_iter * s3_list_iter_range(struct S3 *s3, const char *bucket, const struct s3_list_options *opts, const char *end, struct s3_batch *batch);
+
+void s3_batch_add(struct s3_batch *b, struct s3_op *op);
+int s3_batch_step(struct s3_batch *b, int timeout_ms);
 
 #endif //_S3_INTERNAL_H
@@ -0,0 +1,346 @@
+/*
+ * Copyright (c) 2014, Ian Delahorne <ian.delahorne@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Request and response bodies. A source hands curl bytes straight from
+ * where the caller keeps them - a buffer, a file descriptor or a read
+ * callback - so uploads never stage a copy of the payload. A sink is
+ * the same in the other direction.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <curl/curl.h>
+
+#include "s3.h"
+#include "s3internal.h"
+
+/*
+ * The s3_source_init_* and s3_sink_init_* functions fill in storage the
+ * caller provides, such as the op's own; the plain constructors
+ * allocate it.
+ */
+struct s3_source *
+s3_source_init_buffer(struct s3_source *src, const char *buf, size_t len) {
+	memset(src, 0, sizeof (*src));
+	src->type = S3_SOURCE_BUFFER;
+	src->buf = buf;
+	src->len = len;
+
+	return src;
+}
+
+struct s3_source *
+s3_source_init_fd(struct s3_source *src, int fd, off_t offset, size_t len) {
+	memset(src, 0, sizeof (*src));
+	src->type = S3_SOURCE_FD;
+	src->fd = fd;
+	src->offset = offset;
+	src->len = len;
+
+	return src;
+}
+
+struct s3_source *
+s3_source_init_callback(struct s3_source *src, s3_read_func read, void *arg, size_t len) {
+	memset(src, 0, sizeof (*src));
+	src->type = S3_SOURCE_CALLBACK;
+	src->read = read;
+	src->arg = arg;
+	src->len = len;
+
+	return src;
+}
+
+struct s3_source *
+s3_source_buffer(const char *buf, size_t len) {
+	return s3_source_init_buffer(malloc(sizeof (struct s3_source)), buf, len);
+}
+
+struct s3_source *
+s3_source_fd(int fd, off_t offset, size_t len) {
+	return s3_source_init_fd(malloc(sizeof (struct s3_source)), fd, offset, len);
+}
+
+struct s3_source *
+s3_source_callback(s3_read_func read, void *arg, size_t len) {
+	return s3_source_init_callback(malloc(sizeof (struct s3_source)), read, arg, len);
+}
+
+/*
+ * A source covering len bytes at offset within src. Buffers and file
+ * descriptors are sliced in place; callback sources can't seek and are
+ * not sliceable.
+ */
+struct s3_source *
+s3_source_slice(const struct s3_source *src, size_t offset, size_t len) {
+	switch (src->type) {
+	case S3_SOURCE_BUFFER:
+		return s3_source_buffer(src->buf + offset, len);
+	case S3_SOURCE_FD:
+		return s3_source_fd(src->fd, src->offset + offset, len);
+	default:
+		return NULL;
+	}
+}
+
+void
+s3_source_free(struct s3_source *src) {
+	free(src);
+}
+
+/*
+ * Content-MD5 of the whole source into out (S3_MD5_LENGTH bytes), or -1
+ * if it can only be read once. ck, if not NULL, is fed the same bytes.
+ */
+int
+s3_source_md5(const struct s3_source *src, struct s3_checksum *ck, char *out) {
+	switch (src->type) {
+	case S3_SOURCE_BUFFER:
+		s3_md5_base64(src->buf, src->len, ck, out);
+		return 0;
+	case S3_SOURCE_FD:
+		return s3_md5_base64_fd(src->fd, src->offset, src->len, ck, out);
+	default:
+		return -1;
+	}
+}
+
+/* Start the body over for a retry; callback sources can only do so unread */
+int
+s3_source_rewind(struct s3_source *src) {
+	if (src->type == S3_SOURCE_CALLBACK && src->pos > 0)
+		return -1;
+	src->pos = 0;
+	return 0;
+}
+
+size_t
+s3_source_curl_readfunc(void *ptr, size_t size, size_t nmemb, void *arg) {
+	struct s3_source *src = arg;
+	size_t left = src->len - src->pos;
+	size_t max_chunk = size * nmemb;
+	size_t n = left < max_chunk ? left : max_chunk;
+	ssize_t r;
+
+	if (n == 0)
+		return 0;
+
+	switch (src->type) {
+	case S3_SOURCE_BUFFER:
+		memcpy(ptr, src->buf + src->pos, n);
+		break;
+	case S3_SOURCE_FD:
+		do {
+			r = pread(src->fd, ptr, n, src->offset + src->pos);
+		} while (r < 0 && errno == EINTR);
+		if (r < 0)
+			return CURL_READFUNC_ABORT;
+		n = r;
+		break;
+	case S3_SOURCE_CALLBACK:
+		n = src->read(ptr, n, src->arg);
+		if (n == S3_READ_ABORT)
+			return CURL_READFUNC_ABORT;
+		break;
+	}
+
+	src->pos += n;
+	return n;
+}
+
+/* Lets curl rewind a body, e.g. to resend it after a redirect */
+int
+s3_source_curl_seekfunc(void *arg, curl_off_t offset, int origin) {
+	struct s3_source *src = arg;
+
+	if (src->type == S3_SOURCE_CALLBACK || origin != SEEK_SET || offset < 0 || (size_t)offset > src->len)
+		return CURL_SEEKFUNC_CANTSEEK;
+
+	src->pos = offset;
+	return CURL_SEEKFUNC_OK;
+}
+
+struct s3_sink *
+s3_sink_init_string(struct s3_sink *sink, struct s3_string *str) {
+	memset(sink, 0, sizeof (*sink));
+	sink->type = S3_SINK_STRING;
+	sink->str = str;
+
+	return sink;
+}
+
+/* Write to fd at offset with pwrite(), or with write() if offset is -1 */
+struct s3_sink *
+s3_sink_init_fd(struct s3_sink *sink, int fd, off_t offset) {
+	memset(sink, 0, sizeof (*sink));
+	sink->type = S3_SINK_FD;
+	sink->fd = fd;
+	sink->offset = offset;
+
+	return sink;
+}
+
+struct s3_sink *
+s3_sink_init_buffer(struct s3_sink *sink, char *buf, size_t size) {
+	memset(sink, 0, sizeof (*sink));
+	sink->type = S3_SINK_BUFFER;
+	sink->buf = buf;
+	sink->size = size;
+
+	return sink;
+}
+
+struct s3_sink *
+s3_sink_init_callback(struct s3_sink *sink, s3_write_func write, void *arg) {
+	memset(sink, 0, sizeof (*sink));
+	sink->type = S3_SINK_CALLBACK;
+	sink->write = write;
+	sink->arg = arg;
+
+	return sink;
+}
+
+struct s3_sink *
+s3_sink_string(struct s3_string *str) {
+	return s3_sink_init_string(malloc(sizeof (struct s3_sink)), str);
+}
+
+struct s3_sink *
+s3_sink_fd(int fd, off_t offset) {
+	return s3_sink_init_fd(malloc(sizeof (struct s3_sink)), fd, offset);
+}
+
+struct s3_sink *
+s3_sink_buffer(char *buf, size_t size) {
+	return s3_sink_init_buffer(malloc(sizeof (struct s3_sink)), buf, size);
+}
+
+struct s3_sink *
+s3_sink_callback(s3_write_func write, void *arg) {
+	return s3_sink_init_callback(malloc(sizeof (struct s3_sink)), write, arg);
+}
+
+void
+s3_sink_free(struct s3_sink *sink) {
+	free(sink);
+}
+
+/*
+ * The response announced len bytes of body. Strings allocate it all up
+ * front instead of growing chunk by chunk.
+ */
+void
+s3_sink_expect(struct s3_sink *sink, size_t len) {
+	if (sink->type == S3_SINK_STRING)
+		(void) s3_string_reserve(sink->str, len);
+}
+
+/*
+ * Drop what a failed attempt delivered so the response can be received
+ * again. Strings and buffers are cut back and positioned writes simply
+ * start over; streams and callbacks can only be rewound if nothing has
+ * reached them yet.
+ */
+int
+s3_sink_rewind(struct s3_sink *sink) {
+	switch (sink->type) {
+	case S3_SINK_STRING:
+		sink->str->len -= sink->pos;
+		if (sink->str->ptr)
+			sink->str->ptr[sink->str->len] = '\0';
+		break;
+	case S3_SINK_FD:
+		if (sink->offset < 0 && sink->pos > 0)
+			return -1;
+		break;
+	case S3_SINK_BUFFER:
+		break;
+	case S3_SINK_CALLBACK:
+		if (sink->pos > 0)
+			return -1;
+		break;
+	}
+
+	sink->pos = 0;
+	sink->checksum.type = S3_CHECKSUM_NONE;
+	sink->checksum_expected[0] = '\0';
+	return 0;
+}
+
+static int
+s3_sink_write_fd(struct s3_sink *sink, const char *ptr, size_t n) {
+	ssize_t r;
+
+	while (n > 0) {
+		if (sink->offset < 0)
+			r = write(sink->fd, ptr, n);
+		else
+			r = pwrite(sink->fd, ptr, n, sink->offset + sink->pos);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		ptr += r;
+		n -= r;
+		sink->pos += r;
+	}
+	return 0;
+}
+
+/* A short return makes curl fail the transfer with CURLE_WRITE_ERROR */
+size_t
+s3_sink_curl_writefunc(void *ptr, size_t size, size_t nmemb, void *arg) {
+	struct s3_sink *sink = arg;
+	size_t n = size * nmemb;
+
+	if (sink->checksum.type != S3_CHECKSUM_NONE)
+		s3_checksum_update(&sink->checksum, ptr, n);
+
+	switch (sink->type) {
+	case S3_SINK_STRING:
+		if (s3_string_curl_writefunc(ptr, size, nmemb, sink->str) != n)
+			return 0;
+		break;
+	case S3_SINK_FD:
+		if (s3_sink_write_fd(sink, ptr, n) < 0)
+			return 0;
+		return n;
+	case S3_SINK_BUFFER:
+		if (n > sink->size - sink->pos)
+			return 0;
+		memcpy(sink->buf + sink->pos, ptr, n);
+		break;
+	case S3_SINK_CALLBACK:
+		if (sink->write(ptr, n, sink->arg) != n)
+			return 0;
+		break;
+	}
+
+	sink->pos += n;
+	return n;
+}
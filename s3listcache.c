@@ -0,0 +1,279 @@
+/*
+ * Copyright (c) 2014, Ian Delahorne <ian.delahorne@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Cache of s3_list_bucket results by bucket and prefix. Listings are
+ * kept for a TTL, and so are empty ones and missing buckets, for a
+ * negative TTL of their own. A PUT, DELETE, Multi-Object Delete or
+ * multipart upload through the same context drops every listing whose
+ * prefix the key starts with, so a context always lists its own writes.
+ *
+ * Listings are named like the requests that change them, by the signed
+ * resource "/bucket/prefix", so a write's resource only has to start
+ * with a listing's name to affect it. A listing being fetched while
+ * such a write completes is not stored, as it may predate the write.
+ */
+
+#include <stdlib.h>
+
+#include "s3.h"
+#include "s3internal.h"
+
+#ifdef LINUX
+#include <bsd/string.h>
+#endif
+#include <string.h>
+
+struct s3_list_cached {
+	char *name;
+	size_t name_len;
+	struct s3_bucket_entry_head *entries;	/* NULL for a missing bucket */
+	uint64_t fresh_until;	/* on s3_now_ms() */
+	TAILQ_ENTRY(s3_list_cached) lru;
+};
+
+struct s3_list_cache {
+	pthread_mutex_t lock;
+	int ttl_ms;
+	int negative_ttl_ms;
+	size_t max_entries;
+	TAILQ_HEAD(s3_list_lru, s3_list_cached) lru;	/* most recently used first */
+	TAILQ_HEAD(, s3_list_fetch) fetching;
+	struct s3_list_cache_stats stats;
+};
+
+/*
+ * Keep up to max_entries listings: those with keys for ttl_ms, empty
+ * ones and missing buckets for negative_ttl_ms.
+ */
+struct s3_list_cache *
+s3_list_cache_new(int ttl_ms, int negative_ttl_ms, size_t max_entries) {
+	struct s3_list_cache *lc = calloc(1, sizeof (struct s3_list_cache));
+
+	pthread_mutex_init(&lc->lock, NULL);
+	lc->ttl_ms = ttl_ms;
+	lc->negative_ttl_ms = negative_ttl_ms;
+	lc->max_entries = max_entries;
+	TAILQ_INIT(&lc->lru);
+	TAILQ_INIT(&lc->fetching);
+
+	return lc;
+}
+
+static void
+s3_list_cached_free(struct s3_list_cached *c) {
+	if (c->entries)
+		s3_bucket_entries_free(c->entries);
+	free(c->name);
+	free(c);
+}
+
+/* Unlink c; the caller frees it */
+static void
+s3_list_cache_remove(struct s3_list_cache *lc, struct s3_list_cached *c) {
+	TAILQ_REMOVE(&lc->lru, c, lru);
+	lc->stats.entries--;
+}
+
+void
+s3_list_cache_free(struct s3_list_cache *lc) {
+	struct s3_list_cached *c;
+
+	while ((c = TAILQ_FIRST(&lc->lru)) != NULL) {
+		s3_list_cache_remove(lc, c);
+		s3_list_cached_free(c);
+	}
+	pthread_mutex_destroy(&lc->lock);
+	free(lc);
+}
+
+void
+s3_list_cache_stats(struct s3_list_cache *lc, struct s3_list_cache_stats *st) {
+	pthread_mutex_lock(&lc->lock);
+	*st = lc->stats;
+	pthread_mutex_unlock(&lc->lock);
+}
+
+static char *
+s3_strdup_or_null(const char *s) {
+	return s ? strdup(s) : NULL;
+}
+
+static struct s3_bucket_entry_head *
+s3_bucket_entries_copy(const struct s3_bucket_entry_head *entries) {
+	struct s3_bucket_entry_head *copy = malloc(sizeof (*copy));
+	struct s3_bucket_entry *e, *n;
+
+	TAILQ_INIT(copy);
+	TAILQ_FOREACH(e, entries, list) {
+		n = calloc(1, sizeof (*n));
+		n->key = s3_strdup_or_null(e->key);
+		n->lastmod = s3_strdup_or_null(e->lastmod);
+		n->etag = s3_strdup_or_null(e->etag);
+		n->size = e->size;
+		n->is_prefix = e->is_prefix;
+		TAILQ_INSERT_TAIL(copy, n, list);
+	}
+	return copy;
+}
+
+static struct s3_list_cached *
+s3_list_cache_find(struct s3_list_cache *lc, const char *name) {
+	struct s3_list_cached *c;
+
+	TAILQ_FOREACH(c, &lc->lru, lru)
+		if (strcmp(c->name, name) == 0)
+			return c;
+	return NULL;
+}
+
+/*
+ * A cached listing of prefix in bucket: returns 0 with a copy in
+ * *entries, NULL if the bucket doesn't exist. Otherwise returns -1 and
+ * registers f as fetching it, to be passed to s3_list_cache_store().
+ */
+int
+s3_list_cache_lookup(struct S3 *s3, const char *bucket, const char *prefix, struct s3_bucket_entry_head **entries, struct s3_list_fetch *f) {
+	struct s3_list_cache *lc = s3->list_cache;
+	struct s3_list_cached *c;
+	struct s3_op op;
+
+	s3_op_init(&op, s3, "GET", bucket, prefix, NULL, NULL);
+	f->name = strdup(op.resource);
+	f->stale = 0;
+	s3_op_free(&op);
+
+	pthread_mutex_lock(&lc->lock);
+	if ((c = s3_list_cache_find(lc, f->name)) != NULL) {
+		if (s3_now_ms() < c->fresh_until) {
+			TAILQ_REMOVE(&lc->lru, c, lru);
+			TAILQ_INSERT_HEAD(&lc->lru, c, lru);
+			*entries = c->entries ? s3_bucket_entries_copy(c->entries) : NULL;
+			if (c->entries == NULL || TAILQ_EMPTY(c->entries))
+				lc->stats.negative_hits++;
+			else
+				lc->stats.hits++;
+			pthread_mutex_unlock(&lc->lock);
+			free(f->name);
+			return 0;
+		}
+		s3_list_cache_remove(lc, c);
+		s3_list_cached_free(c);
+	}
+	lc->stats.misses++;
+	TAILQ_INSERT_TAIL(&lc->fetching, f, entry);
+	pthread_mutex_unlock(&lc->lock);
+
+	return -1;
+}
+
+/*
+ * The listing f went to fetch came back as entries, or failed with the
+ * HTTP status in error. Keep a copy unless a write under the prefix
+ * completed meanwhile; of failures only a missing bucket is kept.
+ */
+void
+s3_list_cache_store(struct S3 *s3, struct s3_list_fetch *f, const struct s3_bucket_entry_head *entries, int error) {
+	struct s3_list_cache *lc = s3->list_cache;
+	struct s3_list_cached *c;
+	int ttl;
+
+	pthread_mutex_lock(&lc->lock);
+	TAILQ_REMOVE(&lc->fetching, f, entry);
+
+	if (f->stale || (entries == NULL && error != 404) || lc->max_entries == 0) {
+		pthread_mutex_unlock(&lc->lock);
+		free(f->name);
+		return;
+	}
+
+	ttl = entries == NULL || TAILQ_EMPTY(entries) ? lc->negative_ttl_ms : lc->ttl_ms;
+	if (ttl <= 0) {
+		pthread_mutex_unlock(&lc->lock);
+		free(f->name);
+		return;
+	}
+
+	/* Another thread may have stored it first */
+	if ((c = s3_list_cache_find(lc, f->name)) != NULL) {
+		s3_list_cache_remove(lc, c);
+		s3_list_cached_free(c);
+	}
+	while (lc->stats.entries >= lc->max_entries) {
+		c = TAILQ_LAST(&lc->lru, s3_list_lru);
+		s3_list_cache_remove(lc, c);
+		s3_list_cached_free(c);
+	}
+
+	c = calloc(1, sizeof (struct s3_list_cached));
+	c->name = f->name;
+	c->name_len = strlen(f->name);
+	c->entries = entries ? s3_bucket_entries_copy(entries) : NULL;
+	c->fresh_until = s3_now_ms() + ttl;
+	TAILQ_INSERT_HEAD(&lc->lru, c, lru);
+	lc->stats.entries++;
+	pthread_mutex_unlock(&lc->lock);
+}
+
+/*
+ * The first n bytes of resource were written: drop the listings they
+ * could appear in, and spoil those being fetched.
+ */
+static void
+s3_list_cache_drop(struct s3_list_cache *lc, const char *resource, size_t n) {
+	struct s3_list_cached *c, *next;
+	struct s3_list_fetch *f;
+
+	pthread_mutex_lock(&lc->lock);
+	for (c = TAILQ_FIRST(&lc->lru); c != NULL; c = next) {
+		next = TAILQ_NEXT(c, lru);
+		if (c->name_len <= n && strncmp(resource, c->name, c->name_len) == 0) {
+			s3_list_cache_remove(lc, c);
+			s3_list_cached_free(c);
+			lc->stats.invalidations++;
+		}
+	}
+	TAILQ_FOREACH(f, &lc->fetching, entry)
+		if (strlen(f->name) <= n && strncmp(resource, f->name, strlen(f->name)) == 0)
+			f->stale = 1;
+	pthread_mutex_unlock(&lc->lock);
+}
+
+/* The op wrote its resource */
+void
+s3_list_cache_invalidate_op(struct s3_op *op) {
+	s3_list_cache_drop(op->s3->list_cache, op->resource, strcspn(op->resource, "?"));
+}
+
+/* key was written by a request whose resource doesn't name it */
+void
+s3_list_cache_invalidate(struct S3 *s3, const char *bucket, const char *key) {
+	struct s3_op op;
+
+	if (s3->list_cache == NULL)
+		return;
+	s3_op_init(&op, s3, "GET", bucket, key, NULL, NULL);
+	s3_list_cache_drop(s3->list_cache, op.resource, strlen(op.resource));
+	s3_op_free(&op);
+}
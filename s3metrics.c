@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) 2014, Ian Delahorne <ian.delahorne@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Request metrics. Each thread counts the attempts it completes in its
+ * own struct s3_thread, so recording takes no lock and shares no cache
+ * line with other threads. The counters are written with relaxed
+ * atomic stores by their one writer, which lets s3_metrics() read them
+ * from another thread at any time without stopping anyone.
+ */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <curl/curl.h>
+
+#include "s3.h"
+#include "s3internal.h"
+
+#include <string.h>
+
+static const char *s3_metrics_methods[S3_METRICS_METHODS] = {
+	"GET", "PUT", "HEAD", "DELETE", "POST"
+};
+
+/* Histogram upper bounds in microseconds; the last bucket is +Inf */
+static const uint64_t s3_metrics_bounds[S3_METRICS_BUCKETS - 1] = {
+	1000, 2500, 5000, 10000, 25000, 50000, 100000,
+	250000, 500000, 1000000, 2500000, 5000000, 10000000
+};
+
+/* Only the owning thread writes a counter, so this needn't be a locked add */
+static void
+s3_counter_add(uint64_t *c, uint64_t n) {
+	__atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static uint64_t
+s3_curl_us(CURL *curl, CURLINFO info) {
+	double t;
+
+	if (curl_easy_getinfo(curl, info, &t) != CURLE_OK || t < 0)
+		return 0;
+	return (uint64_t)(t * 1e6);
+}
+
+static uint64_t
+s3_curl_bytes(CURL *curl, CURLINFO info) {
+	curl_off_t n;
+
+	if (curl_easy_getinfo(curl, info, &n) != CURLE_OK || n < 0)
+		return 0;
+	return (uint64_t)n;
+}
+
+static int
+s3_metrics_method_index(const char *method) {
+	int i;
+
+	for (i = 0; i < S3_METRICS_METHODS; i++)
+		if (strcmp(method, s3_metrics_methods[i]) == 0)
+			return i;
+	return -1;
+}
+
+/* The op's attempt has just finished and still holds its handle */
+void
+s3_metrics_record(struct s3_op *op) {
+	struct S3 *s3 = op->s3;
+	struct s3_request_metrics rm;
+	struct s3_method_metrics *mm;
+	CURL *curl = op->handle->curl;
+	int i, b;
+
+	memset(&rm, 0, sizeof (rm));
+	rm.method = op->method;
+	rm.resource = op->resource;
+	rm.status = op->result.status;
+	rm.error = op->result.error;
+	rm.attempt = op->result.attempts;
+	rm.total_us = s3_curl_us(curl, CURLINFO_TOTAL_TIME);
+	rm.bytes_up = s3_curl_bytes(curl, CURLINFO_SIZE_UPLOAD_T);
+	rm.bytes_down = s3_curl_bytes(curl, CURLINFO_SIZE_DOWNLOAD_T);
+
+	if ((i = s3_metrics_method_index(op->method)) >= 0) {
+		mm = &s3_thread_get(s3)->metrics.methods[i];
+		for (b = 0; b < S3_METRICS_BUCKETS - 1 && rm.total_us > s3_metrics_bounds[b]; b++)
+			;
+		s3_counter_add(&mm->requests, 1);
+		if (rm.attempt > 1)
+			s3_counter_add(&mm->retries, 1);
+		if (rm.status == 0)
+			s3_counter_add(&mm->failures, 1);
+		else if (rm.status >= 500)
+			s3_counter_add(&mm->status_5xx, 1);
+		else if (rm.status >= 400)
+			s3_counter_add(&mm->status_4xx, 1);
+		s3_counter_add(&mm->bytes_up, rm.bytes_up);
+		s3_counter_add(&mm->bytes_down, rm.bytes_down);
+		s3_counter_add(&mm->total_us, rm.total_us);
+		s3_counter_add(&mm->latency[b], 1);
+	}
+
+	if (s3->metrics_cb == NULL)
+		return;
+
+	rm.dns_us = s3_curl_us(curl, CURLINFO_NAMELOOKUP_TIME);
+	rm.connect_us = s3_curl_us(curl, CURLINFO_CONNECT_TIME);
+	rm.tls_us = s3_curl_us(curl, CURLINFO_APPCONNECT_TIME);
+	rm.ttfb_us = s3_curl_us(curl, CURLINFO_STARTTRANSFER_TIME);
+	s3->metrics_cb(&rm, s3->metrics_arg);
+}
+
+/* Add from's counts to to's; from may be another thread's, live */
+void
+s3_metrics_add(struct s3_metrics *to, const struct s3_metrics *from) {
+	const uint64_t *f = (const uint64_t *)from;
+	uint64_t *t = (uint64_t *)to;
+	size_t i;
+
+	for (i = 0; i < sizeof (struct s3_metrics) / sizeof (uint64_t); i++)
+		t[i] += __atomic_load_n(&f[i], __ATOMIC_RELAXED);
+}
+
+/*
+ * The context's totals so far, over every thread. Each counter is read
+ * once without stopping the threads, so the snapshot may be a few
+ * requests out of step between counters but never goes backwards.
+ */
+void
+s3_metrics(struct S3 *s3, struct s3_metrics *m) {
+	struct s3_thread *t;
+
+	pthread_mutex_lock(&s3->lock);
+	*m = s3->metrics_exited;
+	SLIST_FOREACH(t, &s3->threads, next)
+		s3_metrics_add(m, &t->metrics);
+	pthread_mutex_unlock(&s3->lock);
+}
+
+static void
+s3_string_printf(struct s3_string *s, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void
+s3_string_printf(struct s3_string *s, const char *fmt, ...) {
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(s->ptr + s->len, s->cap - s->len, fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return;
+
+	if ((size_t)n >= s->cap - s->len) {
+		if (s3_string_reserve(s, n) < 0) {
+			s->ptr[s->len] = '\0';
+			return;
+		}
+		va_start(ap, fmt);
+		vsnprintf(s->ptr + s->len, s->cap - s->len, fmt, ap);
+		va_end(ap);
+	}
+	s->len += n;
+}
+
+static void
+s3_prometheus_counter(struct s3_string *out, const struct s3_metrics *m, const char *name, const char *help, size_t offset) {
+	int i;
+
+	s3_string_printf(out, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+	for (i = 0; i < S3_METRICS_METHODS; i++)
+		s3_string_printf(out, "%s{method=\"%s\"} %llu\n", name, s3_metrics_methods[i],
+		    (unsigned long long)*(const uint64_t *)((const char *)&m->methods[i] + offset));
+}
+
+/* Append m to out in the Prometheus text exposition format */
+void
+s3_metrics_prometheus(const struct s3_metrics *m, struct s3_string *out) {
+	const struct s3_method_metrics *mm;
+	uint64_t cumulative;
+	int i, b;
+
+	s3_prometheus_counter(out, m, "s3_requests_total", "Request attempts, retries included.",
+	    offsetof(struct s3_method_metrics, requests));
+	s3_prometheus_counter(out, m, "s3_retries_total", "Attempts after the first.",
+	    offsetof(struct s3_method_metrics, retries));
+	s3_prometheus_counter(out, m, "s3_request_failures_total", "Attempts that got no response.",
+	    offsetof(struct s3_method_metrics, failures));
+
+	s3_string_printf(out, "# HELP s3_responses_total Error responses by status class.\n"
+	    "# TYPE s3_responses_total counter\n");
+	for (i = 0; i < S3_METRICS_METHODS; i++) {
+		mm = &m->methods[i];
+		s3_string_printf(out, "s3_responses_total{method=\"%s\",class=\"4xx\"} %llu\n"
+		    "s3_responses_total{method=\"%s\",class=\"5xx\"} %llu\n",
+		    s3_metrics_methods[i], (unsigned long long)mm->status_4xx,
+		    s3_metrics_methods[i], (unsigned long long)mm->status_5xx);
+	}
+
+	s3_prometheus_counter(out, m, "s3_sent_bytes_total", "Request body bytes sent.",
+	    offsetof(struct s3_method_metrics, bytes_up));
+	s3_prometheus_counter(out, m, "s3_received_bytes_total", "Response body bytes received.",
+	    offsetof(struct s3_method_metrics, bytes_down));
+
+	s3_string_printf(out, "# HELP s3_request_duration_seconds Time taken by each attempt.\n"
+	    "# TYPE s3_request_duration_seconds histogram\n");
+	for (i = 0; i < S3_METRICS_METHODS; i++) {
+		mm = &m->methods[i];
+		cumulative = 0;
+		for (b = 0; b < S3_METRICS_BUCKETS; b++) {
+			cumulative += mm->latency[b];
+			if (b < S3_METRICS_BUCKETS - 1)
+				s3_string_printf(out, "s3_request_duration_seconds_bucket{method=\"%s\",le=\"%g\"} %llu\n",
+				    s3_metrics_methods[i], s3_metrics_bounds[b] / 1e6, (unsigned long long)cumulative);
+			else
+				s3_string_printf(out, "s3_request_duration_seconds_bucket{method=\"%s\",le=\"+Inf\"} %llu\n",
+				    s3_metrics_methods[i], (unsigned long long)cumulative);
+		}
+		s3_string_printf(out, "s3_request_duration_seconds_sum{method=\"%s\"} %.6f\n"
+		    "s3_request_duration_seconds_count{method=\"%s\"} %llu\n",
+		    s3_metrics_methods[i], mm->total_us / 1e6,
+		    s3_metrics_methods[i], (unsigned long long)mm->requests);
+	}
+}
@@ -0,0 +1,982 @@
+/*
+ * Copyright (c) 2014, Ian Delahorne <ian.delahorne@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * s3mock - a minimal in-memory stand-in for S3, used by s3bench.
+ *
+ * Point a client at it by setting s3->proxy to "http://127.0.0.1:<port>";
+ * requests then arrive with absolute URIs carrying the bucket in the
+ * host name, exactly as they would be sent to Amazon. Signatures are
+ * not checked.
+ *
+ * To look more like a remote service it can hold every response back
+ * (-l), cap each connection's transfer rate (-b) and fail a share of
+ * requests with 503 SlowDown (-e).
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+
+#include "s3.h"
+#include "s3internal.h"
+
+#ifdef LINUX
+#include <bsd/stdlib.h>
+#endif
+
+#define MOCK_HDR_MAX	16384
+#define MOCK_NBUCKETS	4096
+#define MOCK_PACE_CHUNK	16384	/* bytes moved between pauses when rate limited */
+
+struct mock_object {
+	char *name;		/* "bucket/key" */
+	char *data;
+	size_t len;
+	char etag[2 * 16 + 16];	/* hex MD5, plus "-N" for multipart */
+	char checksum_alg[16];	/* x-amz-checksum-* it was stored with, if any */
+	char checksum[S3_CHECKSUM_LENGTH];
+	char content_type[128];
+	char meta[512];		/* x-amz-meta-* header lines it was stored with */
+	time_t mtime;
+	struct mock_object *next;
+};
+
+struct mock_request {
+	char method[16];
+	char name[2048];	/* "bucket/key" */
+	char query[2048];
+	size_t content_length;
+	int expect_continue;
+	int aws_chunked;
+	int close;
+	int has_range;
+	size_t range_start;
+	size_t range_end;	/* inclusive, SIZE_MAX for open ended */
+	char if_match[64];
+	char if_none_match[64];
+	int checksum_mode;
+	char checksum_alg[16];	/* from a header or an aws-chunked trailer */
+	char checksum[32];
+	char content_type[128];
+	char content_md5[64];
+	char meta[512];
+};
+
+static struct mock_object *store[MOCK_NBUCKETS];
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+static int verbose;
+static int latency_ms;		/* added before each response */
+static double bandwidth;	/* bytes/s per connection and direction, 0 for unlimited */
+static double error_rate;	/* share of requests answered 503 */
+
+static unsigned int
+mock_hash(const char *s) {
+	unsigned int h = 5381;
+
+	while (*s)
+		h = h * 33 + (unsigned char)*s++;
+	return h % MOCK_NBUCKETS;
+}
+
+static struct mock_object *
+mock_lookup(const char *name) {
+	struct mock_object *o;
+
+	for (o = store[mock_hash(name)]; o; o = o->next)
+		if (strcmp(o->name, name) == 0)
+			return o;
+	return NULL;
+}
+
+static void
+mock_etag(const char *data, size_t len, char *out) {
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int digest_len, i;
+
+	EVP_Digest(data, len, digest, &digest_len, EVP_md5(), NULL);
+	for (i = 0; i < digest_len; i++)
+		sprintf(out + 2 * i, "%02x", digest[i]);
+}
+
+/* Takes ownership of data; alg and checksum may be NULL */
+static void
+mock_store(const char *name, char *data, size_t len, const char *alg, const char *checksum) {
+	struct mock_object *o;
+	unsigned int h = mock_hash(name);
+
+	pthread_mutex_lock(&store_lock);
+	if ((o = mock_lookup(name)) == NULL) {
+		o = calloc(1, sizeof (*o));
+		o->name = strdup(name);
+		o->next = store[h];
+		store[h] = o;
+	}
+	free(o->data);
+	o->data = data;
+	o->len = len;
+	o->mtime = time(NULL);
+	mock_etag(data, len, o->etag);
+	snprintf(o->checksum_alg, sizeof (o->checksum_alg), "%s", alg ? alg : "");
+	snprintf(o->checksum, sizeof (o->checksum), "%s", checksum ? checksum : "");
+	pthread_mutex_unlock(&store_lock);
+}
+
+static int
+mock_remove(const char *name) {
+	struct mock_object **op, *o;
+
+	pthread_mutex_lock(&store_lock);
+	for (op = &store[mock_hash(name)]; (o = *op) != NULL; op = &o->next) {
+		if (strcmp(o->name, name) == 0) {
+			*op = o->next;
+			free(o->name);
+			free(o->data);
+			free(o);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&store_lock);
+
+	return o != NULL;
+}
+
+static double
+mock_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* With a rate limit, move at most MOCK_PACE_CHUNK bytes at a time */
+static size_t
+mock_pace_len(size_t len) {
+	return bandwidth > 0 && len > MOCK_PACE_CHUNK ? MOCK_PACE_CHUNK : len;
+}
+
+/* Having moved done bytes since start, wait until the rate allows more */
+static void
+mock_pace(double start, size_t done) {
+	double ahead;
+
+	if (bandwidth > 0 && (ahead = start + done / bandwidth - mock_now()) > 0)
+		usleep(ahead * 1e6);
+}
+
+static int
+write_all(int fd, const char *buf, size_t len) {
+	double start = mock_now();
+	size_t done = 0;
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write(fd, buf, mock_pace_len(len))) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+		done += n;
+		mock_pace(start, done);
+	}
+	return 0;
+}
+
+static int
+read_all(int fd, char *buf, size_t len) {
+	double start = mock_now();
+	size_t done = 0;
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = read(fd, buf, mock_pace_len(len))) <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+		done += n;
+		mock_pace(start, done);
+	}
+	return 0;
+}
+
+static int
+mock_respond(int fd, int status, const char *reason, const char *extra_headers, const char *body, size_t len, int with_body) {
+	char hdr[2048];
+	int n;
+
+	n = snprintf(hdr, sizeof (hdr),
+	    "HTTP/1.1 %d %s\r\n"
+	    "Content-Length: %zu\r\n"
+	    "Server: s3mock\r\n"
+	    "%s"
+	    "\r\n", status, reason, len, extra_headers ? extra_headers : "");
+
+	if (latency_ms > 0)
+		usleep(latency_ms * 1000);
+	if (write_all(fd, hdr, n) < 0)
+		return -1;
+	if (with_body && len > 0 && write_all(fd, body, len) < 0)
+		return -1;
+	return 0;
+}
+
+static int
+mock_error(int fd, int status, const char *reason, const char *code, int with_body) {
+	char body[512];
+	int n;
+
+	n = snprintf(body, sizeof (body),
+	    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+	    "<Error><Code>%s</Code><Message>%s</Message></Error>", code, reason);
+	return mock_respond(fd, status, reason, "Content-Type: application/xml\r\n", body, n, with_body);
+}
+
+/* Undo percent-encoding of a request path in place */
+static void
+mock_decode(char *s) {
+	char *out = s;
+
+	for (; *s; s++) {
+		if (*s == '%' && isxdigit((unsigned char)s[1]) && isxdigit((unsigned char)s[2])) {
+			sscanf(s + 1, "%2hhx", out++);
+			s += 2;
+		} else
+			*out++ = *s;
+	}
+	*out = '\0';
+}
+
+/*
+ * Split the request target into "bucket/key" and query. Absolute URIs
+ * (proxy requests) carry the bucket as the first label of the host;
+ * origin-form targets fall back to the Host header.
+ */
+static void
+mock_parse_target(struct mock_request *req, const char *target, const char *host) {
+	const char *path, *q, *dot;
+	size_t hlen;
+
+	if (strncasecmp(target, "http://", 7) == 0) {
+		host = target + 7;
+		path = strchr(host, '/');
+		if (path == NULL)
+			path = host + strlen(host);
+		hlen = path - host;
+	} else {
+		path = target;
+		hlen = host ? strcspn(host, "\r\n") : 0;
+	}
+
+	dot = host ? memchr(host, '.', hlen) : NULL;
+	if (dot)
+		hlen = dot - host;
+
+	q = strchr(path, '?');
+	snprintf(req->name, sizeof (req->name), "%.*s/%.*s", (int)hlen, host ? host : "",
+	    (int)((q ? q : path + strlen(path)) - path - (*path == '/')), path + (*path == '/'));
+	snprintf(req->query, sizeof (req->query), "%s", q ? q + 1 : "");
+	mock_decode(req->name);
+}
+
+static int
+mock_read_request(int fd, struct mock_request *req, char *buf, size_t *buffered) {
+	char *end = NULL, *line, *next, *host = NULL;
+	char target[4096];
+	size_t used = *buffered;
+	ssize_t n;
+
+	while ((end = memmem(buf, used, "\r\n\r\n", 4)) == NULL) {
+		if (used == MOCK_HDR_MAX - 1)
+			return -1;
+		if ((n = read(fd, buf + used, MOCK_HDR_MAX - 1 - used)) <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		used += n;
+	}
+	*end = '\0';
+
+	memset(req, 0, sizeof (*req));
+	if (sscanf(buf, "%15s %4095s", req->method, target) != 2)
+		return -1;
+
+	for (line = strstr(buf, "\r\n"); line; line = next) {
+		line += 2;
+		next = strstr(line, "\r\n");
+		if (strncasecmp(line, "Host:", 5) == 0)
+			host = line + 5 + strspn(line + 5, " ");
+		else if (strncasecmp(line, "Content-Length:", 15) == 0)
+			req->content_length = strtoull(line + 15, NULL, 10);
+		else if (strncasecmp(line, "Expect:", 7) == 0)
+			req->expect_continue = 1;
+		else if (strncasecmp(line, "Content-Encoding: aws-chunked", 29) == 0)
+			req->aws_chunked = 1;
+		else if (strncasecmp(line, "Connection: close", 17) == 0)
+			req->close = 1;
+		else if (strncasecmp(line, "Range: bytes=", 13) == 0) {
+			req->has_range = 1;
+			req->range_start = strtoull(line + 13, &line, 10);
+			req->range_end = line[1] >= '0' && line[1] <= '9' ? strtoull(line + 1, NULL, 10) : SIZE_MAX;
+		} else if (strncasecmp(line, "If-Match:", 9) == 0)
+			sscanf(line + 9, " \"%63[^\"]", req->if_match);
+		else if (strncasecmp(line, "If-None-Match:", 14) == 0)
+			sscanf(line + 14, " \"%63[^\"]", req->if_none_match);
+		else if (strncasecmp(line, "Content-MD5:", 12) == 0)
+			sscanf(line + 12, " %63s", req->content_md5);
+		else if (strncasecmp(line, "Content-Type:", 13) == 0)
+			sscanf(line + 13, " %127[^\r]", req->content_type);
+		else if (strncasecmp(line, "x-amz-meta-", 11) == 0 && next != NULL &&
+		    strlen(req->meta) + (next + 2 - line) < sizeof (req->meta))
+			strncat(req->meta, line, next + 2 - line);
+		else if (strncasecmp(line, "x-amz-checksum-mode:", 20) == 0)
+			req->checksum_mode = 1;
+		else if (strncasecmp(line, "x-amz-checksum-", 15) == 0)
+			sscanf(line + 15, "%15[^:]: %31s", req->checksum_alg, req->checksum);
+	}
+	mock_parse_target(req, target, host);
+
+	/* Keep whatever followed the header block for the body */
+	end += 4;
+	*buffered = used - (end - buf);
+	memmove(buf, end, *buffered);
+
+	return 0;
+}
+
+/*
+ * Copy the value of query parameter name into out, decoded as S3 does
+ * with "+" as a space; returns 0 if absent
+ */
+static int
+mock_query_get(const char *query, const char *name, char *out, size_t size) {
+	size_t nlen = strlen(name), vlen;
+	const char *p;
+
+	for (p = query; p && *p; p = strchr(p, '&') ? strchr(p, '&') + 1 : NULL) {
+		if (strncmp(p, name, nlen) != 0 || (p[nlen] != '=' && p[nlen] != '&' && p[nlen] != '\0'))
+			continue;
+		p += nlen;
+		if (*p == '=')
+			p++;
+		for (vlen = strcspn(p, "&"); vlen > 0 && size > 1; vlen--, size--) {
+			if (*p == '%' && vlen >= 3) {
+				sscanf(p + 1, "%2hhx", out++);
+				p += 3;
+				vlen -= 2;
+			} else if (*p == '+') {
+				*out++ = ' ';
+				p++;
+			} else
+				*out++ = *p++;
+		}
+		*out = '\0';
+		return 1;
+	}
+	return 0;
+}
+
+static int
+mock_send_etag(int fd, const char *name) {
+	char hdr[256];
+
+	pthread_mutex_lock(&store_lock);
+	snprintf(hdr, sizeof (hdr), "ETag: \"%s\"\r\n", mock_lookup(name)->etag);
+	pthread_mutex_unlock(&store_lock);
+
+	return mock_respond(fd, 200, "OK", hdr, NULL, 0, 0);
+}
+
+/* Parts are kept in the store under "bucket/key?uploadId=N&partNumber=M" */
+static int
+mock_multipart(int fd, struct mock_request *req, char *body, size_t len) {
+	static unsigned long next_upload = 1;
+	struct mock_object *o;
+	char upload_id[64], part[16], name[2200];
+	char xml[1024], *data, *p;
+	unsigned char *digests;
+	unsigned long id;
+	size_t total;
+	int i, n;
+
+	if (strcmp(req->method, "POST") == 0 && mock_query_get(req->query, "uploads", part, sizeof (part))) {
+		pthread_mutex_lock(&store_lock);
+		/* As from some S3-compatible servers, needing encoding */
+		snprintf(upload_id, sizeof (upload_id), "mock+upload/%lu==", next_upload++);
+		pthread_mutex_unlock(&store_lock);
+		n = snprintf(xml, sizeof (xml),
+		    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		    "<InitiateMultipartUploadResult xmlns=\"http://s3.amazonaws.com/doc/2006-03-01/\">"
+		    "<UploadId>%s</UploadId></InitiateMultipartUploadResult>", upload_id);
+		free(body);
+		return mock_respond(fd, 200, "OK", "Content-Type: application/xml\r\n", xml, n, 1);
+	}
+
+	/* An ID that didn't survive the trip (a "+" sent as is) is unknown */
+	n = 0;
+	if (!mock_query_get(req->query, "uploadId", upload_id, sizeof (upload_id)) ||
+	    sscanf(upload_id, "mock+upload/%lu==%n", &id, &n) != 1 || n == 0 || upload_id[n] != '\0') {
+		free(body);
+		return mock_error(fd, 404, "Not Found", "NoSuchUpload", 1);
+	}
+
+	if (strcmp(req->method, "PUT") == 0 && mock_query_get(req->query, "partNumber", part, sizeof (part))) {
+		snprintf(name, sizeof (name), "%s?uploadId=%s&partNumber=%d", req->name, upload_id, atoi(part));
+		mock_store(name, body, len, NULL, NULL);
+		return mock_send_etag(fd, name);
+	}
+
+	if (strcmp(req->method, "POST") == 0) {
+		/*
+		 * Concatenate the parts listed in the completion request. As
+		 * with S3, the ETag is the MD5 of the parts' MD5s.
+		 */
+		data = NULL;
+		digests = NULL;
+		total = 0;
+		n = 0;
+		pthread_mutex_lock(&store_lock);
+		for (p = body; p && (p = strstr(p, "<PartNumber>")) != NULL; p++) {
+			snprintf(name, sizeof (name), "%s?uploadId=%s&partNumber=%d", req->name, upload_id, atoi(p + 12));
+			if ((o = mock_lookup(name)) == NULL) {
+				pthread_mutex_unlock(&store_lock);
+				free(data);
+				free(digests);
+				free(body);
+				return mock_error(fd, 400, "Bad Request", "InvalidPart", 1);
+			}
+			data = realloc(data, total + o->len + 1);
+			memcpy(data + total, o->len ? o->data : "", o->len);
+			digests = realloc(digests, 16 * (n + 1));
+			EVP_Digest(o->len ? o->data : "", o->len, digests + 16 * n, NULL, EVP_md5(), NULL);
+			total += o->len;
+			n++;
+		}
+		pthread_mutex_unlock(&store_lock);
+		for (i = 1; i <= n; i++) {
+			snprintf(name, sizeof (name), "%s?uploadId=%s&partNumber=%d", req->name, upload_id, i);
+			mock_remove(name);
+		}
+		free(body);
+
+		mock_store(req->name, data ? data : malloc(1), total, NULL, NULL);
+		pthread_mutex_lock(&store_lock);
+		o = mock_lookup(req->name);
+		mock_etag((char *)digests, 16 * n, o->etag);
+		snprintf(o->etag + 32, sizeof (o->etag) - 32, "-%d", n);
+		free(digests);
+		n = snprintf(xml, sizeof (xml),
+		    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		    "<CompleteMultipartUploadResult xmlns=\"http://s3.amazonaws.com/doc/2006-03-01/\">"
+		    "<Key>%s</Key><ETag>\"%s\"</ETag></CompleteMultipartUploadResult>", req->name, o->etag);
+		pthread_mutex_unlock(&store_lock);
+		return mock_respond(fd, 200, "OK", "Content-Type: application/xml\r\n", xml, n, 1);
+	}
+
+	if (strcmp(req->method, "DELETE") == 0) {
+		for (i = 1; i <= 10000; i++) {
+			snprintf(name, sizeof (name), "%s?uploadId=%s&partNumber=%d", req->name, upload_id, i);
+			mock_remove(name);
+		}
+		free(body);
+		return mock_respond(fd, 204, "No Content", NULL, NULL, 0, 0);
+	}
+
+	free(body);
+	return mock_error(fd, 400, "Bad Request", "InvalidRequest", 1);
+}
+
+static void
+mock_xml_escape(FILE *f, const char *s) {
+	for (; *s; s++) {
+		switch (*s) {
+		case '&':
+			fputs("&amp;", f);
+			break;
+		case '<':
+			fputs("&lt;", f);
+			break;
+		case '>':
+			fputs("&gt;", f);
+			break;
+		default:
+			fputc(*s, f);
+		}
+	}
+}
+
+static int
+mock_strcmp(const void *a, const void *b) {
+	return strcmp(((struct mock_object * const *)a)[0]->name, ((struct mock_object * const *)b)[0]->name);
+}
+
+/* ListObjects (v1 markers and v2 continuation tokens) over "bucket/" */
+/* Undo the XML escapes of a key in place */
+static void
+mock_xml_unescape(char *s) {
+	static const char *ents[] = { "&amp;", "&", "&lt;", "<", "&gt;", ">", "&quot;", "\"", "&apos;", "'" };
+	char *out = s;
+	size_t i;
+
+	while (*s) {
+		for (i = 0; i < sizeof (ents) / sizeof (ents[0]); i += 2)
+			if (strncmp(s, ents[i], strlen(ents[i])) == 0)
+				break;
+		if (i < sizeof (ents) / sizeof (ents[0])) {
+			*out++ = *ents[i + 1];
+			s += strlen(ents[i]);
+		} else
+			*out++ = *s++;
+	}
+	*out = '\0';
+}
+
+/* Multi-Object Delete; every key is deleted, existing or not */
+static int
+mock_delete_many(int fd, struct mock_request *req, char *body, size_t len) {
+	char name[2048], *p, *end, *xml = NULL;
+	size_t xml_len, nkeys = 0;
+	int quiet, rc;
+	FILE *f;
+
+	if (req->content_md5[0] == '\0') {
+		free(body);
+		return mock_error(fd, 400, "Bad Request", "InvalidRequest", 1);
+	}
+	body[len] = '\0';
+	for (p = body; (p = strstr(p, "<Key>")) != NULL; p++)
+		nkeys++;
+	if (nkeys > 1000) {
+		free(body);
+		return mock_error(fd, 400, "Bad Request", "MalformedXML", 1);
+	}
+	quiet = strstr(body, "<Quiet>true</Quiet>") != NULL;
+
+	f = open_memstream(&xml, &xml_len);
+	fprintf(f, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+	    "<DeleteResult xmlns=\"http://s3.amazonaws.com/doc/2006-03-01/\">");
+	for (p = body; (p = strstr(p, "<Key>")) != NULL; p = end) {
+		p += 5;
+		if ((end = strstr(p, "</Key>")) == NULL)
+			break;
+		*end++ = '\0';
+		if (!quiet)
+			fprintf(f, "<Deleted><Key>%s</Key></Deleted>", p);
+		mock_xml_unescape(p);
+		snprintf(name, sizeof (name), "%s%s", req->name, p);
+		mock_remove(name);
+	}
+	fprintf(f, "</DeleteResult>");
+	fclose(f);
+	free(body);
+
+	rc = mock_respond(fd, 200, "OK", "Content-Type: application/xml\r\n", xml, xml_len, 1);
+	free(xml);
+	return rc;
+}
+
+static int
+mock_list(int fd, struct mock_request *req) {
+	struct mock_object *o, **objs = NULL;
+	char prefix[1024] = "", delim[16] = "", marker[1024] = "", tmp[32];
+	char last_prefix[1024] = "", last[1024] = "";
+	char *xml = NULL, *key, *d;
+	size_t xml_len, blen = strlen(req->name), plen;
+	size_t nobjs = 0, i, count = 0;
+	int max_keys = 1000, v2, truncated = 0, rc;
+	struct tm tm;
+	FILE *f;
+
+	mock_query_get(req->query, "prefix", prefix, sizeof (prefix));
+	mock_query_get(req->query, "delimiter", delim, sizeof (delim));
+	if (mock_query_get(req->query, "max-keys", tmp, sizeof (tmp)))
+		max_keys = atoi(tmp);
+	v2 = mock_query_get(req->query, "list-type", tmp, sizeof (tmp)) && atoi(tmp) == 2;
+	if (!mock_query_get(req->query, v2 ? "continuation-token" : "marker", marker, sizeof (marker)) && v2)
+		mock_query_get(req->query, "start-after", marker, sizeof (marker));
+	plen = strlen(prefix);
+
+	pthread_mutex_lock(&store_lock);
+	for (i = 0; i < MOCK_NBUCKETS; i++) {
+		for (o = store[i]; o; o = o->next) {
+			if (strncmp(o->name, req->name, blen) != 0 || strchr(o->name, '?'))
+				continue;
+			key = o->name + blen;
+			if (strncmp(key, prefix, plen) != 0 || strcmp(key, marker) <= 0)
+				continue;
+			objs = realloc(objs, (nobjs + 1) * sizeof (*objs));
+			objs[nobjs++] = o;
+		}
+	}
+	qsort(objs, nobjs, sizeof (*objs), mock_strcmp);
+
+	f = open_memstream(&xml, &xml_len);
+	fprintf(f, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+	    "<ListBucketResult xmlns=\"http://s3.amazonaws.com/doc/2006-03-01/\">"
+	    "<Name>%.*s</Name><Prefix>", (int)blen - 1, req->name);
+	mock_xml_escape(f, prefix);
+	fprintf(f, "</Prefix><MaxKeys>%d</MaxKeys>", max_keys);
+
+	for (i = 0; i < nobjs; i++) {
+		key = objs[i]->name + blen;
+		/* Keys rolled up into a prefix that was the marker were already returned */
+		if (*delim && strncmp(key, marker, strlen(marker)) == 0 && *marker &&
+		    strlen(marker) >= strlen(delim) && strcmp(marker + strlen(marker) - strlen(delim), delim) == 0)
+			continue;
+		if (*delim && (d = strstr(key + plen, delim)) != NULL) {
+			if (strlen(last_prefix) == (size_t)(d - key) + strlen(delim) &&
+			    strncmp(last_prefix, key, strlen(last_prefix)) == 0)
+				continue;
+			if ((int)count == max_keys) {
+				truncated = 1;
+				break;
+			}
+			snprintf(last_prefix, sizeof (last_prefix), "%.*s", (int)(d - key + strlen(delim)), key);
+			fputs("<CommonPrefixes><Prefix>", f);
+			mock_xml_escape(f, last_prefix);
+			fputs("</Prefix></CommonPrefixes>", f);
+			snprintf(last, sizeof (last), "%s", last_prefix);
+			count++;
+			continue;
+		}
+		if ((int)count == max_keys) {
+			truncated = 1;
+			break;
+		}
+		gmtime_r(&objs[i]->mtime, &tm);
+		fputs("<Contents><Key>", f);
+		mock_xml_escape(f, key);
+		fprintf(f, "</Key><LastModified>%04d-%02d-%02dT%02d:%02d:%02d.000Z</LastModified>"
+		    "<ETag>&quot;%s&quot;</ETag><Size>%zu</Size><StorageClass>STANDARD</StorageClass></Contents>",
+		    tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+		    objs[i]->etag, objs[i]->len);
+		snprintf(last, sizeof (last), "%s", key);
+		count++;
+	}
+	pthread_mutex_unlock(&store_lock);
+
+	fprintf(f, "<IsTruncated>%s</IsTruncated>", truncated ? "true" : "false");
+	if (truncated) {
+		fputs(v2 ? "<NextContinuationToken>" : "<NextMarker>", f);
+		mock_xml_escape(f, last);
+		fputs(v2 ? "</NextContinuationToken>" : "</NextMarker>", f);
+	}
+	if (v2)
+		fprintf(f, "<KeyCount>%zu</KeyCount>", count);
+	fputs("</ListBucketResult>", f);
+	fclose(f);
+
+	rc = mock_respond(fd, 200, "OK", "Content-Type: application/xml\r\n", xml, xml_len, 1);
+	free(xml);
+	free(objs);
+
+	return rc;
+}
+
+/*
+ * Strip aws-chunked framing in place, picking a checksum out of the
+ * trailer. Chunk and trailer signatures aren't checked; the mock
+ * doesn't know the secret.
+ */
+static int
+mock_unchunk(struct mock_request *req, char *body, size_t *len) {
+	char *p = body, *end = body + *len, *out = body, *eol;
+	size_t k;
+
+	for (;;) {
+		if ((eol = memmem(p, end - p, "\r\n", 2)) == NULL)
+			return -1;
+		k = strtoull(p, NULL, 16);
+		p = eol + 2;
+		if (k > (size_t)(end - p) || (size_t)(end - p) - k < 2)
+			return -1;
+		if (k == 0)
+			break;
+		memmove(out, p, k);
+		out += k;
+		p += k + 2;
+	}
+
+	/* Trailing headers, ended by an empty line */
+	while ((eol = memmem(p, end - p, "\r\n", 2)) != NULL && eol > p) {
+		if (strncasecmp(p, "x-amz-checksum-", 15) == 0)
+			sscanf(p + 15, "%15[^:]:%31s", req->checksum_alg, req->checksum);
+		p = eol + 2;
+	}
+	if (eol == NULL)
+		return -1;
+	*len = out - body;
+	body[*len] = '\0';
+
+	return 0;
+}
+
+/* Check a PUT body against the checksum sent with it, if any */
+static int
+mock_checksum(struct mock_request *req, const char *data, size_t len) {
+	struct s3_checksum ck;
+	char sum[S3_CHECKSUM_LENGTH];
+
+	if (req->checksum_alg[0] == '\0')
+		return 0;
+	if (strcasecmp(req->checksum_alg, "crc32c") == 0)
+		s3_checksum_init(&ck, S3_CHECKSUM_CRC32C);
+	else if (strcasecmp(req->checksum_alg, "crc64nvme") == 0)
+		s3_checksum_init(&ck, S3_CHECKSUM_CRC64NVME);
+	else
+		return -1;
+	s3_checksum_update(&ck, data, len);
+	s3_checksum_base64(&ck, sum);
+
+	return strcmp(sum, req->checksum) == 0 ? 0 : -1;
+}
+
+static int
+mock_handle(int fd, struct mock_request *req, char *buf, size_t *buffered) {
+	struct mock_object *o;
+	char *body, *copy;
+	char hdr[1024];
+	size_t len, have, start, n;
+	int head, rc;
+
+	if (verbose)
+		fprintf(stderr, "%s %s%s%s\n", req->method, req->name, *req->query ? "?" : "", req->query);
+
+	len = req->content_length;
+	if (len > 0 && req->expect_continue && *buffered == 0 &&
+	    write_all(fd, "HTTP/1.1 100 Continue\r\n\r\n", 25) < 0)
+		return -1;
+
+	body = malloc(len + 1);
+	have = *buffered < len ? *buffered : len;
+	memcpy(body, buf, have);
+	*buffered -= have;
+	memmove(buf, buf + have, *buffered);
+	if (read_all(fd, body + have, len - have) < 0) {
+		free(body);
+		return -1;
+	}
+	body[len] = '\0';
+
+	if (error_rate > 0 && arc4random_uniform(1000000) < error_rate * 1000000) {
+		free(body);
+		return mock_error(fd, 503, "Slow Down", "SlowDown", strcmp(req->method, "HEAD") != 0);
+	}
+
+	if (req->aws_chunked && mock_unchunk(req, body, &len) < 0) {
+		free(body);
+		return mock_error(fd, 400, "Bad Request", "IncompleteBody", 1);
+	}
+
+	if (strcmp(req->method, "POST") == 0 && strcmp(req->query, "delete") == 0)
+		return mock_delete_many(fd, req, body, len);
+
+	if (strstr(req->query, "uploads") || strstr(req->query, "uploadId="))
+		return mock_multipart(fd, req, body, len);
+
+	if (strcmp(req->method, "PUT") == 0) {
+		if (mock_checksum(req, body, len) < 0) {
+			free(body);
+			return mock_error(fd, 400, "Bad Request", "BadDigest", 1);
+		}
+		mock_store(req->name, body, len, req->checksum_alg, req->checksum);
+		pthread_mutex_lock(&store_lock);
+		o = mock_lookup(req->name);
+		snprintf(o->content_type, sizeof (o->content_type), "%s", req->content_type);
+		snprintf(o->meta, sizeof (o->meta), "%s", req->meta);
+		pthread_mutex_unlock(&store_lock);
+		return mock_send_etag(fd, req->name);
+	}
+	free(body);
+
+	if (strcmp(req->method, "DELETE") == 0) {
+		mock_remove(req->name);
+		return mock_respond(fd, 204, "No Content", NULL, NULL, 0, 0);
+	}
+
+	if (strcmp(req->method, "GET") == 0 && strchr(req->name, '/')[1] == '\0')
+		return mock_list(fd, req);
+
+	head = strcmp(req->method, "HEAD") == 0;
+	if (head || strcmp(req->method, "GET") == 0) {
+		pthread_mutex_lock(&store_lock);
+		if ((o = mock_lookup(req->name)) == NULL) {
+			pthread_mutex_unlock(&store_lock);
+			return mock_error(fd, 404, "Not Found", "NoSuchKey", !head);
+		}
+		if (req->if_match[0] && strcmp(req->if_match, o->etag) != 0) {
+			pthread_mutex_unlock(&store_lock);
+			return mock_error(fd, 412, "Precondition Failed", "PreconditionFailed", !head);
+		}
+		if (req->if_none_match[0] && strcmp(req->if_none_match, o->etag) == 0) {
+			snprintf(hdr, sizeof (hdr), "ETag: \"%s\"\r\n", o->etag);
+			pthread_mutex_unlock(&store_lock);
+			return mock_respond(fd, 304, "Not Modified", hdr, NULL, 0, 0);
+		}
+		start = 0;
+		len = o->len;
+		if (req->has_range) {
+			if (req->range_start >= o->len) {
+				pthread_mutex_unlock(&store_lock);
+				return mock_error(fd, 416, "Requested Range Not Satisfiable", "InvalidRange", !head);
+			}
+			start = req->range_start;
+			len = (req->range_end < o->len ? req->range_end + 1 : o->len) - start;
+			snprintf(hdr, sizeof (hdr), "ETag: \"%s\"\r\nContent-Range: bytes %zu-%zu/%zu\r\n",
+			    o->etag, start, start + len - 1, o->len);
+		} else if (req->checksum_mode && o->checksum_alg[0])
+			snprintf(hdr, sizeof (hdr), "ETag: \"%s\"\r\nx-amz-checksum-%s: %s\r\n",
+			    o->etag, o->checksum_alg, o->checksum);
+		else
+			snprintf(hdr, sizeof (hdr), "ETag: \"%s\"\r\n", o->etag);
+		n = strlen(hdr);
+		n += strftime(hdr + n, sizeof (hdr) - n, "Last-Modified: %a, %d %b %Y %H:%M:%S GMT\r\n", gmtime(&o->mtime));
+		if (o->content_type[0])
+			n += snprintf(hdr + n, sizeof (hdr) - n, "Content-Type: %s\r\n", o->content_type);
+		snprintf(hdr + n, sizeof (hdr) - n, "%s", o->meta);
+		copy = malloc(len + 1);
+		memcpy(copy, o->data + start, len);
+		pthread_mutex_unlock(&store_lock);
+
+		if (req->has_range)
+			rc = mock_respond(fd, 206, "Partial Content", hdr, copy, len, !head);
+		else
+			rc = mock_respond(fd, 200, "OK", hdr, copy, len, !head);
+		free(copy);
+		return rc;
+	}
+
+	return mock_error(fd, 501, "Not Implemented", "NotImplemented", 1);
+}
+
+static void *
+mock_conn(void *arg) {
+	struct mock_request req;
+	char *buf;
+	size_t buffered = 0;
+	int fd = (int)(long)arg;
+
+	buf = malloc(MOCK_HDR_MAX);
+	for (;;) {
+		if (mock_read_request(fd, &req, buf, &buffered) < 0)
+			break;
+		if (mock_handle(fd, &req, buf, &buffered) < 0 || req.close)
+			break;
+	}
+	free(buf);
+	close(fd);
+
+	return NULL;
+}
+
+static void
+usage(void) {
+	fprintf(stderr, "Usage: s3mock [-v] [-b bytes/s] [-e error rate] [-l latency ms] [-p port]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv) {
+	struct sockaddr_in sin;
+	pthread_attr_t attr;
+	pthread_t tid;
+	int ch, s, fd, one = 1;
+	int port = 8000;
+
+	while ((ch = getopt(argc, argv, "b:e:l:p:v")) != -1) {
+		switch (ch) {
+		case 'b':
+			bandwidth = strtod(optarg, NULL);
+			break;
+		case 'e':
+			error_rate = strtod(optarg, NULL);
+			break;
+		case 'l':
+			latency_ms = atoi(optarg);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if ((s = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		return 1;
+	}
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+
+	memset(&sin, 0, sizeof (sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(s, (struct sockaddr *)&sin, sizeof (sin)) < 0 || listen(s, 128) < 0) {
+		perror("bind");
+		return 1;
+	}
+	fprintf(stderr, "s3mock listening on 127.0.0.1:%d\n", port);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (;;) {
+		if ((fd = accept(s, NULL, NULL)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("accept");
+			break;
+		}
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+		pthread_create(&tid, &attr, mock_conn, (void *)(long)fd);
+	}
+
+	return 1;
+}
@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2014, Ian Delahorne <ian.delahorne@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "s3.h"
+#include "s3internal.h"
+
+#ifdef LINUX
+#include <bsd/string.h>
+#endif
+#include <string.h>
+
+struct s3_multipart;
+
+struct s3_part {
+	struct s3_multipart *mp;
+	int number;
+	char etag[S3_ETAG_LENGTH];
+};
+
+struct s3_multipart {
+	struct S3 *s3;
+	struct s3_batch *batch;
+	const char *bucket;
+	const char *key;
+	char *upload_id;	/* URL-encoded, as it goes in a query */
+	struct s3_source *src;
+	size_t len;
+	size_t part_size;
+	int nparts;
+	int next;
+	int failed;
+	struct s3_part *parts;
+};
+
+static int
+s3_multipart_initiate(struct s3_multipart *mp, const char *content_type) {
+	struct s3_op op;
+	struct s3_string *out;
+	char *id = NULL;
+
+	out = s3_string_init();
+	s3_op_init(&op, mp->s3, "POST", mp->bucket, mp->key, "uploads", NULL);
+	op.content_type = content_type ? s3_arena_strdup(&op.arena, content_type) : NULL;
+	op.out = s3_sink_init_string(&op.out_store, out);
+
+	s3_perform_op(&op);
+	if (S3_RESULT_OK(&op.result))
+		id = s3_xml_find_text(out->ptr, out->len, "//amzn:UploadId");
+
+	/* Other servers' IDs may hold "+", "/" or "=" */
+	if (id != NULL) {
+		mp->upload_id = s3_url_encode(id);
+		free(id);
+	}
+
+	s3_op_free(&op);
+	s3_string_free(out);
+
+	return mp->upload_id ? 0 : -1;
+}
+
+static void s3_multipart_queue_part(struct s3_multipart *mp);
+
+static void
+s3_multipart_part_done(struct s3_op *op, void *arg) {
+	struct s3_part *part = arg;
+	struct s3_multipart *mp = part->mp;
+
+	if (!S3_RESULT_OK(&op->result) || op->etag[0] == '\0') {
+		mp->failed = 1;
+		return;
+	}
+	strlcpy(part->etag, op->etag, sizeof (part->etag));
+
+	/* Parts are only queued as earlier ones finish, keeping the queue short */
+	if (!mp->failed && mp->next < mp->nparts)
+		s3_multipart_queue_part(mp);
+}
+
+static void
+s3_multipart_queue_part(struct s3_multipart *mp) {
+	struct s3_part *part = &mp->parts[mp->next++];
+	struct s3_op *op = malloc(sizeof (struct s3_op));
+	size_t offset = (size_t)(part->number - 1) * mp->part_size;
+	size_t len = mp->len - offset < mp->part_size ? mp->len - offset : mp->part_size;
+	char *subresource;
+
+	asprintf(&subresource, "partNumber=%d&uploadId=%s", part->number, mp->upload_id);
+	s3_op_init(op, mp->s3, "PUT", mp->bucket, mp->key, subresource, NULL);
+	free(subresource);
+
+	/* Part checksums would have to be announced when the upload starts */
+	op->checksum_type = S3_CHECKSUM_NONE;
+	s3_op_set_source(op, NULL, s3_source_slice(mp->src, offset, len));
+	op->done = s3_multipart_part_done;
+	op->arg = part;
+
+	s3_batch_add(mp->batch, op);
+}
+
+static int
+s3_multipart_complete(struct s3_multipart *mp) {
+	struct s3_op op;
+	struct s3_string *body, *out;
+	char *subresource;
+	char *p;
+	size_t size;
+	int i, ok;
+
+	size = 128 + mp->nparts * (64 + S3_ETAG_LENGTH);
+	body = s3_string_init();
+	s3_string_reserve(body, size);
+
+	p = body->ptr;
+	p += sprintf(p, "<CompleteMultipartUpload>");
+	for (i = 0; i < mp->nparts; i++)
+		p += sprintf(p, "<Part><PartNumber>%d</PartNumber><ETag>%s</ETag></Part>",
+		    mp->parts[i].number, mp->parts[i].etag);
+	p += sprintf(p, "</CompleteMultipartUpload>");
+	body->len = p - body->ptr;
+
+	asprintf(&subresource, "uploadId=%s", mp->upload_id);
+	s3_op_init(&op, mp->s3, "POST", mp->bucket, mp->key, subresource, NULL);
+	free(subresource);
+
+	op.content_type = "application/xml";
+	out = s3_string_init();
+	op.in = s3_source_init_buffer(&op.in_store, body->ptr, body->len);
+	op.out = s3_sink_init_string(&op.out_store, out);
+
+	s3_perform_op(&op);
+
+	/* S3 may report a failed completion in the body of a 200 response */
+	ok = S3_RESULT_OK(&op.result) && strstr(out->ptr, "<Error>") == NULL;
+
+	s3_op_free(&op);
+	s3_string_free(out);
+	s3_string_free(body);
+
+	return ok ? 0 : -1;
+}
+
+static void
+s3_multipart_abort(struct s3_multipart *mp) {
+	struct s3_op op;
+	char *subresource;
+
+	asprintf(&subresource, "uploadId=%s", mp->upload_id);
+	s3_op_init(&op, mp->s3, "DELETE", mp->bucket, mp->key, subresource, NULL);
+	free(subresource);
+
+	s3_perform_op(&op);
+	s3_op_free(&op);
+}
+
+/* The part size actually used to upload len bytes in part_size parts */
+size_t
+s3_multipart_part_size(size_t len, size_t part_size) {
+	if (part_size < S3_MULTIPART_MIN_PART_SIZE)
+		part_size = S3_MULTIPART_MIN_PART_SIZE;
+	while ((len + part_size - 1) / part_size > S3_MULTIPART_MAX_PARTS)
+		part_size *= 2;
+
+	return part_size;
+}
+
+static int
+s3_multipart_upload(struct S3 *s3, const char *bucket, const char *key, const char *content_type, struct s3_source *src, size_t part_size, int parallelism) {
+	struct s3_multipart mp;
+	size_t len = src->len;
+	int i, rc;
+
+	part_size = s3_multipart_part_size(len, part_size);
+	if (parallelism < 1)
+		parallelism = 1;
+
+	memset(&mp, 0, sizeof (mp));
+	mp.s3 = s3;
+	mp.bucket = bucket;
+	mp.key = key;
+	mp.src = src;
+	mp.len = len;
+	mp.part_size = part_size;
+	mp.nparts = len ? (len + part_size - 1) / part_size : 1;
+
+	if (s3_multipart_initiate(&mp, content_type) < 0)
+		return -1;
+
+	mp.parts = calloc(mp.nparts, sizeof (struct s3_part));
+	for (i = 0; i < mp.nparts; i++) {
+		mp.parts[i].mp = &mp;
+		mp.parts[i].number = i + 1;
+	}
+
+	mp.batch = s3_batch_new(s3, parallelism);
+	for (i = 0; i < parallelism && mp.next < mp.nparts; i++)
+		s3_multipart_queue_part(&mp);
+	s3_batch_wait(mp.batch);
+	s3_batch_free(mp.batch);
+
+	rc = mp.failed ? -1 : s3_multipart_complete(&mp);
+	if (rc < 0)
+		s3_multipart_abort(&mp);
+
+	free(mp.parts);
+	free(mp.upload_id);
+
+	return rc;
+}
+
+/*
+ * Upload len bytes of data as a multipart upload of part_size parts,
+ * at most parallelism of them in flight at a time. Parts are sent
+ * straight from data. On failure the upload is aborted so no parts are
+ * left behind. Returns 0 on success, -1 on failure.
+ */
+int
+s3_put_multipart(struct S3 *s3, const char *bucket, const char *key, const char *content_type, const char *data, size_t len, size_t part_size, int parallelism) {
+	struct s3_source *src = s3_source_buffer(data, len);
+	int rc;
+
+	rc = s3_multipart_upload(s3, bucket, key, content_type, src, part_size, parallelism);
+	s3_source_free(src);
+
+	return rc;
+}
+
+/* As s3_put_multipart, reading each part from fd with pread() */
+int
+s3_put_multipart_fd(struct S3 *s3, const char *bucket, const char *key, const char *content_type, int fd, size_t len, size_t part_size, int parallelism) {
+	struct s3_source *src = s3_source_fd(fd, 0, len);
+	int rc;
+
+	rc = s3_multipart_upload(s3, bucket, key, content_type, src, part_size, parallelism);
+	s3_source_free(src);
+
+	return rc;
+}
@@ -22,17 +22,48 @@
  * SOFTWARE.  
  */
 
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdlib.h>
+#include <strings.h>
 
 #include <curl/curl.h>
+#include <libxml/parser.h>
 
 #include "s3.h"
 #include "s3internal.h"
 #include <stdio.h>
 
+static void s3_handle_free(struct s3_handle *h);
+static void s3_thread_exit(void *arg);
+
+static pthread_once_t s3_global_once = PTHREAD_ONCE_INIT;
+
+/*
+ * curl and libxml2 each have process-wide state that must be set up
+ * once before threads use them, and is never torn down by us: tearing
+ * it down is only safe once no thread can be using either library,
+ * which only the application knows.
+ */
+static void
+s3_global_init(void) {
+	curl_global_init(CURL_GLOBAL_ALL);
+	xmlInitParser();
+}
+
 struct S3 *
 s3_init(const char *id, const char *secret, const char *base_url) {
-	struct S3 *s3 = malloc(sizeof (struct S3));
+	struct S3 *s3;
+
+	pthread_once(&s3_global_once, s3_global_init);
+
+	s3 = malloc(sizeof (struct S3));
+
+	/* Fails once the process has PTHREAD_KEYS_MAX of them */
+	if (pthread_key_create(&s3->thread_key, s3_thread_exit) != 0) {
+		free(s3);
+		return NULL;
+	}
 
 	s3->id = malloc(S3_ID_LENGTH);
 	s3->secret = malloc(S3_SECRET_LENGTH);
@@ -44,12 +75,100 @@ s3_init(const char *id, const char *secret, const char *base_url) {
 	strlcpy(s3->base_url, base_url, 255);
 	
 	s3->proxy = NULL;
+	s3->region = NULL;
+	s3->chunked_uploads = 0;
+	s3->checksum = S3_CHECKSUM_NONE;
+	s3->signer = s3_signer_new(secret);
+	s3->retry.max_attempts = S3_RETRY_ATTEMPTS;
+	s3->retry.base_delay_ms = S3_RETRY_BASE_DELAY_MS;
+	s3->retry.max_delay_ms = S3_RETRY_MAX_DELAY_MS;
+	s3->hedge.percentile = 0;
+	s3->hedge.min_delay_ms = S3_HEDGE_MIN_DELAY_MS;
+	s3->hedger = s3_hedger_new();
+	s3->cache = NULL;
+	s3->list_cache = NULL;
+	s3->metrics_cb = NULL;
+	s3->metrics_arg = NULL;
+
+	pthread_mutex_init(&s3->lock, NULL);
+	SLIST_INIT(&s3->threads);
+	memset(&s3->metrics_exited, 0, sizeof (s3->metrics_exited));
+	s3->max_idle_handles = S3_MAX_IDLE_HANDLES;
 
 	return s3;
 }
 
+static void
+s3_thread_free(struct s3_thread *t) {
+	struct s3_handle *h;
+
+	while ((h = SLIST_FIRST(&t->handles)) != NULL) {
+		SLIST_REMOVE_HEAD(&t->handles, next);
+		s3_handle_free(h);
+	}
+	if (t->hedge_multi)
+		curl_multi_cleanup(t->hedge_multi);
+	free(t);
+}
+
+/* A thread that used the context has exited; its counts live on */
+static void
+s3_thread_exit(void *arg) {
+	struct s3_thread *t = arg;
+
+	pthread_mutex_lock(&t->s3->lock);
+	SLIST_REMOVE(&t->s3->threads, t, s3_thread, next);
+	s3_metrics_add(&t->s3->metrics_exited, &t->metrics);
+	pthread_mutex_unlock(&t->s3->lock);
+
+	s3_thread_free(t);
+}
+
+/*
+ * The calling thread's own state on s3. Only creating it takes the
+ * lock, so threads don't contend for handles.
+ */
+struct s3_thread *
+s3_thread_get(struct S3 *s3) {
+	struct s3_thread *t;
+
+	if ((t = pthread_getspecific(s3->thread_key)) != NULL)
+		return t;
+
+	t = calloc(1, sizeof (struct s3_thread));
+	t->s3 = s3;
+	SLIST_INIT(&t->handles);
+	pthread_setspecific(s3->thread_key, t);
+
+	pthread_mutex_lock(&s3->lock);
+	SLIST_INSERT_HEAD(&s3->threads, t, next);
+	pthread_mutex_unlock(&s3->lock);
+
+	return t;
+}
+
+/*
+ * Threads other than the caller must be done with s3 by now. The state
+ * of those still running is freed here; deleting the key keeps it from
+ * being freed again when they exit.
+ */
 void
 s3_free(struct S3 *s3) {
+	struct s3_thread *t;
+
+	pthread_key_delete(s3->thread_key);
+	while ((t = SLIST_FIRST(&s3->threads)) != NULL) {
+		SLIST_REMOVE_HEAD(&s3->threads, next);
+		s3_thread_free(t);
+	}
+	pthread_mutex_destroy(&s3->lock);
+
+	s3_hedger_free(s3->hedger);
+	if (s3->cache)
+		s3_cache_free(s3->cache);
+	if (s3->list_cache)
+		s3_list_cache_free(s3->list_cache);
+	s3_signer_free(s3->signer);
 	free(s3->id);
 	free(s3->secret);
 	free(s3->base_url);
@@ -57,166 +176,665 @@ s3_free(struct S3 *s3) {
 	free(s3);
 }
 
-char *
-s3_make_date(void) {
-	char *date;
-	time_t now;
+/*
+ * Hand out an easy handle, preferring an idle one so that its live
+ * connection, DNS cache and TLS session are reused by the next request.
+ */
+struct s3_handle *
+s3_handle_get(struct S3 *s3) {
+	struct s3_thread *t = s3_thread_get(s3);
+	struct s3_handle *h;
+
+	if ((h = SLIST_FIRST(&t->handles)) != NULL) {
+		SLIST_REMOVE_HEAD(&t->handles, next);
+		t->nidle--;
+		return h;
+	}
+
+	h = malloc(sizeof (*h));
+	h->curl = curl_easy_init();
+	h->chunker = NULL;
+	s3_arena_init(&h->scratch, NULL, S3_HANDLE_SCRATCH);
+	memset(&h->clock, 0, sizeof (h->clock));
+
+	return h;
+}
+
+static void
+s3_handle_free(struct s3_handle *h) {
+	curl_easy_cleanup(h->curl);
+	s3_arena_release(&h->scratch);
+	if (h->chunker)
+		s3_chunker_free(h->chunker);
+	free(h);
+}
+
+/*
+ * Return a handle to the calling thread's idle list. curl_easy_reset()
+ * drops all options (so no pointers to freed request data linger) but
+ * keeps the connection cache, so the connection stays warm for the
+ * next request.
+ */
+void
+s3_handle_put(struct S3 *s3, struct s3_handle *h) {
+	struct s3_thread *t = s3_thread_get(s3);
+
+	if (t->nidle >= s3->max_idle_handles) {
+		s3_handle_free(h);
+		return;
+	}
+
+	curl_easy_reset(h->curl);
+	s3_arena_reset(&h->scratch);
+	SLIST_INSERT_HEAD(&t->handles, h, next);
+	t->nidle++;
+}
+
+/* Bring the request dates up to the current second */
+void
+s3_clock_update(struct s3_clock *c) {
+	time_t now = time(NULL);
 	struct tm tm;
 
-	date = malloc(128);
-	now = time(0);
-	tm = *gmtime(&now);
-	strftime(date, 128, "%a, %d %b %Y %H:%M:%S %Z", &tm);
+	if (now == c->now)
+		return;
 
-	return date;
+	gmtime_r(&now, &tm);
+	strftime(c->http, sizeof (c->http), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	strftime(c->amz, sizeof (c->amz), "%Y%m%dT%H%M%SZ", &tm);
+	strftime(c->day, sizeof (c->day), "%Y%m%d", &tm);
+	c->now = now;
+}
+
+/*
+ * Response bodies go to the op's sink, except for errors: those are
+ * kept back in the op so that a failed attempt leaves nothing in the
+ * caller's file or buffer and the S3 error code can be read from it.
+ * Of a hedged pair, only the first to deliver data may write.
+ */
+static size_t
+s3_op_writefunc(char *ptr, size_t len, size_t nmemb, struct s3_op *op) {
+	size_t n = len * nmemb, k;
+
+	if (op->result.status == 0)
+		curl_easy_getinfo(op->handle->curl, CURLINFO_RESPONSE_CODE, &op->result.status);
+
+	if (op->result.status >= 300) {
+		k = sizeof (op->error_body) - 1 - op->error_len;
+		if (k > n)
+			k = n;
+		memcpy(op->error_body + op->error_len, ptr, k);
+		op->error_len += k;
+		op->error_body[op->error_len] = '\0';
+		return n;
+	}
 
+	if (op->twin && op->twin->claimed)
+		return 0;
+	op->claimed = 1;
+	if (op->out == NULL)
+		return n;
+	return s3_sink_curl_writefunc(ptr, len, nmemb, op->out);
+}
+
+/* The <Code> of an <Error> response */
+static void
+s3_op_error_code(struct s3_op *op) {
+	const char *p, *end;
+	size_t n;
+
+	if ((p = strstr(op->error_body, "<Code>")) == NULL ||
+	    (end = strstr(p += 6, "</Code>")) == NULL)
+		return;
+
+	n = end - p;
+	if (n >= sizeof (op->result.code))
+		n = sizeof (op->result.code) - 1;
+	memcpy(op->result.code, p, n);
+	op->result.code[n] = '\0';
+}
+
+/*
+ * A full-object checksum on a GET response: check the body against it
+ * as it arrives. Composite checksums of multipart uploads ("...-N")
+ * can't be checked without the part boundaries and are ignored.
+ */
+static void
+s3_op_checksum_header(struct s3_op *op, const char *ptr, size_t n) {
+	enum s3_checksum_type type;
+	const char *name, *colon;
+	size_t vlen;
+
+	if (op->checksum_type == S3_CHECKSUM_NONE || strcmp(op->method, "GET") != 0 ||
+	    (colon = memchr(ptr, ':', n)) == NULL)
+		return;
+
+	for (type = S3_CHECKSUM_CRC32C; type <= S3_CHECKSUM_CRC64NVME; type++) {
+		name = s3_checksum_name(type);
+		if ((size_t)(colon - ptr) == strlen(name) && strncasecmp(ptr, name, colon - ptr) == 0)
+			break;
+	}
+	if (type > S3_CHECKSUM_CRC64NVME)
+		return;
+
+	n -= colon + 1 - ptr;
+	for (ptr = colon + 1; n > 0 && *ptr == ' '; ptr++, n--)
+		;
+	for (vlen = n; vlen > 0 && (ptr[vlen - 1] == '\r' || ptr[vlen - 1] == '\n'); vlen--)
+		;
+	if (vlen == 0 || vlen >= S3_CHECKSUM_LENGTH || memchr(ptr, '-', vlen) != NULL)
+		return;
+
+	s3_checksum_init(&op->out->checksum, type);
+	memcpy(op->out->checksum_expected, ptr, vlen);
+	op->out->checksum_expected[vlen] = '\0';
 }
 
-/* Add return values later */
 void
-s3_perform_op(struct S3 *s3, const char *method, const char *url, const char *sign_data, const char *date, struct s3_string *out, struct s3_string *in, const char *content_md5, const char *content_type) {
-	char *digest;
-	char *hdr;
-	
-	CURL *curl;
-	struct curl_slist *headers = NULL;
+s3_object_info_init(struct s3_object_info *info) {
+	memset(info, 0, sizeof (*info));
+	info->last_modified = -1;
+	TAILQ_INIT(&info->meta);
+}
 
+/* Free the metadata and forget what was known about the object */
+void
+s3_object_info_clear(struct s3_object_info *info) {
+	struct s3_meta *m;
+
+	while ((m = TAILQ_FIRST(&info->meta)) != NULL) {
+		TAILQ_REMOVE(&info->meta, m, list);
+		free(m->name);
+		free(m->value);
+		free(m);
+	}
+	s3_object_info_init(info);
+}
 
+/* The value of user metadata name, or NULL; names are not case sensitive */
+const char *
+s3_object_info_meta(const struct s3_object_info *info, const char *name) {
+	struct s3_meta *m;
 
-	digest = s3_hmac_sign(s3->secret, sign_data, strlen(sign_data));
-#ifdef DEBUG
-	fprintf(stderr, "DEBUG: data to sign:%s\n", sign_data);
-	fprintf(stderr, "DEBUG: Authentication: AWS %s:%s\n", s3->id, digest);
-#endif
-	curl = curl_easy_init();
-	
-	hdr = malloc(1024);
-
-	if (strcmp(method, "DELETE") == 0) {
-		curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, method);
-	} else if (strcmp(method, "PUT") == 0) {
-		if (content_type) {
-			snprintf(hdr, 1023, "Content-Type: %s", content_type);
-			headers = curl_slist_append(headers, hdr);
+	TAILQ_FOREACH(m, &info->meta, list)
+		if (strcasecmp(m->name, name) == 0)
+			return m->value;
+	return NULL;
+}
+
+/*
+ * The headers s3_head() reports, n bytes at ptr. Values are copied out
+ * without leading blanks or the line ending.
+ */
+static void
+s3_op_info_header(struct s3_object_info *info, const char *ptr, size_t n) {
+	const char *colon, *value;
+	struct s3_meta *m;
+	char date[64];
+	size_t vlen;
+
+	if ((colon = memchr(ptr, ':', n)) == NULL)
+		return;
+	for (value = colon + 1; value < ptr + n && *value == ' '; value++)
+		;
+	for (vlen = ptr + n - value; vlen > 0 && (value[vlen - 1] == '\r' || value[vlen - 1] == '\n'); vlen--)
+		;
+
+	if (colon - ptr == 13 && strncasecmp(ptr, "Last-Modified", 13) == 0 && vlen < sizeof (date)) {
+		memcpy(date, value, vlen);
+		date[vlen] = '\0';
+		info->last_modified = curl_getdate(date, NULL);
+	} else if (colon - ptr == 12 && strncasecmp(ptr, "Content-Type", 12) == 0 &&
+	    vlen < sizeof (info->content_type)) {
+		memcpy(info->content_type, value, vlen);
+		info->content_type[vlen] = '\0';
+	} else if (colon - ptr > 11 && strncasecmp(ptr, "x-amz-meta-", 11) == 0) {
+		m = malloc(sizeof (struct s3_meta));
+		m->name = strndup(ptr + 11, colon - ptr - 11);
+		m->value = strndup(value, vlen);
+		TAILQ_INSERT_TAIL(&info->meta, m, list);
+	}
+}
+
+/* Pick the response headers we care about out of the stream */
+static size_t
+s3_op_headerfunc(char *ptr, size_t len, size_t nmemb, struct s3_op *op) {
+	size_t n = len * nmemb;
+	size_t vlen;
+
+	if (n > 15 && strncasecmp(ptr, "Content-Length:", 15) == 0) {
+		op->content_length = strtoull(ptr + 15, NULL, 10);
+		if (op->out && strcmp(op->method, "HEAD") != 0)
+			s3_sink_expect(op->out, op->content_length);
+	} else if (n > 5 && strncasecmp(ptr, "ETag:", 5) == 0) {
+		ptr += 5;
+		n -= 5;
+		while (n > 0 && *ptr == ' ') {
+			ptr++;
+			n--;
 		}
-		
-		if (content_md5) {
-			snprintf(hdr, 1023, "Content-MD5: %s", content_md5);
-			headers = curl_slist_append(headers, hdr);
-		}		
-		
-		curl_easy_setopt(curl, CURLOPT_READFUNCTION, s3_string_curl_readfunc);
-		curl_easy_setopt(curl, CURLOPT_READDATA, in);
-		curl_easy_setopt(curl, CURLOPT_INFILESIZE, in->len);
-		curl_easy_setopt(curl, CURLOPT_UPLOAD, 1);
-	}
-
-	snprintf(hdr, 1023, "Date: %s", date);
-	headers = curl_slist_append(headers, hdr);
-
-	snprintf(hdr, 1023, "Authorization: AWS %s:%s", s3->id, digest);
-	headers = curl_slist_append(headers, hdr);
-	free(hdr);
-	
+		for (vlen = n; vlen > 0 && (ptr[vlen - 1] == '\r' || ptr[vlen - 1] == '\n'); vlen--)
+			;
+		if (vlen >= sizeof (op->etag))
+			vlen = sizeof (op->etag) - 1;
+		memcpy(op->etag, ptr, vlen);
+		op->etag[vlen] = '\0';
+	} else if (n > 15 && strncasecmp(ptr, "x-amz-checksum-", 15) == 0 && op->out &&
+	    (op->twin == NULL || !op->twin->claimed))
+		s3_op_checksum_header(op, ptr + 15, n - 15);
+	else if (op->info)
+		s3_op_info_header(op->info, ptr, n);
+
+	return len * nmemb;
+}
+
+/*
+ * Describe a request against /bucket/key. subresource (e.g. "uploads")
+ * is signed along with the resource; query is appended to the URL but,
+ * like delimiter and prefix, not signed.
+ */
+void
+s3_op_init(struct s3_op *op, struct S3 *s3, const char *method, const char *bucket, const char *key, const char *subresource, const char *query) {
+	char *path;
+
+	memset(op, 0, offsetof(struct s3_op, scratch));
+	s3_arena_init(&op->arena, op->scratch, sizeof (op->scratch));
+
+	op->s3 = s3;
+	op->method = method;
+	op->checksum_type = s3->checksum;
+
+	path = s3_arena_url_encode(&op->arena, key ? key : "", 1);
+	op->resource = s3_arena_printf(&op->arena, "/%s/%s%s%s", bucket, path,
+	    subresource ? "?" : "", subresource ? subresource : "");
+	op->url = s3_arena_printf(&op->arena, "http://%s.%s/%s%s%s%s%s", bucket, s3->base_url, path,
+	    subresource || query ? "?" : "",
+	    subresource ? subresource : "",
+	    subresource && query ? "&" : "",
+	    query ? query : "");
+}
+
+void
+s3_op_free(struct s3_op *op) {
+	if (op->in && op->in != &op->in_store)
+		s3_source_free(op->in);
+	if (op->out && op->out != &op->out_store)
+		s3_sink_free(op->out);
+
+	curl_slist_free_all(op->headers);
+	s3_arena_release(&op->arena);
+}
+
+/*
+ * Add a header to the request being set up. The text and the list node
+ * both come from the handle's scratch; the caller's own headers stay
+ * at the end of the list.
+ */
+void
+s3_op_header(struct s3_op *op, const char *fmt, ...) {
+	struct s3_arena *a = &op->handle->scratch;
+	struct curl_slist *node;
+	va_list ap;
+
+	node = s3_arena_alloc(a, sizeof (struct curl_slist));
+	va_start(ap, fmt);
+	node->data = s3_arena_vprintf(a, fmt, ap);
+	va_end(ap);
+
+	node->next = op->request_headers;
+	op->request_headers = node;
+}
+
+/*
+ * Take a handle and build the request's signed header list in it,
+ * without touching curl.
+ */
+void
+s3_op_prepare(struct s3_op *op) {
+	op->handle = s3_handle_get(op->s3);
+	op->request_headers = op->headers;
+
+	/* x-amz-* headers go in before signing so they are covered */
+	if (op->checksum[0])
+		s3_op_header(op, "x-amz-checksum-%s: %s", s3_checksum_name(op->checksum_type), op->checksum);
+	else if (op->checksum_type != S3_CHECKSUM_NONE && strcmp(op->method, "GET") == 0)
+		s3_op_header(op, "x-amz-checksum-mode: ENABLED");
+
+	s3_op_sign(op);
+
+	if (strcmp(op->method, "PUT") == 0 || strcmp(op->method, "POST") == 0) {
+		if (op->content_type)
+			s3_op_header(op, "Content-Type: %s", op->content_type);
+		else
+			/* Don't let curl add a form content type we didn't sign */
+			s3_op_header(op, "Content-Type:");
+		if (op->content_md5[0])
+			s3_op_header(op, "Content-MD5: %s", op->content_md5);
+	}
+}
+
+/*
+ * Sign the request and configure an easy handle for it. The date is
+ * taken here rather than in s3_op_init so that queued batch operations
+ * are not sent with a stale signature.
+ */
+void
+s3_op_setup(struct s3_op *op) {
+	struct S3 *s3 = op->s3;
+	CURL *curl;
+
+	s3_op_prepare(op);
+	curl = op->handle->curl;
+
+	if (strcmp(op->method, "DELETE") == 0) {
+		curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, op->method);
+	} else if (strcmp(op->method, "HEAD") == 0) {
+		curl_easy_setopt(curl, CURLOPT_NOBODY, 1);
+	} else if (strcmp(op->method, "PUT") == 0 || strcmp(op->method, "POST") == 0) {
+		if (strcmp(op->method, "POST") == 0) {
+			curl_easy_setopt(curl, CURLOPT_POST, 1);
+			curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)(op->in ? op->in->len : 0));
+		} else {
+			curl_easy_setopt(curl, CURLOPT_UPLOAD, 1);
+			curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t)(op->in ? op->in->len : 0));
+		}
+		if (op->chunked) {
+			op->in->pos = 0;
+			curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t)s3_chunked_length(op->in->len,
+			    op->chunked == S3_CHUNKED_SIGNED, op->checksum_type));
+			curl_easy_setopt(curl, CURLOPT_READFUNCTION, s3_chunker_curl_readfunc);
+			curl_easy_setopt(curl, CURLOPT_READDATA, op->chunker);
+			curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, s3_chunker_curl_seekfunc);
+			curl_easy_setopt(curl, CURLOPT_SEEKDATA, op->chunker);
+		} else if (op->in) {
+			op->in->pos = 0;
+			curl_easy_setopt(curl, CURLOPT_READFUNCTION, s3_source_curl_readfunc);
+			curl_easy_setopt(curl, CURLOPT_READDATA, op->in);
+			curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, s3_source_curl_seekfunc);
+			curl_easy_setopt(curl, CURLOPT_SEEKDATA, op->in);
+		} else {
+			curl_easy_setopt(curl, CURLOPT_POSTFIELDS, "");
+		}
+	}
+
 #ifdef DEBUG
 	curl_easy_setopt(curl, CURLOPT_VERBOSE, 1);
 	curl_easy_setopt(curl, CURLOPT_HEADER, 1);
 #endif
 	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
+	curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1);
+
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, op->request_headers);
 
-	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, s3_op_writefunc);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, op);
 
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, s3_string_curl_writefunc);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, out);
+	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, s3_op_headerfunc);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, op);
 
-	curl_easy_setopt(curl, CURLOPT_URL, url);
+	curl_easy_setopt(curl, CURLOPT_URL, op->url);
+	curl_easy_setopt(curl, CURLOPT_PRIVATE, op);
 
 	if (s3->proxy) {
 		curl_easy_setopt(curl, CURLOPT_PROXY, s3->proxy);
 	}
+}
 
-	curl_easy_perform(curl);
+/* Record the outcome of a transfer and give the handle back */
+void
+s3_op_finish(struct s3_op *op, int code) {
+	char sum[S3_CHECKSUM_LENGTH];
+
+	op->result.error = code;
+	op->result.attempts++;
+	curl_easy_getinfo(op->handle->curl, CURLINFO_RESPONSE_CODE, &op->result.status);
+	if (op->result.status >= 300)
+		s3_op_error_code(op);
+
+	if (code == 0 && op->result.status == 200 && op->out && op->out->checksum.type != S3_CHECKSUM_NONE) {
+		s3_checksum_base64(&op->out->checksum, sum);
+		if (strcmp(sum, op->out->checksum_expected) != 0)
+			op->result.error = S3_ERROR_CHECKSUM;
+	}
 
-	curl_easy_cleanup(curl);
-	curl_slist_free_all(headers);
+	s3_metrics_record(op);
 
-	free(digest);	
+	/* Headers of an error response say nothing about the object */
+	if (op->info) {
+		if (S3_RESULT_OK(&op->result)) {
+			op->info->content_length = op->content_length;
+			memcpy(op->info->etag, op->etag, sizeof (op->info->etag));
+		} else
+			s3_object_info_clear(op->info);
+	}
+
+	/* Whatever a write did, cached copies and listings can't be trusted now */
+	if (strcmp(op->method, "GET") != 0 && strcmp(op->method, "HEAD") != 0) {
+		if (op->s3->cache)
+			s3_cache_invalidate_op(op);
+		if (op->s3->list_cache)
+			s3_list_cache_invalidate_op(op);
+	}
+
+	/* The handle's scratch and chunker go with it */
+	s3_handle_put(op->s3, op->handle);
+	op->handle = NULL;
+	op->chunker = NULL;
+	op->request_headers = NULL;
+	op->date = NULL;
+	op->sign_data = NULL;
 }
 
+/*
+ * Make the op ready to be sent again: rewind its body, drop whatever
+ * response it got and sign it afresh when next set up. Fails if the
+ * body or the response can't be replayed.
+ */
+int
+s3_op_reset(struct s3_op *op) {
+	int attempts = op->result.attempts;
+
+	if ((op->in && s3_source_rewind(op->in) < 0) || (op->out && s3_sink_rewind(op->out) < 0))
+		return -1;
+
+	memset(&op->result, 0, sizeof (op->result));
+	op->result.attempts = attempts;
+	op->content_length = 0;
+	op->etag[0] = '\0';
+	if (op->info)
+		s3_object_info_clear(op->info);
+	op->error_len = 0;
+	op->error_body[0] = '\0';
+	op->claimed = 0;
+
+	return 0;
+}
+
+/* Run the op to completion, retrying as the context's policy allows */
+void
+s3_perform_op(struct s3_op *op) {
+	CURLcode code;
+	int delay;
+
+	for (;;) {
+		if (strcmp(op->method, "GET") == 0 && op->s3->hedge.percentile > 0)
+			s3_perform_hedged(op, s3_hedge_delay(op->s3));
+		else {
+			s3_op_setup(op);
+			code = curl_easy_perform(op->handle->curl);
+			s3_op_finish(op, code);
+		}
 
+		if ((delay = s3_op_retry(op)) < 0)
+			break;
+		s3_sleep_ms(delay);
+	}
+}
+
+/*
+ * Attach a request body, taking ownership of src. Content-MD5 is sent
+ * whenever the source can be read twice, unless the body goes
+ * aws-chunked instead. A checksum is only sent with PUTs: with SigV4 it
+ * is computed as the body is sent and follows it in a trailer, with V2
+ * it is computed in the same pass as the Content-MD5.
+ */
 void
+s3_op_set_source(struct s3_op *op, const char *content_type, struct s3_source *src) {
+	struct S3 *s3 = op->s3;
+	struct s3_checksum ck;
+
+	op->in = src;
+	if (strcmp(op->method, "PUT") != 0)
+		op->checksum_type = S3_CHECKSUM_NONE;
+
+	/* Chunk signatures and trailers cover the body in the pass that sends it */
+	if (s3->region && strcmp(op->method, "PUT") == 0 && s3->chunked_uploads)
+		op->chunked = S3_CHUNKED_SIGNED;
+	else if (s3->region && op->checksum_type != S3_CHECKSUM_NONE)
+		op->chunked = S3_CHUNKED_UNSIGNED;
+	else {
+		s3_checksum_init(&ck, op->checksum_type);
+		if (s3_source_md5(src, op->checksum_type ? &ck : NULL, op->content_md5) == 0)
+			s3_checksum_base64(&ck, op->checksum);
+		else
+			op->content_md5[0] = '\0';
+	}
+	op->content_type = content_type ? s3_arena_strdup(&op->arena, content_type) : NULL;
+}
+
+struct s3_result
 s3_get(struct S3 *s3, const char *bucket, const char *key, struct s3_string *out) {
-	const char *method = "GET";
-	char *sign_data;
-	char *date;
-	char *url;
-	
-	date = s3_make_date();
+	struct s3_op op;
 
-	asprintf(&sign_data, "%s\n\n\n%s\n/%s/%s", method, date, bucket, key);	
-	asprintf(&url, "http://%s.%s/%s", bucket, s3->base_url, key);
-	
-	s3_perform_op(s3, method, url, sign_data, date, out, NULL, NULL, NULL);
+	if (s3->cache)
+		return s3_cache_get(s3, bucket, key, out);
+
+	s3_op_init(&op, s3, "GET", bucket, key, NULL, NULL);
+	op.out = s3_sink_init_string(&op.out_store, out);
 
-	free(sign_data);
-	free(date);
-	free(url);
+	s3_perform_op(&op);
+	s3_op_free(&op);
+
+	return op.result;
 }
 
+/* Write the object to fd as it arrives */
+struct s3_result
+s3_get_fd(struct S3 *s3, const char *bucket, const char *key, int fd) {
+	struct s3_op op;
 
-void
+	s3_op_init(&op, s3, "GET", bucket, key, NULL, NULL);
+	op.out = s3_sink_init_fd(&op.out_store, fd, -1);
+
+	s3_perform_op(&op);
+	s3_op_free(&op);
+
+	return op.result;
+}
+
+/*
+ * Download into a caller provided buffer of size bytes; the transfer
+ * fails if the object doesn't fit. The number of bytes received is
+ * stored in len.
+ */
+struct s3_result
+s3_get_buffer(struct S3 *s3, const char *bucket, const char *key, char *buf, size_t size, size_t *len) {
+	struct s3_op op;
+
+	s3_op_init(&op, s3, "GET", bucket, key, NULL, NULL);
+	op.out = s3_sink_init_buffer(&op.out_store, buf, size);
+
+	s3_perform_op(&op);
+	if (len)
+		*len = op.out->pos;
+	s3_op_free(&op);
+
+	return op.result;
+}
+
+/* Hand each chunk of the object to write as it arrives */
+struct s3_result
+s3_get_cb(struct S3 *s3, const char *bucket, const char *key, s3_write_func write, void *arg) {
+	struct s3_op op;
+
+	s3_op_init(&op, s3, "GET", bucket, key, NULL, NULL);
+	op.out = s3_sink_init_callback(&op.out_store, write, arg);
+
+	s3_perform_op(&op);
+	s3_op_free(&op);
+
+	return op.result;
+}
+
+/*
+ * Ask for key's size, ETag, modification time, content type and user
+ * metadata without its body. info, if not NULL, is filled in on success
+ * and left empty otherwise; a missing key gives status 404.
+ */
+struct s3_result
+s3_head(struct S3 *s3, const char *bucket, const char *key, struct s3_object_info *info) {
+	struct s3_op op;
+
+	if (info)
+		s3_object_info_init(info);
+	s3_op_init(&op, s3, "HEAD", bucket, key, NULL, NULL);
+	op.info = info;
+
+	s3_perform_op(&op);
+	s3_op_free(&op);
+
+	return op.result;
+}
+
+struct s3_result
 s3_delete(struct S3 *s3, const char *bucket, const char *key) {
-	char *sign_data;
-	char *url;
-	char *date;
-	const char *method = "DELETE";
-	struct s3_string *out;
-       
-	out = s3_string_init();
-	date = s3_make_date();
-
-	asprintf(&sign_data, "%s\n\n\n%s\n/%s/%s", method, date, bucket, key);
-	asprintf(&url, "http://%s.%s/%s", bucket, s3->base_url, key);
-	
-	s3_perform_op(s3, method, url, sign_data, date, out, NULL, NULL, NULL);
+	struct s3_op op;
 
-	s3_string_free(out);
-	free(date);
-	free(url);
-	free(sign_data);
-	
+	s3_op_init(&op, s3, "DELETE", bucket, key, NULL, NULL);
+
+	s3_perform_op(&op);
+	s3_op_free(&op);
+
+	return op.result;
 }
 
-void
+struct s3_result
 s3_put(struct S3 *s3, const char *bucket, const char *key, const char *content_type, const char *data, size_t len) {
-	const char *method = "PUT";
-	char *sign_data;
-	char *date;
-	char *url;
-	char *md5;
-	struct s3_string *in, *out;
+	struct s3_op op;
 
-	in = s3_string_init();
-	out = s3_string_init();
+	s3_op_init(&op, s3, "PUT", bucket, key, NULL, NULL);
+	s3_op_set_source(&op, content_type, s3_source_init_buffer(&op.in_store, data, len));
 
-	in->ptr = realloc(in->ptr, len + 1);
-	memcpy(in->ptr, data, len);
-	in->len = len;
+	s3_perform_op(&op);
+	s3_op_free(&op);
 
-	md5 = s3_md5_sum(data, len);
+	return op.result;
+}
+
+/* Upload len bytes from the start of fd, read with pread() */
+struct s3_result
+s3_put_fd(struct S3 *s3, const char *bucket, const char *key, const char *content_type, int fd, size_t len) {
+	struct s3_op op;
+
+	s3_op_init(&op, s3, "PUT", bucket, key, NULL, NULL);
+	s3_op_set_source(&op, content_type, s3_source_init_fd(&op.in_store, fd, 0, len));
 
-	date = s3_make_date();
-	asprintf(&sign_data, "%s\n%s\n%s\n%s\n/%s/%s", method, md5, content_type ? content_type : "", date, bucket, key);  
+	s3_perform_op(&op);
+	s3_op_free(&op);
+
+	return op.result;
+}
 
+/* Upload len bytes produced by read; sent without Content-MD5 */
+struct s3_result
+s3_put_cb(struct S3 *s3, const char *bucket, const char *key, const char *content_type, s3_read_func read, void *arg, size_t len) {
+	struct s3_op op;
 
-	asprintf(&url, "http://%s.%s/%s", bucket, s3->base_url, key);
+	s3_op_init(&op, s3, "PUT", bucket, key, NULL, NULL);
+	s3_op_set_source(&op, content_type, s3_source_init_callback(&op.in_store, read, arg, len));
 
-	s3_perform_op(s3, method, url, sign_data, date, out, in, md5, content_type);
-	s3_string_free(in);
-	s3_string_free(out);
+	s3_perform_op(&op);
+	s3_op_free(&op);
 
-	free(url);
-	free(md5);
-	free(date);
-	free(sign_data);
+	return op.result;
 }
@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2014, Ian Delahorne <ian.delahorne@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "s3.h"
+#include "s3internal.h"
+
+#ifdef LINUX
+#include <bsd/string.h>
+#endif
+#include <string.h>
+
+struct s3_ranged;
+
+struct s3_range {
+	struct s3_ranged *rd;
+	int index;
+	int attempts;
+};
+
+struct s3_ranged {
+	struct S3 *s3;
+	struct s3_batch *batch;
+	const char *bucket;
+	const char *key;
+	char etag[S3_ETAG_LENGTH];
+	int fd;
+	size_t len;
+	size_t range_size;
+	int nranges;
+	int next;
+	int failed;
+	struct s3_range *ranges;
+};
+
+static int
+s3_ranged_stat(struct s3_ranged *rd) {
+	struct s3_object_info info;
+	struct s3_result r;
+
+	r = s3_head(rd->s3, rd->bucket, rd->key, &info);
+	if (S3_RESULT_OK(&r)) {
+		rd->len = info.content_length;
+		strlcpy(rd->etag, info.etag, sizeof (rd->etag));
+	}
+	s3_object_info_clear(&info);
+
+	return S3_RESULT_OK(&r) ? 0 : -1;
+}
+
+/*
+ * Size the file up front. Ranges complete out of order, so reserving
+ * the blocks before writing avoids a fragmented file.
+ */
+static int
+s3_ranged_preallocate(int fd, size_t len) {
+	if (ftruncate(fd, len) < 0)
+		return -1;
+#ifdef LINUX
+	/* Not supported everywhere; the file is sized either way */
+	if (len > 0)
+		(void) posix_fallocate(fd, 0, len);
+#endif
+	return 0;
+}
+
+static void s3_range_queue(struct s3_ranged *rd, struct s3_range *r);
+
+static void
+s3_range_done(struct s3_op *op, void *arg) {
+	struct s3_range *r = arg;
+	struct s3_ranged *rd = r->rd;
+	size_t offset = (size_t)r->index * rd->range_size;
+	size_t want = rd->len - offset < rd->range_size ? rd->len - offset : rd->range_size;
+	int whole = offset == 0 && want == rd->len;
+
+	if (op->result.error == 0 && op->out->pos == want &&
+	    (op->result.status == 206 || (whole && op->result.status == 200))) {
+		if (!rd->failed && rd->next < rd->nranges)
+			s3_range_queue(rd, &rd->ranges[rd->next++]);
+		return;
+	}
+
+	/* 412 means the object changed under us; retrying won't help */
+	if (op->result.status != 412 && r->attempts < S3_RANGE_RETRIES && !rd->failed) {
+		s3_range_queue(rd, r);
+		return;
+	}
+
+	rd->failed = 1;
+}
+
+static void
+s3_range_queue(struct s3_ranged *rd, struct s3_range *r) {
+	struct s3_op *op = malloc(sizeof (struct s3_op));
+	size_t offset = (size_t)r->index * rd->range_size;
+	size_t end = offset + rd->range_size < rd->len ? offset + rd->range_size : rd->len;
+	char hdr[128];
+
+	s3_op_init(op, rd->s3, "GET", rd->bucket, rd->key, NULL, NULL);
+
+	snprintf(hdr, sizeof (hdr), "Range: bytes=%zu-%zu", offset, end - 1);
+	op->headers = curl_slist_append(op->headers, hdr);
+	if (rd->etag[0]) {
+		snprintf(hdr, sizeof (hdr), "If-Match: %s", rd->etag);
+		op->headers = curl_slist_append(op->headers, hdr);
+	}
+
+	op->out = s3_sink_init_fd(&op->out_store, rd->fd, offset);
+	op->done = s3_range_done;
+	op->arg = r;
+	r->attempts++;
+
+	s3_batch_add(rd->batch, op);
+}
+
+/*
+ * Check the file against the ETag when it is a plain MD5. Multipart
+ * ETags are a hash of the part hashes and can't be checked without
+ * knowing the part size.
+ */
+static int
+s3_ranged_verify(struct s3_ranged *rd) {
+	const char *etag = rd->etag;
+	char hex[2 * 16 + 1];
+
+	if (*etag == '"')
+		etag++;
+	if (strlen(etag) < 32 || strchr(etag, '-') != NULL)
+		return 0;
+
+	if (s3_md5_hex_fd(rd->fd, 0, rd->len, hex) < 0)
+		return -1;
+
+	return strncasecmp(hex, etag, 32) == 0 ? 0 : -1;
+}
+
+/*
+ * Download key into fd by fetching range_size byte ranges over up to
+ * parallelism connections, each written in place at its offset. Failed
+ * ranges are retried individually. Returns 0 on success, -1 on failure.
+ */
+int
+s3_get_parallel(struct S3 *s3, const char *bucket, const char *key, int fd, size_t range_size, int parallelism) {
+	struct s3_ranged rd;
+	int i;
+
+	if (range_size == 0)
+		range_size = S3_RANGE_SIZE;
+	if (parallelism < 1)
+		parallelism = 1;
+
+	memset(&rd, 0, sizeof (rd));
+	rd.s3 = s3;
+	rd.bucket = bucket;
+	rd.key = key;
+	rd.fd = fd;
+	rd.range_size = range_size;
+
+	if (s3_ranged_stat(&rd) < 0 || s3_ranged_preallocate(fd, rd.len) < 0)
+		return -1;
+
+	rd.nranges = (rd.len + range_size - 1) / range_size;
+	rd.ranges = calloc(rd.nranges ? rd.nranges : 1, sizeof (struct s3_range));
+	for (i = 0; i < rd.nranges; i++) {
+		rd.ranges[i].rd = &rd;
+		rd.ranges[i].index = i;
+	}
+
+	rd.batch = s3_batch_new(s3, parallelism);
+	for (i = 0; i < parallelism && rd.next < rd.nranges; i++)
+		s3_range_queue(&rd, &rd.ranges[rd.next++]);
+	s3_batch_wait(rd.batch);
+	s3_batch_free(rd.batch);
+
+	free(rd.ranges);
+
+	if (rd.failed || s3_ranged_verify(&rd) < 0)
+		return -1;
+
+	return 0;
+}
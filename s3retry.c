@@ -0,0 +1,324 @@
+/*
+ * Copyright (c) 2014, Ian Delahorne <ian.delahorne@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Retries and hedged requests. A failed attempt that is worth repeating
+ * is rewound with s3_op_reset() and sent again after a randomized,
+ * exponentially growing delay, so that clients throttled together don't
+ * come back together. Hedging goes after the slow tail instead: a GET
+ * that hasn't seen its first byte when most GETs would have is sent a
+ * second time, and the slower of the two is dropped.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <curl/curl.h>
+
+#include "s3.h"
+#include "s3internal.h"
+
+#ifdef LINUX
+#include <bsd/stdlib.h>
+#endif
+
+#define S3_HEDGE_SAMPLES	128	/* first-byte times kept */
+#define S3_HEDGE_MIN_SAMPLES	20	/* don't hedge on less history than this */
+#define S3_HEDGE_RECOMPUTE	16	/* new samples between percentile updates */
+
+/* First-byte times of recent GETs, from every thread using the context */
+struct s3_hedger {
+	pthread_mutex_t lock;
+	int samples[S3_HEDGE_SAMPLES];	/* ms to first byte, a ring */
+	int nsamples;
+	int next;
+	int fresh;		/* samples since delay_ms was worked out */
+	int delay_ms;		/* -1 until there is enough history */
+};
+
+uint64_t
+s3_now_ms(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void
+s3_sleep_ms(int ms) {
+	struct timespec ts;
+
+	if (ms <= 0)
+		return;
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (long)(ms % 1000) * 1000000;
+	while (nanosleep(&ts, &ts) < 0)
+		;
+}
+
+/*
+ * Whether a failed request might succeed if sent again: throttling and
+ * server errors, connections that broke or timed out, and bodies that
+ * arrived damaged. Anything the client got wrong will fail the same way.
+ */
+int
+s3_result_retryable(const struct s3_result *r) {
+	static const char *codes[] = {
+		"InternalError", "RequestTimeout", "ServiceUnavailable",
+		"SlowDown", "Throttling", "ThrottlingException", NULL
+	};
+	int i;
+
+	switch (r->error) {
+	case 0:
+		break;
+	case S3_ERROR_CHECKSUM:
+	case CURLE_COULDNT_RESOLVE_HOST:
+	case CURLE_COULDNT_CONNECT:
+	case CURLE_PARTIAL_FILE:
+	case CURLE_OPERATION_TIMEDOUT:
+	case CURLE_SSL_CONNECT_ERROR:
+	case CURLE_GOT_NOTHING:
+	case CURLE_SEND_ERROR:
+	case CURLE_RECV_ERROR:
+	case CURLE_HTTP2:
+	case CURLE_HTTP2_STREAM:
+		return 1;
+	default:
+		return 0;
+	}
+
+	if (r->status == 429 || r->status >= 500)
+		return 1;
+	for (i = 0; codes[i] != NULL; i++)
+		if (strcmp(r->code, codes[i]) == 0)
+			return 1;
+	return 0;
+}
+
+/*
+ * After an attempt has finished: if the op should go again, rewind it
+ * and return how many ms to wait first, else -1. The wait is drawn
+ * uniformly from zero up to the exponential backoff ("full jitter").
+ */
+int
+s3_op_retry(struct s3_op *op) {
+	const struct s3_retry_policy *p = &op->s3->retry;
+	uint64_t cap;
+
+	if (S3_RESULT_OK(&op->result) || op->result.attempts >= p->max_attempts ||
+	    !s3_result_retryable(&op->result) || s3_op_reset(op) < 0)
+		return -1;
+
+	cap = (uint64_t)p->base_delay_ms << (op->result.attempts - 1 < 20 ? op->result.attempts - 1 : 20);
+	if (cap > (uint64_t)p->max_delay_ms)
+		cap = p->max_delay_ms;
+
+	return cap > 0 ? (int)arc4random_uniform((uint32_t)cap + 1) : 0;
+}
+
+struct s3_hedger *
+s3_hedger_new(void) {
+	struct s3_hedger *hg = calloc(1, sizeof (struct s3_hedger));
+
+	pthread_mutex_init(&hg->lock, NULL);
+	hg->delay_ms = -1;
+
+	return hg;
+}
+
+void
+s3_hedger_free(struct s3_hedger *hg) {
+	pthread_mutex_destroy(&hg->lock);
+	free(hg);
+}
+
+static int
+s3_int_cmp(const void *a, const void *b) {
+	return *(const int *)a - *(const int *)b;
+}
+
+static void
+s3_hedge_record(struct S3 *s3, int ms) {
+	struct s3_hedger *hg = s3->hedger;
+	int sorted[S3_HEDGE_SAMPLES];
+
+	pthread_mutex_lock(&hg->lock);
+	hg->samples[hg->next] = ms;
+	hg->next = (hg->next + 1) % S3_HEDGE_SAMPLES;
+	if (hg->nsamples < S3_HEDGE_SAMPLES)
+		hg->nsamples++;
+
+	if (hg->nsamples >= S3_HEDGE_MIN_SAMPLES && ++hg->fresh >= S3_HEDGE_RECOMPUTE) {
+		hg->fresh = 0;
+		memcpy(sorted, hg->samples, hg->nsamples * sizeof (int));
+		qsort(sorted, hg->nsamples, sizeof (int), s3_int_cmp);
+		hg->delay_ms = sorted[(hg->nsamples - 1) * s3->hedge.percentile / 100];
+	}
+	pthread_mutex_unlock(&hg->lock);
+}
+
+/* How long a GET may go without a first byte before it is hedged, or -1 */
+int
+s3_hedge_delay(struct S3 *s3) {
+	struct s3_hedger *hg = s3->hedger;
+	int delay;
+
+	pthread_mutex_lock(&hg->lock);
+	delay = hg->delay_ms;
+	pthread_mutex_unlock(&hg->lock);
+
+	if (delay < 0)
+		return -1;
+	return delay > s3->hedge.min_delay_ms ? delay : s3->hedge.min_delay_ms;
+}
+
+/*
+ * The duplicate shares everything with op but its handle and response:
+ * the strings in op's scratch, the caller's headers and the sink. It
+ * must not outlive op and must not free any of them.
+ */
+static void
+s3_op_twin(struct s3_op *twin, struct s3_op *op) {
+	memcpy(twin, op, offsetof(struct s3_op, in_store));
+	s3_arena_init(&twin->arena, twin->scratch, sizeof (twin->scratch));
+	memset(&twin->result, 0, sizeof (twin->result));
+	twin->result.attempts = op->result.attempts;
+	twin->content_length = 0;
+	twin->etag[0] = '\0';
+	twin->error_len = 0;
+	twin->error_body[0] = '\0';
+	twin->claimed = 0;
+	twin->twin = op;
+	op->twin = twin;
+}
+
+/*
+ * Send a GET, and if delay_ms passes without a first byte, a duplicate
+ * of it. The first to answer completes op; the other is abandoned. A
+ * negative delay_ms never hedges, which still gathers timings.
+ */
+void
+s3_perform_hedged(struct s3_op *op, int delay_ms) {
+	struct s3_thread *t = s3_thread_get(op->s3);
+	struct s3_op twin, *o, *winner = NULL, *loser;
+	int done[2] = { 0, 0 }, code[2] = { 0, 0 };
+	int hedged = 0, still, left, wait;
+	uint64_t start = s3_now_ms(), elapsed;
+	long status;
+	double ttfb;
+	CURLMsg *msg;
+	CURLM *multi;
+
+	/* Hedged GETs share the connections of the thread's multi handle */
+	if (t->hedge_multi == NULL)
+		t->hedge_multi = curl_multi_init();
+	multi = t->hedge_multi;
+
+	s3_op_setup(op);
+	curl_multi_add_handle(multi, op->handle->curl);
+
+	for (;;) {
+		curl_multi_perform(multi, &still);
+		while ((msg = curl_multi_info_read(multi, &left)) != NULL) {
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&o);
+			curl_multi_remove_handle(multi, msg->easy_handle);
+			done[o != op] = 1;
+			code[o != op] = msg->data.result;
+		}
+
+		/*
+		 * Once one of them has written to the sink it is the only
+		 * possible outcome. Before that, the first complete response
+		 * wins, and a failure only counts when both have failed.
+		 */
+		if (!hedged || op->claimed)
+			winner = done[0] ? op : NULL;
+		else if (twin.claimed)
+			winner = done[1] ? &twin : NULL;
+		else if (done[0] && code[0] == CURLE_OK)
+			winner = op;
+		else if (done[1] && code[1] == CURLE_OK)
+			winner = &twin;
+		else if (done[0] && done[1])
+			winner = op;
+		if (winner)
+			break;
+
+		elapsed = s3_now_ms() - start;
+		wait = 1000;
+		if (!hedged && delay_ms >= 0 && !op->claimed) {
+			if (elapsed >= (uint64_t)delay_ms) {
+				s3_op_twin(&twin, op);
+				s3_op_setup(&twin);
+				twin.headers = NULL;	/* op's, already in the request */
+				curl_multi_add_handle(multi, twin.handle->curl);
+				hedged = 1;
+				continue;
+			}
+			wait = delay_ms - elapsed;
+		}
+		curl_multi_wait(multi, NULL, 0, wait, NULL);
+	}
+
+	/*
+	 * Only complete responses are timed: failed or abandoned transfers
+	 * can report a partial first byte time that would skew the delay.
+	 * The result isn't filled in until s3_op_finish, which also gives
+	 * up the handle, so ask curl.
+	 */
+	if (code[winner != op] == CURLE_OK &&
+	    curl_easy_getinfo(winner->handle->curl, CURLINFO_RESPONSE_CODE, &status) == CURLE_OK &&
+	    status >= 200 && status < 300 &&
+	    curl_easy_getinfo(winner->handle->curl, CURLINFO_STARTTRANSFER_TIME, &ttfb) == CURLE_OK && ttfb > 0)
+		s3_hedge_record(op->s3, (int)(ttfb * 1000));
+
+	if (hedged) {
+		loser = winner == op ? &twin : op;
+		if (!done[loser != op])
+			curl_multi_remove_handle(multi, loser->handle->curl);
+		s3_op_finish(loser, done[loser != op] ? code[loser != op] : CURLE_ABORTED_BY_CALLBACK);
+	}
+	s3_op_finish(winner, code[winner != op]);
+
+	if (hedged) {
+		if (winner == &twin) {
+			op->result = twin.result;
+			op->content_length = twin.content_length;
+			memcpy(op->etag, twin.etag, sizeof (op->etag));
+			memcpy(op->error_body, twin.error_body, sizeof (op->error_body));
+			op->error_len = twin.error_len;
+			op->claimed = 1;
+		}
+		/* Both attempts count, as both went out */
+		op->result.attempts++;
+		op->twin = NULL;
+		twin.out = NULL;
+		s3_op_free(&twin);
+	}
+}
@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) 2014, Ian Delahorne <ian.delahorne@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Parallel enumeration of large buckets. The key space is cut into
+ * ranges at the common prefixes on the first page of a delimited
+ * listing, and cut again with start-after when there are fewer ranges
+ * than connections or the page didn't reach the end. Each range is
+ * listed by its own iterator on a shared batch. Since the ranges are
+ * disjoint and ordered, merging them into one sorted stream only means
+ * draining them in turn; at most parallelism ranges are open at once,
+ * each holding a few pages, so memory stays bounded however large the
+ * bucket.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "s3.h"
+#include "s3internal.h"
+
+#ifdef LINUX
+#include <bsd/string.h>
+#endif
+#include <string.h>
+
+/* Characters to split ranges at, in byte order */
+static const char s3_shard_alphabet[] =
+    "-0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ_abcdefghijklmnopqrstuvwxyz";
+
+struct s3_list_parallel {
+	struct S3 *s3;
+	struct s3_batch *batch;
+	char *bucket;
+	struct s3_list_options opts;
+	char *prefix;
+	char *start_after;
+	char **bounds;		/* range i is (bounds[i - 1], bounds[i]] */
+	int nbounds;
+	int cap;
+	char *first;		/* lowest and highest names on the first page */
+	char *last;
+	int window;
+	int current;		/* range being drained */
+	int next;		/* next range to open */
+	int error;
+	struct s3_list_iter **shards;
+};
+
+static int
+s3_shard_cmp(const void *a, const void *b) {
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static void
+s3_shard_bound(struct s3_list_parallel *lp, char *bound) {
+	if (lp->start_after && strcmp(bound, lp->start_after) <= 0) {
+		free(bound);
+		return;
+	}
+	if (lp->nbounds == lp->cap) {
+		lp->cap = lp->cap ? lp->cap * 2 : 16;
+		lp->bounds = realloc(lp->bounds, lp->cap * sizeof (char *));
+	}
+	lp->bounds[lp->nbounds++] = bound;
+}
+
+static void
+s3_shard_seen(struct s3_list_parallel *lp, const char *name) {
+	if (lp->first == NULL || strcmp(name, lp->first) < 0) {
+		free(lp->first);
+		lp->first = strdup(name);
+	}
+	if (lp->last == NULL || strcmp(name, lp->last) > 0) {
+		free(lp->last);
+		lp->last = strdup(name);
+	}
+}
+
+static void
+s3_shard_key(void *arg, const struct s3_list_item *item) {
+	s3_shard_seen(arg, item->key);
+}
+
+static void
+s3_shard_prefix(void *arg, const char *prefix) {
+	s3_shard_seen(arg, prefix);
+	s3_shard_bound(arg, strdup(prefix));
+}
+
+/*
+ * Collect the common prefixes on the first page under prefix as range
+ * boundaries. Returns -1 if it failed, 1 if there is more after it.
+ */
+static int
+s3_shard_discover(struct s3_list_parallel *lp, const char *delimiter) {
+	struct s3_list_options opts;
+
+	memset(&opts, 0, sizeof (opts));
+	opts.prefix = lp->prefix;
+	opts.delimiter = delimiter;
+	opts.start_after = lp->start_after;
+	opts.max_keys = lp->opts.max_keys;
+	opts.v2 = lp->opts.v2;
+
+	return s3_list_page(lp->s3, lp->bucket, &opts, s3_shard_key, s3_shard_prefix, lp);
+}
+
+/*
+ * Split every range into about ways pieces at lower + c, for c spread
+ * over the alphabet, keeping only the points that fall inside it.
+ */
+static void
+s3_shard_split(struct s3_list_parallel *lp, int ways) {
+	int nranges = lp->nbounds + 1;
+	int alen = sizeof (s3_shard_alphabet) - 1;
+	const char *lower, *upper;
+	char *bound;
+	int i, j;
+
+	if (ways > alen)
+		ways = alen;
+
+	for (i = 0; i < nranges; i++) {
+		lower = i > 0 ? lp->bounds[i - 1] : (lp->prefix ? lp->prefix : "");
+		upper = i < nranges - 1 ? lp->bounds[i] : NULL;
+
+		for (j = 1; j < ways; j++) {
+			asprintf(&bound, "%s%c", lower, s3_shard_alphabet[j * alen / ways]);
+			if (strcmp(bound, lower) <= 0 || (upper && strcmp(bound, upper) >= 0)) {
+				free(bound);
+				continue;
+			}
+			s3_shard_bound(lp, bound);
+		}
+	}
+
+	qsort(lp->bounds, lp->nbounds, sizeof (char *), s3_shard_cmp);
+}
+
+/*
+ * Add up to ways - 1 bounds after key, each the first level characters
+ * of key and then one that sorts after key[level]: the next ones in
+ * turn, or if spread, ones spread over the rest of the alphabet.
+ */
+static void
+s3_shard_points(struct s3_list_parallel *lp, const char *key, size_t level, int ways, int spread) {
+	int alen = sizeof (s3_shard_alphabet) - 1;
+	unsigned char c = key[level];
+	char *bound;
+	int i, j, n;
+
+	for (i = 0; i < alen && (unsigned char)s3_shard_alphabet[i] <= c; i++)
+		;
+	if ((n = ways - 1) > alen - i)
+		n = alen - i;
+
+	for (j = 0; j < n; j++) {
+		asprintf(&bound, "%.*s%c", (int)level, key,
+		    s3_shard_alphabet[i + (spread ? j * (alen - i) / n : j)]);
+		s3_shard_bound(lp, bound);
+	}
+}
+
+/*
+ * The first page ended at lp->last and says nothing about what comes
+ * after it, so guess. Where the page only varied in later characters
+ * (bench/00000000 to bench/00000999, say) the names probably count
+ * up, and the next values of the character before those make ranges
+ * about a page apart. Bounds spread over the first character after the
+ * prefix catch names that don't.
+ */
+static void
+s3_shard_split_tail(struct s3_list_parallel *lp, int ways) {
+	size_t base = lp->prefix ? strlen(lp->prefix) : 0;
+	size_t d;
+
+	for (d = 0; lp->first[d] != '\0' && lp->first[d] == lp->last[d]; d++)
+		;
+	if (d > base + 1)
+		s3_shard_points(lp, lp->last, d - 1, ways, 0);
+	if (strlen(lp->last) > base)
+		s3_shard_points(lp, lp->last, base, ways, 1);
+
+	qsort(lp->bounds, lp->nbounds, sizeof (char *), s3_shard_cmp);
+}
+
+/* Open ranges until window of them are being listed */
+static void
+s3_shard_open(struct s3_list_parallel *lp) {
+	struct s3_list_options opts;
+	int i;
+
+	while (lp->next <= lp->nbounds && lp->next < lp->current + lp->window) {
+		i = lp->next++;
+
+		opts = lp->opts;
+		opts.delimiter = NULL;
+		opts.prefix = lp->prefix;
+		if (opts.prefetch < 1)
+			opts.prefetch = S3_LIST_PARALLEL_PREFETCH;
+		opts.start_after = i > 0 ? lp->bounds[i - 1] : lp->start_after;
+
+		lp->shards[i] = s3_list_iter_range(lp->s3, lp->bucket, &opts,
+		    i < lp->nbounds ? lp->bounds[i] : NULL, lp->batch);
+	}
+}
+
+/*
+ * Enumerate every key under opts->prefix in order, listing up to
+ * parallelism ranges of the key space at a time. Ranges are found from
+ * the common prefixes at opts->delimiter ("/" if NULL); max_keys, v2
+ * and start_after apply as for s3_list_iter_new, and each range holds
+ * up to opts->prefetch pages (S3_LIST_PARALLEL_PREFETCH if 0). Returns
+ * NULL if the ranges can't be discovered.
+ */
+struct s3_list_parallel *
+s3_list_parallel_new(struct S3 *s3, const char *bucket, const struct s3_list_options *opts, int parallelism) {
+	struct s3_list_parallel *lp = calloc(1, sizeof (struct s3_list_parallel));
+	int more;
+
+	if (parallelism < 1)
+		parallelism = 1;
+
+	lp->s3 = s3;
+	lp->bucket = strdup(bucket);
+	if (opts) {
+		lp->opts = *opts;
+		lp->prefix = opts->prefix ? strdup(opts->prefix) : NULL;
+		lp->start_after = opts->start_after ? strdup(opts->start_after) : NULL;
+	}
+	lp->window = parallelism;
+
+	if ((more = s3_shard_discover(lp, opts && opts->delimiter ? opts->delimiter : "/")) < 0) {
+		s3_list_parallel_free(lp);
+		return NULL;
+	}
+	if (more && lp->last)
+		s3_shard_split_tail(lp, parallelism);
+	else if (lp->nbounds + 1 < parallelism)
+		s3_shard_split(lp, (parallelism + lp->nbounds) / (lp->nbounds + 1));
+
+	lp->shards = calloc(lp->nbounds + 1, sizeof (struct s3_list_iter *));
+	lp->batch = s3_batch_new(s3, parallelism);
+	s3_shard_open(lp);
+
+	return lp;
+}
+
+/*
+ * Next key in sorted order, or NULL at the end or on failure. The entry
+ * belongs to the caller and is freed with s3_bucket_entry_free.
+ */
+struct s3_bucket_entry *
+s3_list_parallel_next(struct s3_list_parallel *lp) {
+	struct s3_list_iter *it;
+	struct s3_bucket_entry *e;
+
+	while (!lp->error && lp->current <= lp->nbounds) {
+		it = lp->shards[lp->current];
+		if ((e = s3_list_iter_next(it)) != NULL)
+			return e;
+
+		if (s3_list_iter_error(it))
+			lp->error = 1;
+		s3_list_iter_free(it);
+		lp->shards[lp->current++] = NULL;
+		s3_shard_open(lp);
+	}
+
+	return NULL;
+}
+
+/* Non-zero if the enumeration ended early because a listing failed */
+int
+s3_list_parallel_error(struct s3_list_parallel *lp) {
+	return lp->error;
+}
+
+void
+s3_list_parallel_free(struct s3_list_parallel *lp) {
+	int i;
+
+	/* The iterators' in-flight pages complete against them here */
+	if (lp->batch)
+		s3_batch_free(lp->batch);
+
+	if (lp->shards) {
+		for (i = 0; i <= lp->nbounds; i++)
+			if (lp->shards[i])
+				s3_list_iter_free(lp->shards[i]);
+		free(lp->shards);
+	}
+
+	for (i = 0; i < lp->nbounds; i++)
+		free(lp->bounds[i]);
+	free(lp->bounds);
+	free(lp->first);
+	free(lp->last);
+	free(lp->bucket);
+	free(lp->prefix);
+	free(lp->start_after);
+	free(lp);
+}
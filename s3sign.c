@@ -0,0 +1,748 @@
+/*
+ * Copyright (c) 2014, Ian Delahorne <ian.delahorne@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Request signing. Each S3 context owns a signer holding HMAC states
+ * already keyed with the secret (SigV2) or with the derived signing key
+ * (SigV4), so a request costs a copy of that state and one pass over
+ * the string to sign. The SigV4 key depends on the date, region and
+ * service, and is derived again only when one of them changes.
+ */
+
+/*
+ * Keyed HMAC states are copied by assignment, which needs SHA_CTX and
+ * SHA256_CTX and the low-level SHA1_* and SHA256_* calls. OpenSSL 3.0
+ * deprecates those for EVP_MD_CTX, which is opaque, allocated and
+ * costs a fetch to duplicate. They are still provided, so ask for the
+ * 1.1.0 API, in which they are current and build without warnings. An
+ * OpenSSL configured with no-deprecated would need an EVP port.
+ */
+#define OPENSSL_API_COMPAT 0x10100000L
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <time.h>
+
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
+#include "s3.h"
+#include "s3internal.h"
+
+#ifdef LINUX
+#include <bsd/string.h>
+#endif
+#include <string.h>
+
+#define S3_SHA256_EMPTY "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"
+#define S3_SIGV4_SERVICE "s3"
+#define S3_HMAC_BLOCK 64	/* SHA-1 and SHA-256 alike */
+
+/*
+ * An HMAC key schedule: the hash states after absorbing the inner and
+ * outer padded keys. Copies are made by assignment, so a MAC over a
+ * keyed state costs no allocation and no rehashing of the key.
+ */
+typedef struct s3_mac {
+	int sha256;
+	union {
+		SHA_CTX sha1;
+		SHA256_CTX sha256;
+	} inner, outer;
+} s3_mac;
+
+/*
+ * Shared by every thread using the context. The SigV2 state never
+ * changes once keyed; the SigV4 key changes daily, so it is only read
+ * and rekeyed under lock.
+ */
+struct s3_signer {
+	s3_mac v2;		/* keyed with the secret */
+	pthread_mutex_t lock;	/* guards v4 and v4_scope */
+	s3_mac v4;		/* keyed with the signing key for v4_scope */
+	char *v4_secret;	/* "AWS4" + secret */
+	char v4_scope[128];	/* date/region/service/aws4_request, empty until derived */
+};
+
+static void
+s3_mac_init(s3_mac *m, int sha256, const void *key, size_t keylen) {
+	unsigned char k[S3_HMAC_BLOCK], pad[S3_HMAC_BLOCK];
+	int i;
+
+	memset(k, 0, sizeof (k));
+	if (keylen > S3_HMAC_BLOCK) {
+		if (sha256)
+			SHA256(key, keylen, k);
+		else
+			SHA1(key, keylen, k);
+	} else
+		memcpy(k, key, keylen);
+
+	m->sha256 = sha256;
+	for (i = 0; i < S3_HMAC_BLOCK; i++)
+		pad[i] = k[i] ^ 0x36;
+	if (sha256) {
+		SHA256_Init(&m->inner.sha256);
+		SHA256_Update(&m->inner.sha256, pad, sizeof (pad));
+	} else {
+		SHA1_Init(&m->inner.sha1);
+		SHA1_Update(&m->inner.sha1, pad, sizeof (pad));
+	}
+	for (i = 0; i < S3_HMAC_BLOCK; i++)
+		pad[i] = k[i] ^ 0x5c;
+	if (sha256) {
+		SHA256_Init(&m->outer.sha256);
+		SHA256_Update(&m->outer.sha256, pad, sizeof (pad));
+	} else {
+		SHA1_Init(&m->outer.sha1);
+		SHA1_Update(&m->outer.sha1, pad, sizeof (pad));
+	}
+}
+
+/* MAC data with the keyed state m; returns the digest length */
+static unsigned int
+s3_mac_run(const s3_mac *m, const void *data, size_t len, unsigned char *out) {
+	s3_mac c = *m;
+
+	if (c.sha256) {
+		SHA256_Update(&c.inner.sha256, data, len);
+		SHA256_Final(out, &c.inner.sha256);
+		SHA256_Update(&c.outer.sha256, out, SHA256_DIGEST_LENGTH);
+		SHA256_Final(out, &c.outer.sha256);
+		return SHA256_DIGEST_LENGTH;
+	}
+	SHA1_Update(&c.inner.sha1, data, len);
+	SHA1_Final(out, &c.inner.sha1);
+	SHA1_Update(&c.outer.sha1, out, SHA_DIGEST_LENGTH);
+	SHA1_Final(out, &c.outer.sha1);
+	return SHA_DIGEST_LENGTH;
+}
+
+/*
+ * SHA256() in OpenSSL 3 looks the digest up and allocates a context on
+ * every call; the low level interface works on the stack.
+ */
+static void
+s3_sha256(const void *data, size_t len, unsigned char *out) {
+	SHA256_CTX c;
+
+	SHA256_Init(&c);
+	SHA256_Update(&c, data, len);
+	SHA256_Final(out, &c);
+}
+
+static void
+s3_hex(const unsigned char *digest, unsigned int len, char *out) {
+	static const char hex[] = "0123456789abcdef";
+	unsigned int i;
+
+	for (i = 0; i < len; i++) {
+		out[2 * i] = hex[digest[i] >> 4];
+		out[2 * i + 1] = hex[digest[i] & 0xf];
+	}
+	out[2 * len] = '\0';
+}
+
+struct s3_signer *
+s3_signer_new(const char *secret) {
+	struct s3_signer *sg = calloc(1, sizeof (struct s3_signer));
+
+	s3_mac_init(&sg->v2, 0, secret, strlen(secret));
+	pthread_mutex_init(&sg->lock, NULL);
+	asprintf(&sg->v4_secret, "AWS4%s", secret);
+
+	return sg;
+}
+
+void
+s3_signer_free(struct s3_signer *sg) {
+	pthread_mutex_destroy(&sg->lock);
+	free(sg->v4_secret);
+	free(sg);
+}
+
+/* Base64 HMAC-SHA1 of str, the SigV2 signature. out holds 29 bytes. */
+void
+s3_signer_v2(struct s3_signer *sg, const char *str, size_t len, char *out) {
+	unsigned char digest[SHA_DIGEST_LENGTH];
+	unsigned int n;
+
+	n = s3_mac_run(&sg->v2, str, len, digest);
+	EVP_EncodeBlock((unsigned char *)out, digest, n);
+}
+
+/*
+ * The SigV4 state keyed for scope, into key. The signing key is derived
+ * from the secret through the date, region and service when the scope
+ * changes, and otherwise copied from the last derivation.
+ */
+static void
+s3_signer_v4_key(struct s3_signer *sg, const char *date, const char *region, const char *scope, s3_mac *key) {
+	unsigned char k[SHA256_DIGEST_LENGTH];
+	unsigned int n;
+	s3_mac m;
+
+	pthread_mutex_lock(&sg->lock);
+	if (strcmp(sg->v4_scope, scope) == 0) {
+		*key = sg->v4;
+		pthread_mutex_unlock(&sg->lock);
+		return;
+	}
+
+	s3_mac_init(&m, 1, sg->v4_secret, strlen(sg->v4_secret));
+	n = s3_mac_run(&m, date, strlen(date), k);
+	s3_mac_init(&m, 1, k, n);
+	n = s3_mac_run(&m, region, strlen(region), k);
+	s3_mac_init(&m, 1, k, n);
+	n = s3_mac_run(&m, S3_SIGV4_SERVICE, strlen(S3_SIGV4_SERVICE), k);
+	s3_mac_init(&m, 1, k, n);
+	n = s3_mac_run(&m, "aws4_request", 12, k);
+
+	s3_mac_init(&sg->v4, 1, k, n);
+	strlcpy(sg->v4_scope, scope, sizeof (sg->v4_scope));
+	*key = sg->v4;
+	pthread_mutex_unlock(&sg->lock);
+}
+
+static int
+s3_query_cmp(const void *a, const void *b) {
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * The canonical query string: parameters sorted, each with an "=" even
+ * when it has no value. Values in the URL are already encoded.
+ */
+static char *
+s3_canonical_query(struct s3_arena *a, const char *query) {
+	char *copy, *p, *out, **params;
+	size_t n = 1, i, len = 0;
+
+	if (query == NULL || *query == '\0')
+		return "";
+
+	for (p = (char *)query; *p; p++)
+		if (*p == '&')
+			n++;
+
+	copy = s3_arena_strdup(a, query);
+	params = s3_arena_alloc(a, n * sizeof (char *));
+	for (i = 0, p = copy; p != NULL && i < n; i++)
+		params[i] = strsep(&p, "&");
+	qsort(params, n, sizeof (char *), s3_query_cmp);
+
+	out = s3_arena_alloc(a, strlen(query) + n + 1);
+	for (i = 0; i < n; i++) {
+		len += sprintf(out + len, "%s%s%s", i ? "&" : "", params[i],
+		    strchr(params[i], '=') ? "" : "=");
+	}
+
+	return out;
+}
+
+#define S3_V4_MAX_HEADERS 32
+
+struct s3_v4_header {
+	char name[64];		/* lower case */
+	const char *value;
+	int value_len;
+};
+
+static void
+s3_v4_header(struct s3_v4_header *h, int *n, const char *name, int name_len, const char *value, int value_len) {
+	int i;
+
+	if (*n == S3_V4_MAX_HEADERS || name_len >= (int)sizeof (h->name))
+		return;
+	for (i = 0; i < name_len; i++)
+		h[*n].name[i] = tolower((unsigned char)name[i]);
+	h[*n].name[name_len] = '\0';
+	h[*n].value = value;
+	h[*n].value_len = value_len;
+	(*n)++;
+}
+
+static int
+s3_v4_header_cmp(const void *a, const void *b) {
+	return strcmp(((const struct s3_v4_header *)a)->name, ((const struct s3_v4_header *)b)->name);
+}
+
+/*
+ * The x-amz-* headers going out with the request, lower cased and
+ * sorted, as both signature versions canonicalize them.
+ */
+static int
+s3_amz_headers(struct s3_op *op, struct s3_v4_header *h, int n) {
+	struct curl_slist *l;
+	const char *colon, *v;
+
+	for (l = op->request_headers; l; l = l->next) {
+		if (strncasecmp(l->data, "x-amz-", 6) != 0 || (colon = strchr(l->data, ':')) == NULL)
+			continue;
+		for (v = colon + 1; *v == ' '; v++)
+			;
+		s3_v4_header(h, &n, l->data, colon - l->data, v, strlen(v));
+	}
+
+	qsort(h, n, sizeof (struct s3_v4_header), s3_v4_header_cmp);
+
+	return n;
+}
+
+/* A string assembled in space reserved for it up front */
+struct s3_buf {
+	char *p;
+	size_t len;
+};
+
+static void
+s3_append(struct s3_buf *b, const char *str, size_t len) {
+	memcpy(b->p + b->len, str, len);
+	b->len += len;
+	b->p[b->len] = '\0';
+}
+
+static void
+s3_op_sign_v2(struct s3_op *op) {
+	struct S3 *s3 = op->s3;
+	struct s3_arena *a = &op->handle->scratch;
+	struct s3_v4_header h[S3_V4_MAX_HEADERS];
+	struct s3_buf amz;
+	char sig[64];
+	size_t size = 0;
+	int i, n;
+
+	/* CanonicalizedAmzHeaders go between the date and the resource */
+	n = s3_amz_headers(op, h, 0);
+	for (i = 0; i < n; i++)
+		size += strlen(h[i].name) + h[i].value_len + 2;
+	amz.p = s3_arena_alloc(a, size + 1);
+	amz.len = 0;
+	amz.p[0] = '\0';
+	for (i = 0; i < n; i++) {
+		s3_append(&amz, h[i].name, strlen(h[i].name));
+		s3_append(&amz, ":", 1);
+		s3_append(&amz, h[i].value, h[i].value_len);
+		s3_append(&amz, "\n", 1);
+	}
+
+	s3_clock_update(&op->handle->clock);
+	op->date = op->handle->clock.http;
+	op->sign_data = s3_arena_printf(a, "%s\n%s\n%s\n%s\n%s%s", op->method,
+	    op->content_md5, op->content_type ? op->content_type : "",
+	    op->date, amz.p, op->resource);
+
+	s3_signer_v2(s3->signer, op->sign_data, strlen(op->sign_data), sig);
+#ifdef DEBUG
+	fprintf(stderr, "DEBUG: data to sign:%s\n", op->sign_data);
+	fprintf(stderr, "DEBUG: Authentication: AWS %s:%s\n", s3->id, sig);
+#endif
+
+	s3_op_header(op, "Date: %s", op->date);
+	s3_op_header(op, "Authorization: AWS %s:%s", s3->id, sig);
+}
+
+/*
+ * Collect the headers to sign: host, x-amz-date and x-amz-content-sha256
+ * always, Content-MD5 and Content-Type when sent, the aws-chunked
+ * headers when streaming, and any x-amz-* header the caller added.
+ */
+static int
+s3_v4_headers(struct s3_op *op, struct s3_v4_header *h, const char *host, int host_len,
+    const char *amzdate, const char *payload, const char *content_length, const char *decoded_length) {
+	int n = 0;
+
+	s3_v4_header(h, &n, "host", 4, host, host_len);
+	s3_v4_header(h, &n, "x-amz-date", 10, amzdate, strlen(amzdate));
+	s3_v4_header(h, &n, "x-amz-content-sha256", 20, payload, strlen(payload));
+	if (op->content_md5[0])
+		s3_v4_header(h, &n, "content-md5", 11, op->content_md5, strlen(op->content_md5));
+	if (op->content_type)
+		s3_v4_header(h, &n, "content-type", 12, op->content_type, strlen(op->content_type));
+	if (op->chunked) {
+		s3_v4_header(h, &n, "content-encoding", 16, "aws-chunked", 11);
+		s3_v4_header(h, &n, "content-length", 14, content_length, strlen(content_length));
+		s3_v4_header(h, &n, "x-amz-decoded-content-length", 28, decoded_length, strlen(decoded_length));
+	}
+
+	return s3_amz_headers(op, h, n);
+}
+
+static struct s3_chunker * s3_chunker_start(struct s3_handle *h, const s3_mac *key, struct s3_source *src,
+    const char *amzdate, const char *scope, const char *seed, enum s3_checksum_type trailer);
+
+/*
+ * AWS Signature Version 4. Bodies are not hashed up front: they go as
+ * UNSIGNED-PAYLOAD, covered by Content-MD5 where one was computed, or
+ * aws-chunked with every chunk signed as it is sent. A checksum is sent
+ * as a trailer after the last chunk.
+ */
+static void
+s3_op_sign_v4(struct s3_op *op) {
+	struct S3 *s3 = op->s3;
+	struct s3_arena *a = &op->handle->scratch;
+	struct s3_clock *clk = &op->handle->clock;
+	struct s3_v4_header h[S3_V4_MAX_HEADERS];
+	struct s3_buf canonical, signed_headers;
+	const char *host, *path, *query, *payload, *canonical_query;
+	char scope[128], content_length[32], decoded_length[32];
+	char digest_hex[2 * SHA256_DIGEST_LENGTH + 1], sig[2 * SHA256_DIGEST_LENGTH + 1];
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+	size_t names = 0, values = 0;
+	unsigned int dlen;
+	int path_len, i, n;
+	s3_mac key;
+
+	s3_clock_update(clk);
+	snprintf(scope, sizeof (scope), "%s/%s/%s/aws4_request", clk->day, s3->region, S3_SIGV4_SERVICE);
+
+	if (op->chunked) {
+		if (op->chunked == S3_CHUNKED_UNSIGNED)
+			payload = "STREAMING-UNSIGNED-PAYLOAD-TRAILER";
+		else if (op->checksum_type != S3_CHECKSUM_NONE)
+			payload = "STREAMING-AWS4-HMAC-SHA256-PAYLOAD-TRAILER";
+		else
+			payload = "STREAMING-AWS4-HMAC-SHA256-PAYLOAD";
+		if (op->checksum_type != S3_CHECKSUM_NONE)
+			s3_op_header(op, "x-amz-trailer: x-amz-checksum-%s", s3_checksum_name(op->checksum_type));
+		snprintf(content_length, sizeof (content_length), "%zu",
+		    s3_chunked_length(op->in->len, op->chunked == S3_CHUNKED_SIGNED, op->checksum_type));
+		snprintf(decoded_length, sizeof (decoded_length), "%zu", op->in->len);
+	} else
+		payload = op->in ? "UNSIGNED-PAYLOAD" : S3_SHA256_EMPTY;
+
+	/* url is "http://host/path?query" */
+	host = op->url + strlen("http://");
+	path = strchr(host, '/');
+	query = strchr(path, '?');
+	path_len = query ? (int)(query - path) : (int)strlen(path);
+
+	n = s3_v4_headers(op, h, host, path - host, clk->amz, payload, content_length, decoded_length);
+	canonical_query = s3_canonical_query(a, query ? query + 1 : NULL);
+
+	for (i = 0; i < n; i++) {
+		names += strlen(h[i].name) + 1;
+		values += h[i].value_len + 2;
+	}
+	signed_headers.p = s3_arena_alloc(a, names + 1);
+	signed_headers.len = 0;
+	canonical.p = s3_arena_alloc(a, strlen(op->method) + path_len + strlen(canonical_query) +
+	    names + values + names + strlen(payload) + 8);
+	canonical.len = 0;
+
+	s3_append(&canonical, op->method, strlen(op->method));
+	s3_append(&canonical, "\n", 1);
+	s3_append(&canonical, path, path_len);
+	s3_append(&canonical, "\n", 1);
+	s3_append(&canonical, canonical_query, strlen(canonical_query));
+	s3_append(&canonical, "\n", 1);
+	for (i = 0; i < n; i++) {
+		s3_append(&canonical, h[i].name, strlen(h[i].name));
+		s3_append(&canonical, ":", 1);
+		s3_append(&canonical, h[i].value, h[i].value_len);
+		s3_append(&canonical, "\n", 1);
+
+		if (i > 0)
+			s3_append(&signed_headers, ";", 1);
+		s3_append(&signed_headers, h[i].name, strlen(h[i].name));
+	}
+	s3_append(&canonical, "\n", 1);
+	s3_append(&canonical, signed_headers.p, signed_headers.len);
+	s3_append(&canonical, "\n", 1);
+	s3_append(&canonical, payload, strlen(payload));
+
+	s3_sha256(canonical.p, canonical.len, digest);
+	s3_hex(digest, SHA256_DIGEST_LENGTH, digest_hex);
+
+	op->sign_data = s3_arena_printf(a, "AWS4-HMAC-SHA256\n%s\n%s\n%s", clk->amz, scope, digest_hex);
+
+	s3_signer_v4_key(s3->signer, clk->day, s3->region, scope, &key);
+	dlen = s3_mac_run(&key, op->sign_data, strlen(op->sign_data), digest);
+	s3_hex(digest, dlen, sig);
+#ifdef DEBUG
+	fprintf(stderr, "DEBUG: canonical request:\n%s\n", canonical.p);
+	fprintf(stderr, "DEBUG: data to sign:%s\n", op->sign_data);
+#endif
+
+	op->date = clk->amz;
+
+	s3_op_header(op, "x-amz-date: %s", clk->amz);
+	s3_op_header(op, "x-amz-content-sha256: %s", payload);
+
+	if (op->chunked) {
+		s3_op_header(op, "Content-Encoding: aws-chunked");
+		s3_op_header(op, "x-amz-decoded-content-length: %s", decoded_length);
+
+		op->chunker = s3_chunker_start(op->handle, op->chunked == S3_CHUNKED_SIGNED ? &key : NULL,
+		    op->in, clk->amz, scope, sig, op->checksum_type);
+	}
+
+	s3_op_header(op, "Authorization: AWS4-HMAC-SHA256 Credential=%s/%s, SignedHeaders=%s, Signature=%s",
+	    s3->id, scope, signed_headers.p, sig);
+}
+
+/*
+ * aws-chunked bodies. The payload is cut into S3_IO_CHUNK_SIZE chunks,
+ * each framed as "<hex size>;chunk-signature=<sig>\r\n<data>\r\n" and
+ * ended by an empty chunk. A chunk's signature covers its data and the
+ * previous signature, the first chaining from the request's own, so the
+ * payload is signed in the same single pass that sends it.
+ *
+ * Unsigned chunks drop the ";chunk-signature=" part. Either way a
+ * checksum can be computed on the same pass and sent as a trailer
+ * after the empty chunk, signed like one more chunk when chunks are.
+ *
+ * A chunker and its frame buffer belong to the handle the request is
+ * sent on, allocated with its first chunked request and reused by the
+ * ones after.
+ */
+#define S3_CHUNK_HDR_MAX 96
+#define S3_CHUNK_TRAILER_MAX 256
+
+struct s3_chunker {
+	struct s3_source *src;
+	int sign;		/* chunks are signed with key */
+	s3_mac key;		/* signing key state for the request's scope */
+	char amzdate[32];
+	char scope[128];
+	char seed[2 * 32 + 1];	/* the request signature */
+	char prev[2 * 32 + 1];	/* signature of the last chunk framed */
+	struct s3_checksum checksum;	/* sent in the trailer, if any */
+	size_t sent;		/* payload bytes framed so far */
+	int last;		/* the final empty chunk has been framed */
+	size_t frame_pos;
+	size_t frame_end;
+	char frame[S3_CHUNK_HDR_MAX + S3_IO_CHUNK_SIZE + S3_CHUNK_TRAILER_MAX];
+};
+
+static size_t
+s3_chunk_framing(size_t k, int sign) {
+	char hex[32];
+
+	/* size, ";chunk-signature=", signature, CRLF, data, CRLF */
+	return snprintf(hex, sizeof (hex), "%zx", k) + (sign ? 17 + 64 : 0) + 2 + k + 2;
+}
+
+/* "x-amz-checksum-<name>:<base64>\r\n" and, if signed, its signature line */
+static size_t
+s3_chunk_trailer_length(int sign, enum s3_checksum_type trailer) {
+	struct s3_checksum ck;
+	char sum[S3_CHECKSUM_LENGTH];
+
+	if (trailer == S3_CHECKSUM_NONE)
+		return 0;
+	s3_checksum_init(&ck, trailer);
+	s3_checksum_base64(&ck, sum);
+
+	return 15 + strlen(s3_checksum_name(trailer)) + 1 + strlen(sum) + 2 +
+	    (sign ? 24 + 64 + 2 : 0);
+}
+
+/* Length on the wire of len payload bytes sent aws-chunked */
+size_t
+s3_chunked_length(size_t len, int sign, enum s3_checksum_type trailer) {
+	size_t n = 0;
+
+	for (; len > S3_IO_CHUNK_SIZE; len -= S3_IO_CHUNK_SIZE)
+		n += s3_chunk_framing(S3_IO_CHUNK_SIZE, sign);
+	if (len > 0)
+		n += s3_chunk_framing(len, sign);
+
+	return n + s3_chunk_framing(0, sign) + s3_chunk_trailer_length(sign, trailer);
+}
+
+/* Set up h's chunker for a request; NULL if it can't be allocated */
+static struct s3_chunker *
+s3_chunker_start(struct s3_handle *h, const s3_mac *key, struct s3_source *src,
+    const char *amzdate, const char *scope, const char *seed, enum s3_checksum_type trailer) {
+	struct s3_chunker *c = h->chunker;
+
+	if (c == NULL && (c = h->chunker = malloc(sizeof (struct s3_chunker))) == NULL)
+		return NULL;
+
+	c->sign = key != NULL;
+	if (key)
+		c->key = *key;
+	c->src = src;
+	strlcpy(c->amzdate, amzdate, sizeof (c->amzdate));
+	strlcpy(c->scope, scope, sizeof (c->scope));
+	strlcpy(c->seed, seed, sizeof (c->seed));
+	strlcpy(c->prev, seed, sizeof (c->prev));
+	s3_checksum_init(&c->checksum, trailer);
+	c->sent = 0;
+	c->last = 0;
+	c->frame_pos = c->frame_end = 0;
+
+	return c;
+}
+
+void
+s3_chunker_free(struct s3_chunker *c) {
+	free(c);
+}
+
+/* Chain a signature over sts_len bytes of sts into c->prev */
+static void
+s3_chunker_sign(struct s3_chunker *c, const char *kind, const char *data, size_t len) {
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+	unsigned int dlen;
+	char data_hex[2 * SHA256_DIGEST_LENGTH + 1];
+	char sts[512];
+	int sts_len;
+
+	s3_sha256(data, len, digest);
+	s3_hex(digest, SHA256_DIGEST_LENGTH, data_hex);
+
+	/* Chunks also carry the hash of their (empty) extensions */
+	if (strcmp(kind, "PAYLOAD") == 0)
+		sts_len = snprintf(sts, sizeof (sts), "AWS4-HMAC-SHA256-PAYLOAD\n%s\n%s\n%s\n%s\n%s",
+		    c->amzdate, c->scope, c->prev, S3_SHA256_EMPTY, data_hex);
+	else
+		sts_len = snprintf(sts, sizeof (sts), "AWS4-HMAC-SHA256-%s\n%s\n%s\n%s\n%s",
+		    kind, c->amzdate, c->scope, c->prev, data_hex);
+	dlen = s3_mac_run(&c->key, sts, sts_len, digest);
+	s3_hex(digest, dlen, c->prev);
+}
+
+/*
+ * The trailer after the empty chunk, written at p: the checksum line,
+ * its signature when chunks are signed, and the blank line ending the
+ * body.
+ */
+static size_t
+s3_chunker_trailer(struct s3_chunker *c, char *p) {
+	char sum[S3_CHECKSUM_LENGTH];
+	size_t n = 0;
+
+	if (c->checksum.type != S3_CHECKSUM_NONE) {
+		s3_checksum_base64(&c->checksum, sum);
+		n = snprintf(p, S3_CHUNK_TRAILER_MAX, "x-amz-checksum-%s:%s\n",
+		    s3_checksum_name(c->checksum.type), sum);
+		if (c->sign) {
+			s3_chunker_sign(c, "TRAILER", p, n);
+			n--;
+			n += snprintf(p + n, S3_CHUNK_TRAILER_MAX - n, "\r\nx-amz-trailer-signature:%s", c->prev);
+		} else
+			n--;
+		memcpy(p + n, "\r\n", 2);
+		n += 2;
+	}
+	memcpy(p + n, "\r\n", 2);
+
+	return n + 2;
+}
+
+/* Read, sign and frame the next chunk */
+static int
+s3_chunker_next(struct s3_chunker *c) {
+	char *data = c->frame + S3_CHUNK_HDR_MAX;
+	size_t left = c->src->len - c->sent;
+	size_t k = left < S3_IO_CHUNK_SIZE ? left : S3_IO_CHUNK_SIZE;
+	size_t have, r;
+	char hdr[S3_CHUNK_HDR_MAX];
+	int hdr_len;
+
+	/* Chunk sizes are fixed by the announced length, so fill it up */
+	for (have = 0; have < k; have += r) {
+		r = s3_source_curl_readfunc(data + have, 1, k - have, c->src);
+		if (r == 0 || r == CURL_READFUNC_ABORT)
+			return -1;
+	}
+	s3_checksum_update(&c->checksum, data, k);
+
+	if (c->sign) {
+		s3_chunker_sign(c, "PAYLOAD", data, k);
+		hdr_len = snprintf(hdr, sizeof (hdr), "%zx;chunk-signature=%s\r\n", k, c->prev);
+	} else
+		hdr_len = snprintf(hdr, sizeof (hdr), "%zx\r\n", k);
+	memcpy(data - hdr_len, hdr, hdr_len);
+
+	c->frame_pos = S3_CHUNK_HDR_MAX - hdr_len;
+	if (k > 0) {
+		memcpy(data + k, "\r\n", 2);
+		c->frame_end = S3_CHUNK_HDR_MAX + k + 2;
+	} else
+		c->frame_end = S3_CHUNK_HDR_MAX + s3_chunker_trailer(c, data);
+	c->sent += k;
+	c->last = k == 0;
+
+	return 0;
+}
+
+/* arg is NULL if the chunker couldn't be allocated, failing the request */
+size_t
+s3_chunker_curl_readfunc(void *ptr, size_t size, size_t nmemb, void *arg) {
+	struct s3_chunker *c = arg;
+	size_t max = size * nmemb;
+	size_t n = 0, k;
+
+	if (c == NULL)
+		return CURL_READFUNC_ABORT;
+
+	while (n < max) {
+		if (c->frame_pos == c->frame_end) {
+			if (c->last)
+				break;
+			if (s3_chunker_next(c) < 0)
+				return CURL_READFUNC_ABORT;
+		}
+		k = c->frame_end - c->frame_pos;
+		if (k > max - n)
+			k = max - n;
+		memcpy((char *)ptr + n, c->frame + c->frame_pos, k);
+		c->frame_pos += k;
+		n += k;
+	}
+
+	return n;
+}
+
+/* Only a rewind to the start is possible, re-signing from the seed */
+int
+s3_chunker_curl_seekfunc(void *arg, curl_off_t offset, int origin) {
+	struct s3_chunker *c = arg;
+
+	if (c == NULL || origin != SEEK_SET || offset != 0 ||
+	    s3_source_curl_seekfunc(c->src, 0, SEEK_SET) != CURL_SEEKFUNC_OK)
+		return CURL_SEEKFUNC_CANTSEEK;
+
+	strlcpy(c->prev, c->seed, sizeof (c->prev));
+	s3_checksum_init(&c->checksum, c->checksum.type);
+	c->sent = 0;
+	c->last = 0;
+	c->frame_pos = c->frame_end = 0;
+
+	return CURL_SEEKFUNC_OK;
+}
+
+/* Add the date and authorization headers to a request */
+void
+s3_op_sign(struct s3_op *op) {
+	if (op->s3->region)
+		s3_op_sign_v4(op);
+	else
+		s3_op_sign_v2(op);
+}
@@ -22,25 +22,53 @@
  * SOFTWARE.  
  */
 
+#include <ctype.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include "s3.h"
 #include "s3internal.h"
 
+/*
+ * Make room for at least extra more bytes (plus the terminating NUL).
+ * Returns -1 if memory couldn't be allocated.
+ */
+int
+s3_string_reserve(struct s3_string *s, size_t extra) {
+	size_t need = s->len + extra + 1;
+	size_t cap;
+	char *ptr;
+
+	if (need <= s->cap)
+		return 0;
+
+	/* Grow geometrically so a stream of small writes stays linear */
+	cap = s->cap * 2;
+	if (cap < need)
+		cap = need;
+
+	if ((ptr = realloc(s->ptr, cap)) == NULL)
+		return -1;
+	s->ptr = ptr;
+	s->cap = cap;
+
+	return 0;
+}
+
 size_t
 s3_string_curl_writefunc(void *ptr, size_t len, size_t nmemb, struct s3_string *s) {
-	size_t new_len = s->len + len  *nmemb;
-	s->ptr = realloc(s->ptr, new_len + 1);
-	if (s->ptr == NULL) {
+	size_t n = len * nmemb;
+
+	/* Returning short makes curl fail the transfer with CURLE_WRITE_ERROR */
+	if (s3_string_reserve(s, n) < 0) {
 		fprintf(stderr, "realloc() failed\n");
-		exit(EXIT_FAILURE);
+		return 0;
 	}
-	memcpy(s->ptr+s->len, ptr, len*nmemb);
-	s->ptr[new_len] = '\0';
-	s->len = new_len;
+	memcpy(s->ptr + s->len, ptr, n);
+	s->len += n;
+	s->ptr[s->len] = '\0';
 
-	return len*nmemb;
+	return n;
 }
 
 size_t
@@ -61,7 +89,8 @@ s3_string_init(void) {
 	s = malloc(sizeof (struct s3_string));
 	s->len = 0;
 	s->uploaded = 0;
-	s->ptr = malloc(s->len+1);
+	s->cap = 1;
+	s->ptr = malloc(s->cap);
 	if (s->ptr == NULL) {
 		fprintf(stderr, "malloc() failed\n");
 		exit(EXIT_FAILURE);
@@ -75,3 +104,67 @@ s3_string_free(struct s3_string *str) {
 	free(str->ptr);
 	free(str);
 }
+
+/*
+ * Percent-encode s into out, which may be NULL to only measure it.
+ * Returns the encoded length.
+ */
+static size_t
+s3_url_encode_keep(const char *s, int keep_slash, char *out) {
+	static const char hex[] = "0123456789ABCDEF";
+	size_t n = 0;
+
+	for (; *s; s++) {
+		unsigned char c = *s;
+
+		if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' || (c == '/' && keep_slash)) {
+			if (out)
+				out[n] = c;
+			n++;
+		} else {
+			if (out) {
+				out[n] = '%';
+				out[n + 1] = hex[c >> 4];
+				out[n + 2] = hex[c & 0xf];
+			}
+			n += 3;
+		}
+	}
+	if (out)
+		out[n] = '\0';
+
+	return n;
+}
+
+static char *
+s3_url_encode_alloc(const char *s, int keep_slash) {
+	char *out;
+
+	if ((out = malloc(s3_url_encode_keep(s, keep_slash, NULL) + 1)) == NULL)
+		return NULL;
+	s3_url_encode_keep(s, keep_slash, out);
+
+	return out;
+}
+
+/* Percent-encode s for use as a query string value */
+char *
+s3_url_encode(const char *s) {
+	return s3_url_encode_alloc(s, 0);
+}
+
+/* Percent-encode an object key for the request path, keeping the slashes */
+char *
+s3_url_encode_path(const char *s) {
+	return s3_url_encode_alloc(s, 1);
+}
+
+/* As above, into an arena */
+char *
+s3_arena_url_encode(struct s3_arena *a, const char *s, int keep_slash) {
+	char *out = s3_arena_alloc(a, s3_url_encode_keep(s, keep_slash, NULL) + 1);
+
+	s3_url_encode_keep(s, keep_slash, out);
+
+	return out;
+}
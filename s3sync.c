@@ -0,0 +1,717 @@
+/*
+ * Copyright (c) 2014, Ian Delahorne <ian.delahorne@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * s3sync - mirror a directory tree to a bucket prefix, or a prefix to a
+ * directory.
+ *
+ *	s3sync [options] dir s3://bucket/prefix		upload
+ *	s3sync [options] s3://bucket/prefix dir		download
+ *
+ * The bucket is listed on one thread while the directory is walked on
+ * another. Files missing on the other side, or of a different size, are
+ * copied outright. Where the sizes match, hash threads compute the
+ * file's ETag and compare it with the object's, handing anything that
+ * differs to the transfer threads as soon as it is known.
+ */
+
+#include "s3.h"
+
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fts.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SYNC_MULTIPART_THRESHOLD (16 * 1024 * 1024)
+#define SYNC_PART_SIZE (8 * 1024 * 1024)
+#define SYNC_PART_PARALLELISM 4	/* parts or ranges of one file in flight */
+#define SYNC_TEMP_SUFFIX ".s3sync."	/* downloads in progress */
+
+struct file {
+	char *path;		/* relative to the directory and the prefix */
+	size_t size;
+	char *etag;		/* the object's, unquoted; NULL for local files */
+};
+
+struct files {
+	struct file *v;
+	size_t n;
+	size_t cap;
+};
+
+/* A file and an object of the same size, to be compared by hashing */
+struct check {
+	struct file *local;
+	struct file *remote;
+};
+
+struct sync {
+	struct S3 *s3;
+	char *bucket;
+	char *prefix;		/* empty, or ending in "/" */
+	const char *dir;
+	int upload;
+	int dry_run;
+	int delete;
+	int quiet;
+	int concurrency;
+	int hashers;
+	size_t threshold;	/* multipart from this size up */
+	size_t part_size;
+	mode_t mode;		/* of downloaded files */
+
+	struct files local;
+	struct files remote;
+	int list_failed;
+
+	struct check *checks;
+	size_t nchecks;
+	size_t next_check;	/* next to claim */
+	struct file **removals;	/* on the destination side, with -d */
+	size_t nremovals;
+
+	/* Files to copy, from the source side; added to by the hash threads */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct file **queue;
+	size_t queued;
+	size_t next;		/* next to claim */
+	int hashing;		/* hash threads still running */
+
+	/* Totals, under lock */
+	size_t unchanged;
+	size_t copied;
+	size_t bytes;
+	size_t removed;
+	size_t failed;
+};
+
+static double
+now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+files_add(struct files *fs, const char *path, size_t size, const char *etag) {
+	struct file *f;
+
+	if (fs->n == fs->cap) {
+		fs->cap = fs->cap ? 2 * fs->cap : 1024;
+		fs->v = realloc(fs->v, fs->cap * sizeof (struct file));
+	}
+	f = &fs->v[fs->n++];
+	f->path = strdup(path);
+	f->size = size;
+	f->etag = etag ? strdup(etag) : NULL;
+}
+
+static void
+files_free(struct files *fs) {
+	size_t i;
+
+	for (i = 0; i < fs->n; i++) {
+		free(fs->v[i].path);
+		free(fs->v[i].etag);
+	}
+	free(fs->v);
+}
+
+static int
+file_cmp(const void *a, const void *b) {
+	return strcmp(((const struct file *)a)->path, ((const struct file *)b)->path);
+}
+
+static char *
+sync_local_path(struct sync *s, const char *path) {
+	char *p;
+
+	asprintf(&p, "%s/%s", s->dir, path);
+	return p;
+}
+
+static char *
+sync_key(struct sync *s, const char *path) {
+	char *p;
+
+	asprintf(&p, "%s%s", s->prefix, path);
+	return p;
+}
+
+/* Keys that would land outside the directory, or nowhere, are not downloaded */
+static int
+safe_path(const char *path) {
+	const char *p = path, *end;
+	size_t len;
+
+	if (*p == '/')
+		return 0;
+	for (;;) {
+		end = strchr(p, '/');
+		len = end ? (size_t)(end - p) : strlen(p);
+		if (len == 0 || (len == 1 && p[0] == '.') || (len == 2 && p[0] == '.' && p[1] == '.'))
+			return 0;
+		if (end == NULL)
+			return 1;
+		p = end + 1;
+	}
+}
+
+static void
+unquote(const char *etag, char *out, size_t size) {
+	size_t len;
+
+	if (*etag == '"')
+		etag++;
+	len = strlen(etag);
+	if (len > 0 && etag[len - 1] == '"')
+		len--;
+	if (len >= size)
+		len = size - 1;
+	memcpy(out, etag, len);
+	out[len] = '\0';
+}
+
+/* Runs on its own thread while the directory is walked */
+static void *
+sync_list(void *arg) {
+	struct sync *s = arg;
+	struct s3_list_options opts;
+	struct s3_list_parallel *lp;
+	struct s3_bucket_entry *e;
+	char etag[S3_ETAG_LENGTH];
+	const char *path;
+	size_t len;
+
+	memset(&opts, 0, sizeof (opts));
+	opts.prefix = s->prefix;
+	if ((lp = s3_list_parallel_new(s->s3, s->bucket, &opts, s->concurrency)) == NULL) {
+		s->list_failed = 1;
+		return NULL;
+	}
+
+	while ((e = s3_list_parallel_next(lp)) != NULL) {
+		path = e->key + strlen(s->prefix);
+		len = strlen(path);
+		if (e->is_prefix || len == 0 || path[len - 1] == '/')
+			;	/* a directory placeholder */
+		else if (!s->upload && !safe_path(path))
+			fprintf(stderr, "s3sync: skipping s3://%s/%s\n", s->bucket, e->key);
+		else {
+			unquote(e->etag ? e->etag : "", etag, sizeof (etag));
+			files_add(&s->remote, path, e->size, etag);
+		}
+		s3_bucket_entry_free(e);
+	}
+
+	s->list_failed = s3_list_parallel_error(lp);
+	s3_list_parallel_free(lp);
+
+	return NULL;
+}
+
+static int
+sync_walk(struct sync *s) {
+	char *roots[] = { (char *)s->dir, NULL };
+	size_t len = strlen(s->dir);
+	size_t skip = len - (s->dir[len - 1] == '/') + 1;	/* "dir/" */
+	FTS *fts;
+	FTSENT *ent;
+	int rc = 0;
+
+	if ((fts = fts_open(roots, FTS_PHYSICAL | FTS_NOCHDIR, NULL)) == NULL)
+		return -1;
+
+	while ((ent = fts_read(fts)) != NULL) {
+		switch (ent->fts_info) {
+		case FTS_F:
+			if (strstr(ent->fts_name, SYNC_TEMP_SUFFIX) == NULL)
+				files_add(&s->local, ent->fts_path + skip, ent->fts_statp->st_size, NULL);
+			break;
+		case FTS_DNR:
+		case FTS_ERR:
+		case FTS_NS:
+			fprintf(stderr, "s3sync: %s: %s\n", ent->fts_path, strerror(ent->fts_errno));
+			rc = -1;
+			break;
+		}
+	}
+	fts_close(fts);
+
+	return rc;
+}
+
+/*
+ * Match up the sorted files and objects: copy what is missing or of a
+ * different size, hash what might be the same, and with -d remove what
+ * only the destination has.
+ */
+static void
+sync_plan(struct sync *s) {
+	struct files *src = s->upload ? &s->local : &s->remote;
+	struct files *dst = s->upload ? &s->remote : &s->local;
+	struct file *l, *r;
+	size_t i = 0, j = 0;
+	int c;
+
+	s->queue = calloc(src->n + 1, sizeof (struct file *));
+	s->checks = calloc((src->n < dst->n ? src->n : dst->n) + 1, sizeof (struct check));
+	s->removals = calloc(dst->n + 1, sizeof (struct file *));
+
+	while (i < src->n || j < dst->n) {
+		c = i == src->n ? 1 : j == dst->n ? -1 : strcmp(src->v[i].path, dst->v[j].path);
+		if (c < 0)
+			s->queue[s->queued++] = &src->v[i++];
+		else if (c > 0) {
+			if (s->delete)
+				s->removals[s->nremovals++] = &dst->v[j];
+			j++;
+		} else if (src->v[i].size != dst->v[j].size) {
+			s->queue[s->queued++] = &src->v[i++];
+			j++;
+		} else {
+			l = s->upload ? &src->v[i] : &dst->v[j];
+			r = s->upload ? &dst->v[j] : &src->v[i];
+			s->checks[s->nchecks].local = l;
+			s->checks[s->nchecks++].remote = r;
+			i++;
+			j++;
+		}
+	}
+}
+
+/*
+ * An ETag with a part count is from a multipart upload, and can only
+ * match if it was made with the same part size as ours.
+ */
+static int
+sync_same(struct sync *s, struct check *c) {
+	char etag[S3_ETAG_LENGTH];
+	char *path;
+	int fd, same = 0;
+
+	path = sync_local_path(s, c->local->path);
+	if ((fd = open(path, O_RDONLY)) >= 0) {
+		if (s3_etag_fd(fd, c->local->size, strchr(c->remote->etag, '-') ? s->part_size : 0, etag) == 0)
+			same = strcasecmp(etag, c->remote->etag) == 0;
+		close(fd);
+	}
+	free(path);
+
+	return same;
+}
+
+static void *
+sync_hash(void *arg) {
+	struct sync *s = arg;
+	struct check *c;
+	size_t i;
+	int same;
+
+	while ((i = __sync_fetch_and_add(&s->next_check, 1)) < s->nchecks) {
+		c = &s->checks[i];
+		same = sync_same(s, c);
+
+		pthread_mutex_lock(&s->lock);
+		if (same)
+			s->unchanged++;
+		else {
+			s->queue[s->queued++] = s->upload ? c->local : c->remote;
+			pthread_cond_signal(&s->cond);
+		}
+		pthread_mutex_unlock(&s->lock);
+	}
+
+	pthread_mutex_lock(&s->lock);
+	if (--s->hashing == 0)
+		pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+
+	return NULL;
+}
+
+static int
+sync_upload(struct sync *s, struct file *f) {
+	struct s3_result r;
+	char *path, *key;
+	int fd, rc = -1;
+
+	path = sync_local_path(s, f->path);
+	key = sync_key(s, f->path);
+
+	if ((fd = open(path, O_RDONLY)) >= 0) {
+		if (f->size >= s->threshold)
+			rc = s3_put_multipart_fd(s->s3, s->bucket, key, NULL, fd, f->size, s->part_size, SYNC_PART_PARALLELISM);
+		else {
+			r = s3_put_fd(s->s3, s->bucket, key, NULL, fd, f->size);
+			rc = S3_RESULT_OK(&r) ? 0 : -1;
+		}
+		close(fd);
+	}
+	if (rc < 0)
+		fprintf(stderr, "s3sync: failed to upload %s\n", path);
+
+	free(path);
+	free(key);
+
+	return rc;
+}
+
+/* Create the directories leading up to path */
+static int
+mkdirs(char *path) {
+	char *p;
+
+	for (p = strchr(path + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		if (mkdir(path, 0777) < 0 && errno != EEXIST) {
+			*p = '/';
+			return -1;
+		}
+		*p = '/';
+	}
+	return 0;
+}
+
+/* Downloads go to a temporary file that replaces the old one once complete */
+static int
+sync_download(struct sync *s, struct file *f) {
+	struct s3_result r;
+	char *path, *key, *tmp;
+	int fd, rc = -1;
+
+	path = sync_local_path(s, f->path);
+	key = sync_key(s, f->path);
+	asprintf(&tmp, "%s" SYNC_TEMP_SUFFIX "XXXXXX", path);
+
+	if (mkdirs(tmp) == 0 && (fd = mkstemp(tmp)) >= 0) {
+		if (f->size >= s->threshold)
+			rc = s3_get_parallel(s->s3, s->bucket, key, fd, s->part_size, SYNC_PART_PARALLELISM);
+		else {
+			r = s3_get_fd(s->s3, s->bucket, key, fd);
+			rc = S3_RESULT_OK(&r) ? 0 : -1;
+		}
+		if (rc == 0 && (fchmod(fd, s->mode) < 0 || rename(tmp, path) < 0))
+			rc = -1;
+		close(fd);
+		if (rc < 0)
+			unlink(tmp);
+	}
+	if (rc < 0)
+		fprintf(stderr, "s3sync: failed to download %s\n", key);
+
+	free(path);
+	free(key);
+	free(tmp);
+
+	return rc;
+}
+
+/* Transfers files as the planning and the hash threads queue them */
+static void *
+sync_copy(void *arg) {
+	struct sync *s = arg;
+	struct file *f;
+	int rc;
+
+	for (;;) {
+		pthread_mutex_lock(&s->lock);
+		while (s->next == s->queued && s->hashing > 0)
+			pthread_cond_wait(&s->cond, &s->lock);
+		if (s->next == s->queued) {
+			pthread_mutex_unlock(&s->lock);
+			return NULL;
+		}
+		f = s->queue[s->next++];
+		pthread_mutex_unlock(&s->lock);
+
+		if (!s->quiet)
+			printf("%s %s\n", s->upload ? "upload" : "download", f->path);
+		if (s->dry_run)
+			rc = 0;
+		else
+			rc = s->upload ? sync_upload(s, f) : sync_download(s, f);
+
+		pthread_mutex_lock(&s->lock);
+		if (rc == 0) {
+			s->copied++;
+			s->bytes += f->size;
+		} else
+			s->failed++;
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+static void
+sync_remove(struct sync *s) {
+	struct s3_delete_error_head *errors;
+	struct s3_delete_error *e;
+	char **keys, *path;
+	size_t i;
+
+	for (i = 0; i < s->nremovals && !s->quiet; i++)
+		printf("delete %s\n", s->removals[i]->path);
+	if (s->dry_run) {
+		s->removed = s->nremovals;
+		return;
+	}
+
+	if (!s->upload) {
+		for (i = 0; i < s->nremovals; i++) {
+			path = sync_local_path(s, s->removals[i]->path);
+			if (unlink(path) < 0) {
+				fprintf(stderr, "s3sync: %s: %s\n", path, strerror(errno));
+				s->failed++;
+			} else
+				s->removed++;
+			free(path);
+		}
+		return;
+	}
+
+	keys = calloc(s->nremovals + 1, sizeof (char *));
+	for (i = 0; i < s->nremovals; i++)
+		keys[i] = sync_key(s, s->removals[i]->path);
+
+	errors = s3_delete_many(s->s3, s->bucket, (const char * const *)keys, s->nremovals, 1, s->concurrency);
+	s->removed = s->nremovals;
+	TAILQ_FOREACH(e, errors, list) {
+		fprintf(stderr, "s3sync: failed to delete %s: %s\n", e->key, e->code);
+		s->removed--;
+		s->failed++;
+	}
+	s3_delete_errors_free(errors);
+
+	for (i = 0; i < s->nremovals; i++)
+		free(keys[i]);
+	free(keys);
+}
+
+/* A size in bytes, with an optional k, m or g suffix */
+static size_t
+parse_size(const char *str) {
+	char *end;
+	size_t n = strtoull(str, &end, 10);
+
+	switch (*end) {
+	case 'g':
+	case 'G':
+		n *= 1024;
+		/* FALLTHROUGH */
+	case 'm':
+	case 'M':
+		n *= 1024;
+		/* FALLTHROUGH */
+	case 'k':
+	case 'K':
+		n *= 1024;
+	}
+	return n;
+}
+
+/* Split s3://bucket/prefix, making the prefix end in "/" */
+static int
+parse_url(struct sync *s, const char *url) {
+	const char *p;
+
+	if (strncmp(url, "s3://", 5) != 0)
+		return -1;
+	url += 5;
+	if ((p = strchr(url, '/')) == NULL)
+		p = url + strlen(url);
+	if (p == url)
+		return -1;
+
+	s->bucket = strndup(url, p - url);
+	if (*p == '/')
+		p++;
+	if (*p == '\0')
+		s->prefix = strdup("");
+	else
+		asprintf(&s->prefix, "%s%s", p, p[strlen(p) - 1] == '/' ? "" : "/");
+
+	return 0;
+}
+
+static void
+usage(void) {
+	fprintf(stderr, "Usage: s3sync [-dnq] [-c concurrency] [-j hashers] [-m threshold] [-p proxy] [-r region] [-s part_size] dir s3://bucket/prefix\n"
+	    "       s3sync [-dnq] [-c concurrency] [-j hashers] [-m threshold] [-p proxy] [-r region] [-s part_size] s3://bucket/prefix dir\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv) {
+	struct sync s;
+	struct stat st;
+	pthread_t lister, *hashers, *copiers;
+	char *proxy = NULL, *region = NULL, *id, *secret;
+	double start;
+	mode_t mask;
+	int ch, i, exists, walk_failed;
+
+	memset(&s, 0, sizeof (s));
+	s.concurrency = 16;
+	s.hashers = sysconf(_SC_NPROCESSORS_ONLN);
+	s.threshold = SYNC_MULTIPART_THRESHOLD;
+	s.part_size = SYNC_PART_SIZE;
+
+	while ((ch = getopt(argc, argv, "c:dj:m:np:qr:s:")) != -1) {
+		switch (ch) {
+		case 'c':
+			s.concurrency = atoi(optarg);
+			break;
+		case 'd':
+			s.delete = 1;
+			break;
+		case 'j':
+			s.hashers = atoi(optarg);
+			break;
+		case 'm':
+			s.threshold = parse_size(optarg);
+			break;
+		case 'n':
+			s.dry_run = 1;
+			break;
+		case 'p':
+			proxy = optarg;
+			break;
+		case 'q':
+			s.quiet = 1;
+			break;
+		case 'r':
+			region = optarg;
+			break;
+		case 's':
+			s.part_size = parse_size(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 2 || s.concurrency < 1 || s.hashers < 1)
+		usage();
+
+	if (strncmp(argv[0], "s3://", 5) != 0 && parse_url(&s, argv[1]) == 0) {
+		s.upload = 1;
+		s.dir = argv[0];
+	} else if (strncmp(argv[1], "s3://", 5) != 0 && parse_url(&s, argv[0]) == 0)
+		s.dir = argv[1];
+	else
+		usage();
+
+	/* Credentials can be left out when testing against a local s3mock */
+	id = getenv("AWS_ACCESS_KEY_ID");
+	secret = getenv("AWS_SECRET_KEY");
+	if ((id == NULL || secret == NULL) && proxy == NULL) {
+		fprintf(stderr, "Error: Environment variable AWS_ACCESS_KEY_ID or AWS_SECRET_KEY not set\n");
+		return 1;
+	}
+
+	exists = stat(s.dir, &st) == 0;
+	if (exists && !S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "s3sync: %s is not a directory\n", s.dir);
+		return 1;
+	}
+	if (!exists && (s.upload || errno != ENOENT || (!s.dry_run && mkdir(s.dir, 0777) < 0))) {
+		fprintf(stderr, "s3sync: %s: %s\n", s.dir, strerror(errno));
+		return 1;
+	}
+
+	mask = umask(0);
+	umask(mask);
+	s.mode = 0666 & ~mask;
+
+	if ((s.s3 = s3_init(id ? id : "s3sync", secret ? secret : "s3sync", "s3.amazonaws.com")) == NULL) {
+		fprintf(stderr, "s3sync: failed to set up the S3 context\n");
+		return 1;
+	}
+	s.s3->proxy = proxy;
+	s.s3->region = region;
+	pthread_mutex_init(&s.lock, NULL);
+	pthread_cond_init(&s.cond, NULL);
+
+	start = now();
+
+	pthread_create(&lister, NULL, sync_list, &s);
+	walk_failed = exists || !s.dry_run ? sync_walk(&s) < 0 : 0;
+	pthread_join(lister, NULL);
+	if (s.list_failed) {
+		fprintf(stderr, "s3sync: failed to list s3://%s/%s\n", s.bucket, s.prefix);
+		return 1;
+	}
+
+	qsort(s.local.v, s.local.n, sizeof (struct file), file_cmp);
+	qsort(s.remote.v, s.remote.n, sizeof (struct file), file_cmp);
+	sync_plan(&s);
+
+	hashers = calloc(s.hashers, sizeof (pthread_t));
+	copiers = calloc(s.concurrency, sizeof (pthread_t));
+	s.hashing = s.hashers;
+	for (i = 0; i < s.hashers; i++)
+		pthread_create(&hashers[i], NULL, sync_hash, &s);
+	for (i = 0; i < s.concurrency; i++)
+		pthread_create(&copiers[i], NULL, sync_copy, &s);
+	for (i = 0; i < s.hashers; i++)
+		pthread_join(hashers[i], NULL);
+	for (i = 0; i < s.concurrency; i++)
+		pthread_join(copiers[i], NULL);
+
+	/* Files that couldn't be seen would look deleted */
+	if (s.nremovals > 0 && walk_failed)
+		fprintf(stderr, "s3sync: not deleting anything, %s could not be read in full\n", s.dir);
+	else if (s.nremovals > 0)
+		sync_remove(&s);
+
+	printf("%zu files, %zu unchanged, %zu %s (%.1f MB), %zu deleted, %zu failed in %.1fs\n",
+	    s.upload ? s.local.n : s.remote.n, s.unchanged, s.copied, s.dry_run ? "to copy" : "copied",
+	    s.bytes / (1024.0 * 1024), s.removed, s.failed, now() - start);
+
+	free(hashers);
+	free(copiers);
+	free(s.queue);
+	free(s.checks);
+	free(s.removals);
+	files_free(&s.local);
+	files_free(&s.remote);
+	free(s.bucket);
+	free(s.prefix);
+	pthread_mutex_destroy(&s.lock);
+	pthread_cond_destroy(&s.cond);
+	s3_free(s.s3);
+
+	return s.failed > 0 || walk_failed;
+}
@@ -22,6 +22,8 @@
  * SOFTWARE.  
  */
 
+#include <string.h>
+
 #include "s3xml.h"
 
 static void
@@ -96,3 +98,35 @@ s3_execute_xpath_expr(const xmlDocPtr doc, const xmlChar *xpath_expr, void (*nod
 
 	xmlXPathFreeContext(xpath_ctx); 
 }
+
+static void
+s3_xml_first_text(xmlNodeSetPtr nodes, void *data) {
+	char **text = data;
+	xmlChar *value;
+
+	if (nodes == NULL || nodes->nodeNr == 0)
+		return;
+
+	value = xmlNodeGetContent(nodes->nodeTab[0]);
+	*text = strdup((const char *)value);
+	xmlFree(value);
+}
+
+/*
+ * Return the text content of the first node matching xpath_expr in a
+ * small response document, or NULL. The caller frees the result.
+ */
+char *
+s3_xml_find_text(const char *xml, size_t len, const char *xpath_expr) {
+	xmlDocPtr doc;
+	char *text = NULL;
+
+	doc = xmlReadMemory(xml, len, "noname.xml", NULL, 0);
+	if (doc == NULL)
+		return NULL;
+
+	s3_execute_xpath_expr(doc, (const xmlChar *)xpath_expr, s3_xml_first_text, &text);
+	xmlFreeDoc(doc);
+
+	return text;
+}
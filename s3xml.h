@@ -29,3 +29,4 @@
 
 
 void  s3_execute_xpath_expr(const xmlDocPtr doc, const xmlChar *xpath_expr, void (*nodeset_cb)(xmlNodeSetPtr, void *), void *cb_data);
+char * s3_xml_find_text(const char *xml, size_t len, const char *xpath_expr);